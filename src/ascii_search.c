@@ -0,0 +1,165 @@
+#include <stdint.h>
+#include "ascii_search.h"
+#include "cpu.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+static unsigned char ascii_tolower(unsigned char c)
+{
+	if (c >= 'A' && c <= 'Z') {
+		return c + ('a' - 'A');
+	}
+	return c;
+}
+
+/* Compare n bytes of str, lowercased, with those of lower. */
+static bool equal_lower(const char *str, const char *lower, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (ascii_tolower(str[i]) != (unsigned char)lower[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Search for needle from offset start, one position at a time. */
+static ssize_t search_scalar(
+		const char *haystack,
+		size_t start,
+		size_t len,
+		const char *needle,
+		size_t needle_len)
+{
+	for (size_t i = start; i + needle_len <= len; i++) {
+		if (equal_lower(&haystack[i], needle, needle_len)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+#ifdef __x86_64__
+
+/*
+ * Adding 0x80 - 'A' moves 'A' to 'Z' to the very bottom of the signed range,
+ * so the uppercase letters can be picked out with a single signed compare.
+ */
+static __m128i lower_sse2(__m128i x)
+{
+	__m128i shifted = _mm_add_epi8(x, _mm_set1_epi8((char)(0x80 - 'A')));
+	__m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(0x80 + 26)));
+	return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+[[gnu::target("avx2")]]
+static __m256i lower_avx2(__m256i x)
+{
+	__m256i shifted = _mm256_add_epi8(x, _mm256_set1_epi8((char)(0x80 - 'A')));
+	__m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x80 + 26)), shifted);
+	return _mm256_or_si256(x, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+/*
+ * Check the candidate positions in mask, returning the first at which the
+ * whole of needle is found, or -1. The first and last bytes are already known
+ * to match.
+ */
+static ssize_t check_candidates(
+		const char *haystack,
+		size_t i,
+		uint32_t mask,
+		const char *needle,
+		size_t needle_len)
+{
+	while (mask != 0) {
+		size_t pos = i + __builtin_ctz(mask);
+		if (needle_len <= 2 || equal_lower(&haystack[pos + 1], &needle[1], needle_len - 2)) {
+			return pos;
+		}
+		mask &= mask - 1;
+	}
+	return -1;
+}
+
+/*
+ * The loads for the last byte run needle_len - 1 bytes ahead of those for the
+ * first, so the vector loops stop while both are still within len, and leave
+ * the last few positions to search_scalar().
+ */
+static ssize_t search_sse2(const char *haystack, size_t len, const char *needle, size_t needle_len)
+{
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+	size_t i = 0;
+	for (; i + needle_len - 1 + 16 <= len; i += 16) {
+		__m128i a = lower_sse2(_mm_loadu_si128((const __m128i *)&haystack[i]));
+		__m128i b = lower_sse2(_mm_loadu_si128((const __m128i *)&haystack[i + needle_len - 1]));
+		uint32_t mask = _mm_movemask_epi8(
+				_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+		ssize_t pos = check_candidates(haystack, i, mask, needle, needle_len);
+		if (pos != -1) {
+			return pos;
+		}
+	}
+	return search_scalar(haystack, i, len, needle, needle_len);
+}
+
+[[gnu::target("avx2")]]
+static ssize_t search_avx2(const char *haystack, size_t len, const char *needle, size_t needle_len)
+{
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+	size_t i = 0;
+	for (; i + needle_len - 1 + 32 <= len; i += 32) {
+		__m256i a = lower_avx2(_mm256_loadu_si256((const __m256i *)&haystack[i]));
+		__m256i b = lower_avx2(_mm256_loadu_si256((const __m256i *)&haystack[i + needle_len - 1]));
+		uint32_t mask = _mm256_movemask_epi8(
+				_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+		ssize_t pos = check_candidates(haystack, i, mask, needle, needle_len);
+		if (pos != -1) {
+			return pos;
+		}
+	}
+	return search_scalar(haystack, i, len, needle, needle_len);
+}
+
+#endif /* __x86_64__ */
+
+ssize_t ascii_search(const char *haystack, size_t len, const char *needle, size_t needle_len)
+{
+	if (needle_len == 0) {
+		return 0;
+	}
+	if (needle_len > len) {
+		return -1;
+	}
+#ifdef __x86_64__
+	if (len - needle_len + 1 >= 32 && cpu_has_avx2()) {
+		return search_avx2(haystack, len, needle, needle_len);
+	}
+	return search_sse2(haystack, len, needle, needle_len);
+#else
+	return search_scalar(haystack, 0, len, needle, needle_len);
+#endif
+}
+
+bool ascii_starts_with(const char *str, size_t len, const char *prefix, size_t prefix_len)
+{
+	if (prefix_len > len) {
+		return false;
+	}
+	size_t i = 0;
+#ifdef __x86_64__
+	for (; i + 16 <= prefix_len; i += 16) {
+		__m128i a = lower_sse2(_mm_loadu_si128((const __m128i *)&str[i]));
+		__m128i b = _mm_loadu_si128((const __m128i *)&prefix[i]);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff) {
+			return false;
+		}
+	}
+#endif
+	return equal_lower(&str[i], &prefix[i], prefix_len - i);
+}
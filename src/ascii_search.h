@@ -0,0 +1,30 @@
+#ifndef ASCII_SEARCH_H
+#define ASCII_SEARCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Case-insensitive substring and prefix search of plain ASCII strings, which
+ * is what most of normal and prefix matching comes down to.
+ *
+ * The needle must already be lowercase. Only the haystack's ASCII letters
+ * are lowercased for comparison, and every other byte must match exactly.
+ *
+ * On x86-64, substring search compares the needle's first and last bytes
+ * against 16 positions of the haystack at once with SSE2, or 32 with AVX2
+ * where the CPU has it, and only checks the rest of the needle where both
+ * agree. Elsewhere, it's just a plain loop.
+ */
+
+/*
+ * Return the offset of the first occurrence of needle in the first len bytes
+ * of haystack, or -1 if there isn't one.
+ */
+ssize_t ascii_search(const char *haystack, size_t len, const char *needle, size_t needle_len);
+
+/* Whether the first len bytes of str start with prefix. */
+bool ascii_starts_with(const char *str, size_t len, const char *prefix, size_t prefix_len);
+
+#endif /* ASCII_SEARCH_H */
@@ -0,0 +1,115 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+#include "atomic_write.h"
+#include "log.h"
+#include "xmalloc.h"
+
+/*
+ * The temporary files that are being written, so that they're not left
+ * behind if we exit part way through, e.g. while a background refresh is
+ * still writing a cache. Each entry lives on the stack of the call writing
+ * it.
+ */
+struct pending_write {
+	const char *path;
+	struct pending_write *next;
+};
+
+static once_flag pending_once = ONCE_FLAG_INIT;
+static mtx_t pending_lock;
+static struct pending_write *pending;
+static pid_t pending_pid;
+
+static void remove_all_pending(void)
+{
+	/*
+	 * A forked child that exits shouldn't remove our files, and mustn't
+	 * touch the lock, which another thread may have held when it forked.
+	 */
+	if (getpid() != pending_pid) {
+		return;
+	}
+	mtx_lock(&pending_lock);
+	for (struct pending_write *p = pending; p != NULL; p = p->next) {
+		unlink(p->path);
+	}
+	pending = NULL;
+	mtx_unlock(&pending_lock);
+}
+
+static void init_pending(void)
+{
+	mtx_init(&pending_lock, mtx_plain);
+	pending_pid = getpid();
+	atexit(remove_all_pending);
+}
+
+static void add_pending(struct pending_write *entry)
+{
+	mtx_lock(&pending_lock);
+	entry->next = pending;
+	pending = entry;
+	mtx_unlock(&pending_lock);
+}
+
+static void remove_pending(struct pending_write *entry)
+{
+	mtx_lock(&pending_lock);
+	for (struct pending_write **p = &pending; *p != NULL; p = &(*p)->next) {
+		if (*p == entry) {
+			*p = entry->next;
+			break;
+		}
+	}
+	mtx_unlock(&pending_lock);
+}
+
+bool atomic_write(
+		const char *path,
+		bool (*write_contents)(FILE *file, void *data),
+		void *data)
+{
+	size_t len = strlen(path) + strlen(".XXXXXX") + 1;
+	char *tmp_path = xmalloc(len);
+	snprintf(tmp_path, len, "%s.XXXXXX", path);
+	call_once(&pending_once, init_pending);
+
+	errno = 0;
+	int fd = mkstemp(tmp_path);
+	FILE *file = fd == -1 ? NULL : fdopen(fd, "wb");
+	if (file == NULL) {
+		log_error("Failed to create \"%s\": %s\n", tmp_path, strerror(errno));
+		if (fd != -1) {
+			close(fd);
+			unlink(tmp_path);
+		}
+		free(tmp_path);
+		return false;
+	}
+	struct pending_write entry = { .path = tmp_path };
+	add_pending(&entry);
+
+	errno = 0;
+	bool ok = write_contents(file, data);
+	if (ferror(file)) {
+		ok = false;
+	}
+	if (fclose(file) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		log_error("Error writing \"%s\": %s\n", tmp_path, strerror(errno));
+	} else if (rename(tmp_path, path) == -1) {
+		log_error("Failed to rename \"%s\": %s\n", tmp_path, strerror(errno));
+		ok = false;
+	}
+	if (!ok) {
+		unlink(tmp_path);
+	}
+	remove_pending(&entry);
+	free(tmp_path);
+	return ok;
+}
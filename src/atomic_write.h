@@ -0,0 +1,21 @@
+#ifndef ATOMIC_WRITE_H
+#define ATOMIC_WRITE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Write a file by writing a temporary file alongside it, then renaming that
+ * into place, so that anything reading the file never sees it half written,
+ * even if we're stopped part way through.
+ *
+ * write_contents() is handed the temporary file to fill, and returns false on
+ * error, in which case the temporary file is removed and path is left as it
+ * was.
+ */
+bool atomic_write(
+		const char *path,
+		bool (*write_contents)(FILE *file, void *data),
+		void *data);
+
+#endif /* ATOMIC_WRITE_H */
@@ -1,16 +1,20 @@
-#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include "atomic_write.h"
 #include "compgen.h"
 #include "history.h"
 #include "log.h"
 #include "mkdirp.h"
+#include "radix_sort.h"
 #include "string_vec.h"
+#include "traverse.h"
 #include "xmalloc.h"
 
 static const char *default_cache_dir = ".cache";
@@ -51,20 +55,11 @@ static char *get_cache_path() {
 	return cache_name;
 }
 
-static void write_cache(const char *buffer, const char *filename)
+static bool write_commands(FILE *file, void *data)
 {
-	errno = 0;
-	FILE *fp = fopen(filename, "wb");
-	if (!fp) {
-		log_error("Failed to open cache file \"%s\": %s\n", filename, strerror(errno));
-		return;
-	}
-	size_t len = strlen(buffer);
-	errno = 0;
-	if (fwrite(buffer, 1, len, fp) != len) {
-		log_error("Error writing cache file \"%s\": %s\n", filename, strerror(errno));
-	}
-	fclose(fp);
+	const char *commands = data;
+	size_t len = strlen(commands);
+	return fwrite(commands, 1, len, file) == len;
 }
 
 static char *read_cache(const char *filename)
@@ -104,8 +99,12 @@ static char *read_cache(const char *filename)
 	return cache;
 }
 
-char *compgen_cached()
+char *compgen_cached(bool *stale)
 {
+	if (stale != NULL) {
+		*stale = false;
+	}
+
 	log_debug("Retrieving PATH.\n");
 	const char *env_path = getenv("PATH");
 	if (env_path == NULL) {
@@ -124,16 +123,17 @@ char *compgen_cached()
 	/* If the cache doesn't exist, create it and return */
 	errno = 0;
 	if (stat(cache_path, &sb) == -1) {
-		if (errno == ENOENT) {
-			char *commands = compgen();
-			if (mkdirp(cache_path)) {
-				write_cache(commands, cache_path);
-			}
-			free(cache_path);
-			return commands;
-		}
+		bool missing = errno == ENOENT;
 		free(cache_path);
-		return compgen();
+		if (!missing) {
+			return compgen();
+		}
+		if (stale != NULL) {
+			log_debug("No cache yet, creating it in the background.\n");
+			*stale = true;
+			return xstrdup("");
+		}
+		return compgen_update();
 	}
 
 	/* The cache exists, so check if it's still in date */
@@ -153,18 +153,39 @@ char *compgen_cached()
 	}
 	free(path);
 
-	char *commands;
-	if (out_of_date) {
-		log_debug("Cache out of date, updating.\n");
-		log_indent();
-		commands = compgen();
-		log_unindent();
-		write_cache(commands, cache_path);
-	} else {
+	char *commands = NULL;
+	if (!out_of_date) {
 		log_debug("Cache up to date, loading.\n");
 		commands = read_cache(cache_path);
+	} else if (stale != NULL) {
+		log_debug("Cache out of date, loading it while it's updated.\n");
+		commands = read_cache(cache_path);
+		*stale = true;
 	}
 	free(cache_path);
+	if (commands != NULL) {
+		return commands;
+	}
+	log_debug("Updating cache.\n");
+	log_indent();
+	commands = compgen_update();
+	log_unindent();
+	if (stale != NULL) {
+		*stale = false;
+	}
+	return commands;
+}
+
+char *compgen_update()
+{
+	char *commands = compgen();
+	char *cache_path = get_cache_path();
+	if (cache_path != NULL) {
+		if (mkdirp(cache_path)) {
+			atomic_write(cache_path, write_commands, commands);
+		}
+		free(cache_path);
+	}
 	return commands;
 }
 
@@ -184,24 +205,15 @@ char *compgen()
 
 	log_debug("Scanning PATH for binaries.\n");
 	while (path_entry != NULL) {
-		DIR *dir = opendir(path_entry);
-		if (dir != NULL) {
-			int fd = dirfd(dir);
-			struct dirent *d;
-			while ((d = readdir(dir)) != NULL) {
-				struct stat sb;
-				if (fstatat(fd, d->d_name, &sb, 0) == -1) {
-					continue;
-				}
-				if (faccessat(fd, d->d_name, X_OK, 0) == -1) {
-					continue;
+		struct traverse_dir dir;
+		if (traverse_open(&dir, AT_FDCWD, path_entry, false)) {
+			const struct traverse_entry *entry;
+			while ((entry = traverse_next(&dir)) != NULL) {
+				if (traverse_is_executable(&dir, entry)) {
+					string_vec_add(&programs, entry->d_name);
 				}
-				if (!S_ISREG(sb.st_mode)) {
-					continue;
-				}
-				string_vec_add(&programs, d->d_name);
 			}
-			closedir(dir);
+			traverse_close(&dir);
 		}
 		path_entry = strtok_r(NULL, ":", &saveptr);
 	}
@@ -229,13 +241,6 @@ char *compgen()
 	return buf;
 }
 
-static int cmpscorep(const void *restrict a, const void *restrict b)
-{
-	struct scored_string *restrict str1 = (struct scored_string *)a;
-	struct scored_string *restrict str2 = (struct scored_string *)b;
-	return str2->history_score - str1->history_score;
-}
-
 struct string_ref_vec compgen_history_sort(struct string_ref_vec *programs, struct history *history)
 {
 	log_debug("Moving already known programs to the front.\n");
@@ -252,14 +257,17 @@ struct string_ref_vec compgen_history_sort(struct string_ref_vec *programs, stru
 	 * For compgen, we expect there to be many more commands than history
 	 * entries. For speed, we therefore create a copy of the command
 	 * vector with all of the non-zero history score items pushed to the
-	 * front. We can then call qsort() on just the first few items of the
-	 * new vector, rather than on the entire original vector.
+	 * front. We can then sort just the first few items of the new
+	 * vector, rather than the entire original vector.
 	 */
 	struct string_ref_vec vec = {
 		.count = programs->count,
 		.size = programs->size,
-		.buf = xcalloc(programs->size, sizeof(*vec.buf))
+		.buf = xcalloc(programs->size, sizeof(*vec.buf)),
+		.folded = programs->folded
 	};
+	/* The keys' casefolded strings come along too. */
+	programs->folded = NULL;
 
 	size_t n_hist = 0;
 	for (ssize_t i = programs->count - 1; i >= 0; i--) {
@@ -270,6 +278,23 @@ struct string_ref_vec compgen_history_sort(struct string_ref_vec *programs, stru
 			n_hist++;
 		}
 	}
-	qsort(vec.buf, n_hist, sizeof(vec.buf[0]), cmpscorep);
+
+	/*
+	 * Most used first. The known programs were gathered back to front,
+	 * so they're read in reverse to keep ties in alphabetical order.
+	 */
+	uint64_t *keys = xmalloc(2 * n_hist * sizeof(*keys));
+	for (size_t i = 0; i < n_hist; i++) {
+		int64_t score = vec.buf[n_hist - 1 - i].history_score;
+		keys[i] = (uint64_t)(INT32_MAX - score) << 32 | i;
+	}
+	radix_sort(keys, &keys[n_hist], n_hist);
+	struct scored_string_ref *sorted = xmalloc(n_hist * sizeof(*sorted));
+	for (size_t i = 0; i < n_hist; i++) {
+		sorted[i] = vec.buf[n_hist - 1 - (keys[i] & UINT32_MAX)];
+	}
+	memcpy(vec.buf, sorted, n_hist * sizeof(*sorted));
+	free(sorted);
+	free(keys);
 	return vec;
 }
@@ -1,14 +1,25 @@
 #ifndef COMPGEN_H
 #define COMPGEN_H
 
+#include <stdbool.h>
 #include "history.h"
 #include "string_vec.h"
 
 [[nodiscard("memory leaked")]]
 char *compgen(void);
 
+/*
+ * Return the cached list of commands. If stale is NULL, the cache is updated
+ * first if need be. Otherwise, a missing or out of date cache is returned
+ * as-is (empty if missing) with *stale set, and the caller should arrange
+ * for compgen_update() to be called.
+ */
 [[nodiscard("memory leaked")]]
-char *compgen_cached(void);
+char *compgen_cached(bool *stale);
+
+/* Regenerate the list of commands, and write it to the cache. */
+[[nodiscard("memory leaked")]]
+char *compgen_update(void);
 
 [[nodiscard("memory leaked")]]
 struct string_ref_vec compgen_history_sort(struct string_ref_vec *programs, struct history *history);
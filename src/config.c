@@ -734,6 +734,24 @@ bool parse_option(struct sofi *sofi, const char *filename, size_t lineno, const
 		if (!err) {
 			sofi->drun_launch = val;
 		}
+	} else if (strcasecmp(option, "files-max-depth") == 0) {
+		uint32_t val = parse_uint32(filename, lineno, value, &err);
+		if (!err) {
+			sofi->files_options.max_depth = val == 0 ? SCAN_UNLIMITED : val;
+		}
+	} else if (strcasecmp(option, "files-max-count") == 0) {
+		uint32_t val = parse_uint32(filename, lineno, value, &err);
+		if (!err) {
+			sofi->files_options.max_files = val == 0 ? SCAN_UNLIMITED : val;
+		}
+	} else if (strcasecmp(option, "files-exclude") == 0) {
+		snprintf(sofi->files_exclude, N_ELEM(sofi->files_exclude), "%s", value);
+		sofi->files_options.exclude = sofi->files_exclude[0] == '\0' ? NULL : sofi->files_exclude;
+	} else if (strcasecmp(option, "files-ignore-files") == 0) {
+		bool val = parse_bool(filename, lineno, value, &err);
+		if (!err) {
+			sofi->files_options.ignore_files = val;
+		}
 	} else if (strcasecmp(option, "drun-print-exec") == 0) {
 		log_warning("drun-print-exec is deprecated, as it is now always true.\n"
 				"           This option may be removed in a future version of sofi.\n");
@@ -1014,6 +1032,9 @@ enum matching_algorithm parse_matching_algorithm(const char *filename, size_t li
 	if(strcasecmp(str, "prefix") == 0) {
 		return MATCHING_ALGORITHM_PREFIX;
 	}
+	if(strcasecmp(str, "approx") == 0) {
+		return MATCHING_ALGORITHM_APPROX;
+	}
 	PARSE_ERROR(filename, lineno, "Invalid matching algorithm \"%s\".\n", str);
 	if (err) {
 		*err = true;
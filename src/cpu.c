@@ -0,0 +1,10 @@
+#include "cpu.h"
+
+bool cpu_has_avx2(void)
+{
+#ifdef __x86_64__
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,13 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdbool.h>
+
+/*
+ * Whether the CPU we're running on has AVX2. On x86-64, SSE2 is always there,
+ * but anything built for AVX2 has to check for it first. Always false
+ * elsewhere.
+ */
+bool cpu_has_avx2(void);
+
+#endif /* CPU_H */
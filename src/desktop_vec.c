@@ -3,6 +3,7 @@
 #include "desktop_vec.h"
 #include "matching.h"
 #include "log.h"
+#include "pool.h"
 #include "string_vec.h"
 #include "unicode.h"
 #include "xmalloc.h"
@@ -27,6 +28,8 @@ void desktop_vec_destroy(struct desktop_vec *restrict vec)
 		free(vec->buf[i].name);
 		free(vec->buf[i].path);
 		free(vec->buf[i].keywords);
+		free(vec->buf[i].name_key.folded);
+		free(vec->buf[i].keywords_key.folded);
 	}
 	free(vec->buf);
 }
@@ -51,6 +54,14 @@ void desktop_vec_add(
 	vec->buf[vec->count].keywords = xstrdup(keywords);
 	vec->buf[vec->count].search_score = 0;
 	vec->buf[vec->count].history_score = 0;
+	match_key_init(
+			&vec->buf[vec->count].name_key,
+			vec->buf[vec->count].name,
+			strlen(vec->buf[vec->count].name));
+	match_key_init(
+			&vec->buf[vec->count].keywords_key,
+			vec->buf[vec->count].keywords,
+			strlen(vec->buf[vec->count].keywords));
 	vec->count++;
 }
 
@@ -122,16 +133,6 @@ static int cmpdesktopp(const void *restrict a, const void *restrict b)
 	return strcmp(d1->name, d2->name);
 }
 
-static int cmpscorep(const void *restrict a, const void *restrict b)
-{
-	struct scored_string *restrict str1 = (struct scored_string *)a;
-	struct scored_string *restrict str2 = (struct scored_string *)b;
-
-	int hist_diff = str2->history_score - str1->history_score;
-	int search_diff = str2->search_score - str1->search_score;
-	return hist_diff + search_diff;
-}
-
 void desktop_vec_sort(struct desktop_vec *restrict vec)
 {
 	qsort(vec->buf, vec->count, sizeof(vec->buf[0]), cmpdesktopp);
@@ -147,40 +148,103 @@ struct desktop_entry *desktop_vec_find_sorted(struct desktop_vec *restrict vec,
 	return bsearch(&tmp, vec->buf, vec->count, sizeof(vec->buf[0]), cmpdesktopp);
 }
 
-struct string_ref_vec desktop_vec_filter(
-		const struct desktop_vec *restrict vec,
-		const char *restrict substr,
-		enum matching_algorithm algorithm)
+struct filter_job {
+	const struct desktop_vec *vec;
+
+	/* The apps to check, or NULL for all of them. */
+	const uint32_t *indices;
+	size_t count;
+
+	const struct match_query *query;
+	size_t chunk_size;
+	struct result_vec *results;
+
+	/* How many results each chunk found. */
+	size_t *counts;
+
+	const atomic_bool *cancel;
+};
+
+static void filter_chunk(void *data, size_t i)
 {
-	struct string_ref_vec filt = string_ref_vec_create();
-	for (size_t i = 0; i < vec->count; i++) {
+	struct filter_job *job = data;
+	const struct desktop_vec *vec = job->vec;
+	struct result_vec *results = job->results;
+	size_t start = i * job->chunk_size;
+	size_t end = start + job->chunk_size;
+	if (end > job->count) {
+		end = job->count;
+	}
+	job->counts[i] = 0;
+	if (job->cancel != NULL && atomic_load(job->cancel)) {
+		return;
+	}
+	size_t count = 0;
+	for (size_t j = start; j < end; j++) {
+		uint32_t index = job->indices == NULL ? j : job->indices[j];
+		const struct desktop_entry *app = &vec->buf[index];
 		int32_t search_score;
-		search_score = match_words(algorithm, substr, vec->buf[i].name);
-		if (search_score != INT32_MIN) {
-			string_ref_vec_add(&filt, vec->buf[i].name);
-			/* Store the score of the match for later sorting. */
-			filt.buf[filt.count - 1].search_score = search_score;
-			filt.buf[filt.count - 1].history_score = vec->buf[i].history_score;
-		} else {
+		search_score = match_query_score(job->query, app->name, &app->name_key);
+		if (search_score == INT32_MIN) {
 			/* If we didn't match the name, check the keywords. */
-			search_score = match_words(algorithm, substr, vec->buf[i].keywords);
-			if (search_score != INT32_MIN) {
-				string_ref_vec_add(&filt, vec->buf[i].name);
-				/*
-				 * Arbitrary score addition to make name
-				 * matches preferred over keyword matches.
-				 */
-				filt.buf[filt.count - 1].search_score = search_score - 20;
-				filt.buf[filt.count - 1].history_score = vec->buf[i].history_score;
+			search_score = match_query_score(job->query, app->keywords, &app->keywords_key);
+			if (search_score == INT32_MIN) {
+				continue;
 			}
+			/*
+			 * Arbitrary score addition to make name matches
+			 * preferred over keyword matches.
+			 */
+			search_score -= 20;
 		}
+		results->index[start + count] = index;
+		results->score[start + count] = result_score(search_score, app->history_score);
+		results->bounded[start + count] = false;
+		count++;
+	}
+	job->counts[i] = count;
+}
+
+void desktop_vec_filter(
+		const struct desktop_vec *restrict vec,
+		const uint32_t *restrict indices,
+		size_t count,
+		const char *restrict substr,
+		enum matching_algorithm algorithm,
+		const atomic_bool *cancel,
+		struct result_vec *restrict results)
+{
+	result_vec_reserve(results, count);
+	struct match_query query = match_query_create(algorithm, substr);
+	size_t single_count;
+	struct filter_job job = {
+		.vec = vec,
+		.indices = indices,
+		.count = count,
+		.query = &query,
+		.chunk_size = count,
+		.results = results,
+		.counts = &single_count,
+		.cancel = cancel
+	};
+	size_t nchunks = 1;
+	if (count >= FILTER_PARALLEL_THRESHOLD) {
+		job.chunk_size = FILTER_CHUNK_SIZE;
+		nchunks = (count + job.chunk_size - 1) / job.chunk_size;
+		job.counts = xcalloc(nchunks, sizeof(*job.counts));
+		pool_run(nchunks, filter_chunk, &job);
+	} else {
+		filter_chunk(&job, 0);
 	}
 	/*
-	 * Sort the results by this search_score. This moves matches at the beginnings
-	 * of words to the front of the result list.
+	 * The results are ranked by search_score as they're needed, which
+	 * moves matches at the beginnings of words to the front of the list.
 	 */
-	qsort(filt.buf, filt.count, sizeof(filt.buf[0]), cmpscorep);
-	return filt;
+	result_vec_gather(results, job.counts, nchunks, job.chunk_size);
+	if (job.counts != &single_count) {
+		free(job.counts);
+	}
+	match_query_destroy(&query);
 }
 
 struct desktop_vec desktop_vec_load(FILE *file)
@@ -1,11 +1,13 @@
 #ifndef DESKTOP_VEC_H
 #define DESKTOP_VEC_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include "matching.h"
+#include "string_vec.h"
 
 struct desktop_entry {
 	char *id;
@@ -14,6 +16,8 @@ struct desktop_entry {
 	char *keywords;
 	uint32_t search_score;
 	uint32_t history_score;
+	struct match_key name_key;
+	struct match_key keywords_key;
 };
 
 struct desktop_vec {
@@ -35,10 +39,20 @@ void desktop_vec_add_file(struct desktop_vec *desktop, const char *id, const cha
 
 void desktop_vec_sort(struct desktop_vec *restrict vec);
 struct desktop_entry *desktop_vec_find_sorted(struct desktop_vec *restrict vec, const char *name);
-struct string_ref_vec desktop_vec_filter(
+
+/*
+ * Put the apps whose names or keywords match substr in results, as
+ * string_ref_vec_filter_subset() does. If indices is NULL, every app is
+ * checked, and count must be vec->count.
+ */
+void desktop_vec_filter(
 		const struct desktop_vec *restrict vec,
+		const uint32_t *restrict indices,
+		size_t count,
 		const char *restrict substr,
-		enum matching_algorithm algorithm);
+		enum matching_algorithm algorithm,
+		const atomic_bool *cancel,
+		struct result_vec *restrict results);
 
 struct desktop_vec desktop_vec_load(FILE *file);
 void desktop_vec_save(struct desktop_vec *restrict vec, FILE *restrict file);
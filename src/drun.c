@@ -5,14 +5,18 @@
 #include <glib.h>
 #include <gio/gdesktopappinfo.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include "atomic_write.h"
 #include "drun.h"
 #include "history.h"
 #include "log.h"
 #include "mkdirp.h"
+#include "radix_sort.h"
 #include "string_vec.h"
 #include "xmalloc.h"
 
@@ -214,8 +218,18 @@ struct desktop_vec drun_generate(void)
 	return apps;
 }
 
-struct desktop_vec drun_generate_cached()
+static bool write_apps(FILE *file, void *data)
 {
+	desktop_vec_save(data, file);
+	return true;
+}
+
+struct desktop_vec drun_generate_cached(bool *stale)
+{
+	if (stale != NULL) {
+		*stale = false;
+	}
+
 	log_debug("Retrieving cache location.\n");
 	char *cache_path = get_cache_path();
 
@@ -227,26 +241,17 @@ struct desktop_vec drun_generate_cached()
 	/* If the cache doesn't exist, create it and return */
 	errno = 0;
 	if (stat(cache_path, &sb) == -1) {
-		if (errno == ENOENT) {
-			struct desktop_vec apps = drun_generate();
-			if (!mkdirp(cache_path)) {
-				free(cache_path);
-				return apps;
-			}
-			errno = 0;
-			FILE *cache = fopen(cache_path, "wb");
-			if (cache == NULL) {
-				log_error("Error creating drun cache: %s.\n", strerror(errno));
-				free(cache_path);
-				return apps;
-			}
-			desktop_vec_save(&apps, cache);
-			fclose(cache);
-			free(cache_path);
-			return apps;
-		}
+		bool missing = errno == ENOENT;
 		free(cache_path);
-		return drun_generate();
+		if (!missing) {
+			return drun_generate();
+		}
+		if (stale != NULL) {
+			log_debug("No cache yet, creating it in the background.\n");
+			*stale = true;
+			return desktop_vec_create();
+		}
+		return drun_update();
 	}
 
 	log_debug("Retrieving application dirs.\n");
@@ -265,38 +270,53 @@ struct desktop_vec drun_generate_cached()
 	}
 	string_vec_destroy(&application_path);
 
-	struct desktop_vec apps;
-	if (out_of_date) {
+	if (out_of_date && stale == NULL) {
 		log_debug("Cache out of date, updating.\n");
+		free(cache_path);
 		log_indent();
-		apps = drun_generate();
+		struct desktop_vec apps = drun_update();
 		log_unindent();
-		errno = 0;
-		FILE *cache = fopen(cache_path, "wb");
-		if (cache == NULL) {
-			log_error("Failed to update cache: %s.\n", strerror(errno));
-		} else {
-			desktop_vec_save(&apps, cache);
-			fclose(cache);
-		}
+		return apps;
+	}
+
+	if (out_of_date) {
+		log_debug("Cache out of date, loading it while it's updated.\n");
+		*stale = true;
 	} else {
 		log_debug("Cache up to date, loading.\n");
-		errno = 0;
-		FILE *cache = fopen(cache_path, "rb");
-		if (cache == NULL) {
-			log_error("Failed to load cache: %s.\n", strerror(errno));
-			log_indent();
-			apps = drun_generate();
-			log_unindent();
-		} else {
-			apps = desktop_vec_load(cache);
-			fclose(cache);
+	}
+	struct desktop_vec apps;
+	errno = 0;
+	FILE *cache = fopen(cache_path, "rb");
+	if (cache == NULL) {
+		log_error("Failed to load cache: %s.\n", strerror(errno));
+		log_indent();
+		apps = drun_update();
+		log_unindent();
+		if (stale != NULL) {
+			*stale = false;
 		}
+	} else {
+		apps = desktop_vec_load(cache);
+		fclose(cache);
 	}
 	free(cache_path);
 	return apps;
 }
 
+struct desktop_vec drun_update()
+{
+	struct desktop_vec apps = drun_generate();
+	char *cache_path = get_cache_path();
+	if (cache_path != NULL) {
+		if (mkdirp(cache_path)) {
+			atomic_write(cache_path, write_apps, &apps);
+		}
+		free(cache_path);
+	}
+	return apps;
+}
+
 void drun_print(const char *filename, const char *terminal_command)
 {
 	GKeyFile *file = g_key_file_new();
@@ -393,13 +413,6 @@ void drun_launch(const char *filename)
 	g_object_unref(info);
 }
 
-static int cmpscorep(const void *restrict a, const void *restrict b)
-{
-	struct desktop_entry *restrict app1 = (struct desktop_entry *)a;
-	struct desktop_entry *restrict app2 = (struct desktop_entry *)b;
-	return app2->history_score - app1->history_score;
-}
-
 void drun_history_sort(struct desktop_vec *apps, struct history *history)
 {
 	log_debug("Moving already known apps to the front.\n");
@@ -410,5 +423,18 @@ void drun_history_sort(struct desktop_vec *apps, struct history *history)
 		}
 		res->history_score = history->buf[i].run_count;
 	}
-	qsort(apps->buf, apps->count, sizeof(apps->buf[0]), cmpscorep);
+
+	/* Most used first, with ties kept in alphabetical order. */
+	uint64_t *keys = xmalloc(2 * apps->count * sizeof(*keys));
+	for (size_t i = 0; i < apps->count; i++) {
+		keys[i] = (uint64_t)(UINT32_MAX - apps->buf[i].history_score) << 32 | i;
+	}
+	radix_sort(keys, &keys[apps->count], apps->count);
+	struct desktop_entry *sorted = xmalloc(apps->count * sizeof(*sorted));
+	for (size_t i = 0; i < apps->count; i++) {
+		sorted[i] = apps->buf[keys[i] & UINT32_MAX];
+	}
+	memcpy(apps->buf, sorted, apps->count * sizeof(*sorted));
+	free(sorted);
+	free(keys);
 }
@@ -1,12 +1,24 @@
 #ifndef DRUN_H
 #define DRUN_H
 
+#include <stdbool.h>
 #include "desktop_vec.h"
 #include "history.h"
 #include "string_vec.h"
 
 struct desktop_vec drun_generate(void);
-struct desktop_vec drun_generate_cached(void);
+
+/*
+ * Return the cached list of apps. If stale is NULL, the cache is updated
+ * first if need be. Otherwise, a missing or out of date cache is returned
+ * as-is (empty if missing) with *stale set, and the caller should arrange
+ * for drun_update() to be called.
+ */
+struct desktop_vec drun_generate_cached(bool *stale);
+
+/* Regenerate the list of apps, and write it to the cache. */
+struct desktop_vec drun_update(void);
+
 void drun_history_sort(struct desktop_vec *apps, struct history *history);
 void drun_print(const char *filename, const char *terminal_command);
 void drun_launch(const char *filename);
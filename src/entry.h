@@ -8,6 +8,7 @@
 #include <uchar.h>
 #include "color.h"
 #include "desktop_vec.h"
+#include "file_index.h"
 #include "history.h"
 #include "surface.h"
 #include "string_vec.h"
@@ -67,6 +68,12 @@ struct cursor_theme {
 	bool show;
 };
 
+/* The results of filtering against an earlier version of the input. */
+struct prefix_results {
+	char *query;
+	struct result_vec results;
+};
+
 struct entry {
 	struct entry_backend_harfbuzz harfbuzz;
 	struct entry_backend_pango pango;
@@ -85,9 +92,59 @@ struct entry {
 	uint32_t selection;
 	uint32_t first_result;
 	char *command_buffer;
-	struct string_ref_vec results;
 	struct string_ref_vec commands;
+
+	/* Indices into commands, or apps in drun mode, which line up. */
+	struct result_vec results;
+
+	/*
+	 * Whether the results are also saved as the longest prefix's, while
+	 * they stay on show for newer ones to be filtered from. The prefix
+	 * owns them then, apart from their ranking.
+	 */
+	bool results_shared;
+
+	/*
+	 * Whether the commands have been replaced, and their results are
+	 * still being filtered in the background. The result that was
+	 * selected before is kept to select again once they're in.
+	 */
+	bool reloading;
+	char *reload_selection;
+
+	/*
+	 * Results that are no longer needed, whose memory the next filter
+	 * reuses, rather than allocating its own on every keypress.
+	 */
+	struct result_vec spare_results;
+
+	/*
+	 * The input the results were filtered against, which lags behind the
+	 * input itself while newer ones are filtered in the background.
+	 */
+	char results_input[4*MAX_INPUT_LENGTH];
+
+	/*
+	 * The same, ready for asking the matcher where the selected result
+	 * matched, to highlight it.
+	 */
+	struct match_query results_query;
+	struct match_positions match_positions;
+
+	/*
+	 * Results for successively longer prefixes of the input, so that
+	 * deleting characters just means going back to an earlier set, and
+	 * an edit further back only has to refilter the results for the
+	 * longest prefix it leaves intact. The memory used by the results is
+	 * capped, by forgetting the shortest prefixes first.
+	 */
+	size_t prefix_count;
+	size_t prefix_size;
+	size_t prefix_bytes;
+	struct prefix_results *prefixes;
+
 	struct desktop_vec apps;
+	struct file_index file_index;
 	struct history history;
 	bool use_pango;
 
@@ -79,11 +79,64 @@ static void setup_hb_buffer(hb_buffer_t *buffer)
 	hb_buffer_set_cluster_level(buffer, HB_BUFFER_CLUSTER_LEVEL_MONOTONE_CHARACTERS);
 }
 
+/*
+ * Draw the glyphs of clusters containing any of the byte offsets in highlight
+ * with the given colour, and the rest with the current source. The clusters
+ * are in order, as the text is all left-to-right, and so are the offsets.
+ */
+static void show_highlighted_glyphs(
+		cairo_t *cr,
+		const cairo_glyph_t *cairo_glyphs,
+		const hb_glyph_info_t *glyph_info,
+		unsigned int glyph_count,
+		const struct match_positions *highlight,
+		struct color color)
+{
+	cairo_pattern_t *source = cairo_pattern_reference(cairo_get_source(cr));
+	size_t p = 0;
+	unsigned int start = 0;
+	bool run_highlighted = false;
+	for (unsigned int i = 0; i < glyph_count; i++) {
+		uint32_t cluster = glyph_info[i].cluster;
+		uint32_t cluster_end = UINT32_MAX;
+		for (unsigned int j = i + 1; j < glyph_count; j++) {
+			if (glyph_info[j].cluster != cluster) {
+				cluster_end = glyph_info[j].cluster;
+				break;
+			}
+		}
+		while (p < highlight->count && highlight->buf[p] < cluster) {
+			p++;
+		}
+		bool highlighted = p < highlight->count && highlight->buf[p] < cluster_end;
+		if (highlighted != run_highlighted) {
+			cairo_show_glyphs(cr, &cairo_glyphs[start], i - start);
+			if (highlighted) {
+				cairo_set_source_rgba(cr, color.r, color.g, color.b, color.a);
+			} else {
+				cairo_set_source(cr, source);
+			}
+			start = i;
+			run_highlighted = highlighted;
+		}
+	}
+	cairo_show_glyphs(cr, &cairo_glyphs[start], glyph_count - start);
+	cairo_set_source(cr, source);
+	cairo_pattern_destroy(source);
+}
+
 /*
  * Render a hb_buffer with Cairo, and return the extents of the rendered text
- * in Cairo units.
+ * in Cairo units. If highlight isn't NULL, the matched characters it lists
+ * are drawn in highlight_color.
  */
-static cairo_text_extents_t render_hb_buffer(cairo_t *cr, hb_font_extents_t *font_extents, hb_buffer_t *buffer, double scale)
+static cairo_text_extents_t render_hb_buffer_highlighted(
+		cairo_t *cr,
+		hb_font_extents_t *font_extents,
+		hb_buffer_t *buffer,
+		double scale,
+		const struct match_positions *highlight,
+		struct color highlight_color)
 {
 	cairo_save(cr);
 
@@ -117,7 +170,11 @@ static cairo_text_extents_t render_hb_buffer(cairo_t *cr, hb_font_extents_t *fon
 		y -= glyph_pos[i].y_advance / 64.0 / scale;
 	}
 
-	cairo_show_glyphs(cr, cairo_glyphs, glyph_count);
+	if (highlight == NULL || highlight->count == 0) {
+		cairo_show_glyphs(cr, cairo_glyphs, glyph_count);
+	} else {
+		show_highlighted_glyphs(cr, cairo_glyphs, glyph_info, glyph_count, highlight, highlight_color);
+	}
 
 	cairo_text_extents_t extents;
 	cairo_glyph_extents(cr, cairo_glyphs, glyph_count, &extents);
@@ -132,20 +189,42 @@ static cairo_text_extents_t render_hb_buffer(cairo_t *cr, hb_font_extents_t *fon
 	return extents;
 }
 
+static cairo_text_extents_t render_hb_buffer(cairo_t *cr, hb_font_extents_t *font_extents, hb_buffer_t *buffer, double scale)
+{
+	return render_hb_buffer_highlighted(cr, font_extents, buffer, scale, NULL, (struct color){0});
+}
+
 /*
  * Clear the harfbuzz buffer, shape some text and render it with Cairo,
- * returning the extents of the rendered text in Cairo units.
+ * returning the extents of the rendered text in Cairo units. Clusters are
+ * byte offsets into text, so they can be matched up with highlight.
  */
-static cairo_text_extents_t render_text(
+static cairo_text_extents_t render_text_highlighted(
 		cairo_t *cr,
 		struct entry_backend_harfbuzz *hb,
-		const char *text)
+		const char *text,
+		const struct match_positions *highlight,
+		struct color highlight_color)
 {
 	hb_buffer_clear_contents(hb->hb_buffer);
 	setup_hb_buffer(hb->hb_buffer);
 	hb_buffer_add_utf8(hb->hb_buffer, text, -1, 0, -1);
 	hb_shape(hb->hb_font, hb->hb_buffer, hb->hb_features, hb->num_features);
-	return render_hb_buffer(cr, &hb->hb_font_extents, hb->hb_buffer, hb->scale);
+	return render_hb_buffer_highlighted(
+			cr,
+			&hb->hb_font_extents,
+			hb->hb_buffer,
+			hb->scale,
+			highlight,
+			highlight_color);
+}
+
+static cairo_text_extents_t render_text(
+		cairo_t *cr,
+		struct entry_backend_harfbuzz *hb,
+		const char *text)
+{
+	return render_text_highlighted(cr, hb, text, NULL, (struct color){0});
 }
 
 /*
@@ -754,8 +833,12 @@ void entry_backend_harfbuzz_update(struct entry *entry)
 		if (index >= entry->results.count) {
 			break;
 		}
+		/* Results are only put in order as they're drawn. */
+		string_ref_vec_rank(&entry->commands, &entry->results_query, &entry->results, index + 1);
+		const struct scored_string_ref *ref =
+			&entry->commands.buf[result_vec_nth(&entry->results, index)];
 
-		const char *result = entry->results.buf[index].string;
+		const char *result = ref->string;
 		/*
 		 * If this isn't the selected result, or it is but we're not
 		 * doing any fancy match-highlighting, just print as normal.
@@ -814,13 +897,14 @@ void entry_backend_harfbuzz_update(struct entry *entry)
 			/*
 			 * For match highlighting, there's a bit more to do.
 			 *
-			 * We need to split the text into prematch, match and
-			 * postmatch chunks, and draw each separately.
+			 * The matcher tells us which characters it matched,
+			 * and any glyph cluster containing one of them is
+			 * drawn in the highlight colour. This works for fuzzy
+			 * matches too, which needn't be contiguous.
 			 *
-			 * However, we only want one background box around them
-			 * all (if we're drawing one). To do this, we have to
-			 * do the rendering part of render_text_themed()
-			 * manually, with the same method of:
+			 * To do this, we have to do the rendering part of
+			 * render_text_themed() manually, with the same method
+			 * of:
 			 * - Draw the text and measure it
 			 * - Draw the box
 			 * - Draw the text again
@@ -829,79 +913,26 @@ void entry_backend_harfbuzz_update(struct entry *entry)
 			 * as it's currently not possible for the selection to
 			 * do so.
 			 */
-			size_t prematch_len;
-			size_t postmatch_len;
-			char *prematch = xstrdup(result);
-			char *match = NULL;
-			char *postmatch = NULL;
-			if (entry->input_utf8_length > 0 && entry->selection_highlight_color.a != 0) {
-				char *match_pos = utf8_strcasestr(prematch, entry->input_utf8);
-				if (match_pos != NULL) {
-					match = xstrdup(result);
-					prematch_len = (match_pos - prematch);
-					prematch[prematch_len] = '\0';
-					postmatch_len = strlen(result) - prematch_len - entry->input_utf8_length;
-					if (postmatch_len > 0) {
-						postmatch = xstrdup(result);
-					}
-					match[entry->input_utf8_length + prematch_len] = '\0';
-				}
+			const struct match_positions *highlight = NULL;
+			if (entry->results_query.count > 0
+					&& match_query_positions(
+						&entry->results_query,
+						ref->string,
+						&ref->key,
+						&entry->match_positions) != INT32_MIN) {
+				highlight = &entry->match_positions;
 			}
 
 			for (int pass = 0; pass < 2; pass++) {
 				cairo_save(cr);
 				struct color color = entry->selection_theme.foreground_color;
 				cairo_set_source_rgba(cr, color.r, color.g, color.b, color.a);
-
-				cairo_text_extents_t subextents = render_text(cr, &entry->harfbuzz, prematch);
-				extents = subextents;
-
-				if (match != NULL) {
-					cairo_translate(cr, subextents.x_advance, 0);
-					color = entry->selection_highlight_color;
-					cairo_set_source_rgba(cr, color.r, color.g, color.b, color.a);
-
-					subextents = render_text(cr, &entry->harfbuzz, &match[prematch_len]);
-
-					if (prematch_len == 0) {
-						extents = subextents;
-					} else {
-						/*
-						 * This calculation is a little
-						 * complex, but it's basically:
-						 *
-						 * (distance from leftmost pixel of
-						 * prematch to logical end of prematch)
-						 * 
-						 * +
-						 *
-						 * (distance from logical start of match
-						 * to rightmost pixel of match).
-						 */
-						extents.width = extents.x_advance
-							- extents.x_bearing
-							+ subextents.x_bearing
-							+ subextents.width;
-						extents.x_advance += subextents.x_advance;
-					}
-				}
-
-				if (postmatch != NULL) {
-					cairo_translate(cr, subextents.x_advance, 0);
-					color = entry->selection_theme.foreground_color;
-					cairo_set_source_rgba(cr, color.r, color.g, color.b, color.a);
-					subextents = render_text(
-							cr,
-							&entry->harfbuzz,
-							&postmatch[entry->input_utf8_length + prematch_len]);
-
-					extents.width = extents.x_advance
-						- extents.x_bearing
-						+ subextents.x_bearing
-						+ subextents.width;
-					extents.x_advance += subextents.x_advance;
-				}
-
+				extents = render_text_highlighted(
+						cr,
+						&entry->harfbuzz,
+						result,
+						highlight,
+						entry->selection_highlight_color);
 				cairo_restore(cr);
 
 				if (entry->selection_theme.background_color.a == 0) {
@@ -915,14 +946,6 @@ void entry_backend_harfbuzz_update(struct entry *entry)
 					render_text_background(cr, entry, extents, &entry->selection_theme);
 				}
 			}
-
-			free(prematch);
-			if (match != NULL) {
-				free(match);
-			}
-			if (postmatch != NULL) {
-				free(postmatch);
-			}
 		}
 	}
 	entry->num_results_drawn = i;
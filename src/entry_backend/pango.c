@@ -309,6 +309,43 @@ static bool size_overflows(struct entry *entry, uint32_t width, uint32_t height)
 	return false;
 }
 
+/*
+ * Add to base, which may be NULL, colouring the characters of str at the given
+ * byte offsets, with adjacent ones joined up into a single run.
+ */
+static PangoAttrList *highlight_attributes(
+		PangoAttrList *base,
+		const char *str,
+		const struct match_positions *positions,
+		struct color color)
+{
+	PangoAttrList *attrs = base != NULL ? pango_attr_list_copy(base) : pango_attr_list_new();
+	size_t len = strlen(str);
+	size_t i = 0;
+	while (i < positions->count && positions->buf[i] < len) {
+		uint32_t start = positions->buf[i++];
+		uint32_t end = utf8_next_char(&str[start]) - str;
+		while (i < positions->count && positions->buf[i] == end && end < len) {
+			end = utf8_next_char(&str[end]) - str;
+			i++;
+		}
+
+		PangoAttribute *attr = pango_attr_foreground_new(
+				color.r * 65535,
+				color.g * 65535,
+				color.b * 65535);
+		attr->start_index = start;
+		attr->end_index = end;
+		pango_attr_list_insert(attrs, attr);
+
+		attr = pango_attr_foreground_alpha_new(color.a * 65535);
+		attr->start_index = start;
+		attr->end_index = end;
+		pango_attr_list_insert(attrs, attr);
+	}
+	return attrs;
+}
+
 /*
  * This is pretty much a direct translation of the corresponding function in
  * the harfbuzz backend. As that's the one that I care about most, there are
@@ -410,11 +447,15 @@ void entry_backend_pango_update(struct entry *entry)
 		if (index >= entry->results.count) {
 			break;
 		}
+		/* Results are only put in order as they're drawn. */
+		string_ref_vec_rank(&entry->commands, &entry->results_query, &entry->results, index + 1);
+		const struct scored_string_ref *ref =
+			&entry->commands.buf[result_vec_nth(&entry->results, index)];
 
 		const char *str;
 		char formatted_str[PATH_MAX * 2];
 		if (i < entry->results.count) {
-			str = entry->results.buf[index].string;
+			str = ref->string;
 			
 			/* Check if this is a file entry with our special format */
 			const char *separator = strstr(str, "|||");
@@ -484,20 +525,29 @@ void entry_backend_pango_update(struct entry *entry)
 				}
 			}
 		} else {
-			ssize_t prematch_len = -1;
-			ssize_t postmatch_len = -1;
-			size_t match_len = entry->input_utf8_length;
-			PangoRectangle ink_subrect;
-			PangoRectangle logical_subrect;
-			if (entry->input_utf8_length > 0 && entry->selection_highlight_color.a != 0) {
-				char *match_pos = utf8_strcasestr(str, entry->input_utf8);
-				if (match_pos != NULL) {
-					prematch_len = (match_pos - str);
-					postmatch_len = strlen(str) - prematch_len - match_len;
-					if (postmatch_len <= 0) {
-						postmatch_len = -1;
-					}
+			/*
+			 * Colour the characters the matcher says it matched,
+			 * and let Pango work out which glyphs they became.
+			 * The layout's own attributes (for font features) are
+			 * put back afterwards.
+			 */
+			PangoAttrList *attrs = NULL;
+			PangoAttrList *base_attrs = pango_layout_get_attributes(layout);
+			if (entry->results_query.count > 0
+					&& match_query_positions(
+						&entry->results_query,
+						ref->string,
+						&ref->key,
+						&entry->match_positions) != INT32_MIN) {
+				attrs = highlight_attributes(
+						base_attrs,
+						str,
+						&entry->match_positions,
+						entry->selection_highlight_color);
+				if (base_attrs != NULL) {
+					pango_attr_list_ref(base_attrs);
 				}
+				pango_layout_set_attributes(layout, attrs);
 			}
 
 			for (int pass = 0; pass < 2; pass++) {
@@ -505,48 +555,10 @@ void entry_backend_pango_update(struct entry *entry)
 				color = entry->selection_theme.foreground_color;
 				cairo_set_source_rgba(cr, color.r, color.g, color.b, color.a);
 
-				pango_layout_set_text(layout, str, prematch_len);
+				pango_layout_set_text(layout, str, -1);
 				pango_cairo_update_layout(cr, layout);
 				pango_cairo_show_layout(cr, layout);
-				pango_layout_get_pixel_extents(entry->pango.layout, &ink_subrect, &logical_subrect);
-				ink_rect = ink_subrect;
-				logical_rect = logical_subrect;
-
-				if (prematch_len != -1) {
-					cairo_translate(cr, logical_subrect.x + logical_subrect.width, 0);
-					color = entry->selection_highlight_color;
-					cairo_set_source_rgba(cr, color.r, color.g, color.b, color.a);
-					pango_layout_set_text(layout, &str[prematch_len], match_len);
-					pango_cairo_update_layout(cr, layout);
-					pango_cairo_show_layout(cr, layout);
-					pango_layout_get_pixel_extents(entry->pango.layout, &ink_subrect, &logical_subrect);
-					if (prematch_len == 0) {
-						ink_rect = ink_subrect;
-						logical_rect = logical_subrect;
-					} else {
-						ink_rect.width = logical_rect.width
-							- ink_rect.x
-							+ ink_subrect.x
-							+ ink_subrect.width;
-						logical_rect.width += logical_subrect.x + logical_subrect.width;
-					}
-				}
-
-				if (postmatch_len != -1) {
-					cairo_translate(cr, logical_subrect.x + logical_subrect.width, 0);
-					color = entry->selection_theme.foreground_color;
-					cairo_set_source_rgba(cr, color.r, color.g, color.b, color.a);
-					pango_layout_set_text(layout, &str[prematch_len + match_len], -1);
-					pango_cairo_update_layout(cr, layout);
-					pango_cairo_show_layout(cr, layout);
-					pango_layout_get_pixel_extents(entry->pango.layout, &ink_subrect, &logical_subrect);
-					ink_rect.width = logical_rect.width
-						- ink_rect.x
-						+ ink_subrect.x
-						+ ink_subrect.width;
-					logical_rect.width += logical_subrect.x + logical_subrect.width;
-
-				}
+				pango_layout_get_pixel_extents(entry->pango.layout, &ink_rect, &logical_rect);
 
 				cairo_restore(cr);
 
@@ -571,6 +583,13 @@ void entry_backend_pango_update(struct entry *entry)
 					cairo_restore(cr);
 				}
 			}
+			if (attrs != NULL) {
+				pango_layout_set_attributes(layout, base_attrs);
+				pango_attr_list_unref(attrs);
+				if (base_attrs != NULL) {
+					pango_attr_list_unref(base_attrs);
+				}
+			}
 		}
 	}
 	entry->num_results_drawn = i;
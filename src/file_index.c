@@ -0,0 +1,570 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "atomic_write.h"
+#include "file_index.h"
+#include "log.h"
+#include "unicode.h"
+#include "xmalloc.h"
+
+void file_index_builder_init(struct file_index_builder *builder)
+{
+	builder->count = 0;
+	builder->size = 128;
+	builder->records = xcalloc(builder->size, sizeof(*builder->records));
+	builder->dir_count = 0;
+	builder->dir_size = 16;
+	builder->dirs = xcalloc(builder->dir_size, sizeof(*builder->dirs));
+	builder->strings_len = 0;
+	builder->strings_size = 4096;
+	builder->strings = xmalloc(builder->strings_size);
+	builder->app_count = 0;
+	builder->visible_count = SIZE_MAX;
+	builder->max_depth = UINT32_MAX;
+	builder->max_files = UINT32_MAX;
+	builder->exclude = FILE_INDEX_NO_EXCLUDE;
+	builder->flags = 0;
+	builder->trigrams = false;
+}
+
+void file_index_builder_destroy(struct file_index_builder *builder)
+{
+	free(builder->records);
+	free(builder->dirs);
+	free(builder->strings);
+	builder->records = NULL;
+	builder->dirs = NULL;
+	builder->strings = NULL;
+	builder->count = 0;
+	builder->dir_count = 0;
+	builder->strings_len = 0;
+}
+
+/*
+ * Make room for a string of len bytes (including the NUL) at the end of the
+ * strings section, returning where it should go.
+ */
+static char *reserve_string(struct file_index_builder *builder, size_t len, uint32_t *offset)
+{
+	if (builder->strings_len + len > UINT32_MAX) {
+		return NULL;
+	}
+	while (builder->strings_len + len > builder->strings_size) {
+		builder->strings_size *= 2;
+		builder->strings = xrealloc(builder->strings, builder->strings_size);
+	}
+	*offset = builder->strings_len;
+	builder->strings_len += len;
+	return &builder->strings[*offset];
+}
+
+/* Copy str into the strings section, returning its offset. */
+static bool add_string(struct file_index_builder *builder, const char *str, uint32_t *offset)
+{
+	size_t len = strlen(str) + 1;
+	char *dest = reserve_string(builder, len, offset);
+	if (dest == NULL) {
+		return false;
+	}
+	memcpy(dest, str, len);
+	return true;
+}
+
+/*
+ * Names that aren't plain ASCII are followed by their casefolded form, and
+ * every name's signature goes in its record, so that neither has to be
+ * worked out again for every search. Returns the flag to add to the record's
+ * name_len, and the signature.
+ */
+static bool add_folded(
+		struct file_index_builder *builder,
+		const char *name,
+		size_t name_len,
+		uint32_t *flag,
+		uint64_t *sig)
+{
+	struct match_key key;
+	match_key_init(&key, name, name_len);
+	*flag = 0;
+	*sig = key.sig;
+	if (key.folded == NULL) {
+		return true;
+	}
+	uint32_t offset;
+	bool ret = add_string(builder, key.folded, &offset);
+	free(key.folded);
+	*flag = FILE_INDEX_FOLDED;
+	return ret;
+}
+
+static void add_record(struct file_index_builder *builder, uint32_t offset, size_t name_len, uint64_t sig)
+{
+	if (builder->count == builder->size) {
+		builder->size *= 2;
+		builder->records = xrealloc(
+				builder->records,
+				builder->size * sizeof(builder->records[0]));
+	}
+	builder->records[builder->count].offset = offset;
+	builder->records[builder->count].name_len = name_len;
+	builder->records[builder->count].sig = sig;
+	builder->count++;
+	if (builder->dir_count > 0) {
+		builder->dirs[builder->dir_count - 1].file_count++;
+	}
+}
+
+bool file_index_builder_add(struct file_index_builder *builder, const char *str, size_t name_len)
+{
+	uint32_t offset;
+	uint32_t flag;
+	uint64_t sig;
+	if (builder->count == UINT32_MAX
+			|| name_len >= FILE_INDEX_FOLDED
+			|| !add_string(builder, str, &offset)
+			|| !add_folded(builder, str, name_len, &flag, &sig)) {
+		return false;
+	}
+	add_record(builder, offset, name_len | flag, sig);
+	return true;
+}
+
+bool file_index_builder_add_file(struct file_index_builder *builder, const char *path, const char *name)
+{
+	size_t name_len = strlen(name);
+	size_t path_len = strlen(path);
+	uint32_t offset;
+	char *dest = NULL;
+	if (builder->count < UINT32_MAX) {
+		dest = reserve_string(builder, name_len + 3 + path_len + 1 + name_len + 1, &offset);
+	}
+	if (dest == NULL) {
+		return false;
+	}
+	memcpy(dest, name, name_len);
+	dest += name_len;
+	memcpy(dest, "|||", 3);
+	dest += 3;
+	memcpy(dest, path, path_len);
+	dest += path_len;
+	*dest++ = '/';
+	memcpy(dest, name, name_len + 1);
+	uint32_t flag;
+	uint64_t sig;
+	if (!add_folded(builder, name, name_len, &flag, &sig)) {
+		return false;
+	}
+	add_record(builder, offset, name_len | flag, sig);
+	return true;
+}
+
+void file_index_builder_end_apps(struct file_index_builder *builder)
+{
+	builder->app_count = builder->count;
+}
+
+uint32_t file_index_builder_add_dir(
+		struct file_index_builder *builder,
+		const char *path,
+		const struct file_index_dir *dir)
+{
+	uint32_t offset;
+	if (builder->dir_count == UINT32_MAX - 1 || !add_string(builder, path, &offset)) {
+		return FILE_INDEX_NO_PARENT;
+	}
+	if (builder->dir_count == builder->dir_size) {
+		builder->dir_size *= 2;
+		builder->dirs = xrealloc(
+				builder->dirs,
+				builder->dir_size * sizeof(builder->dirs[0]));
+	}
+	struct file_index_dir *new = &builder->dirs[builder->dir_count];
+	*new = *dir;
+	new->path = offset;
+	new->first_file = builder->count;
+	new->file_count = 0;
+	return builder->dir_count++;
+}
+
+void file_index_builder_set_visible(struct file_index_builder *builder, size_t count)
+{
+	builder->visible_count = builder->app_count + count;
+}
+
+void file_index_builder_set_options(
+		struct file_index_builder *builder,
+		uint32_t max_depth,
+		uint32_t max_files,
+		const char *exclude,
+		uint32_t flags)
+{
+	builder->max_depth = max_depth;
+	builder->max_files = max_files;
+	builder->exclude = FILE_INDEX_NO_EXCLUDE;
+	if (exclude != NULL && exclude[0] != '\0') {
+		uint32_t offset;
+		if (add_string(builder, exclude, &offset)) {
+			builder->exclude = offset;
+		}
+	}
+	builder->flags = flags;
+}
+
+void file_index_builder_set_trigrams(struct file_index_builder *builder, bool trigrams)
+{
+	builder->trigrams = trigrams;
+}
+
+/* Check the header and set up pointers to each section. */
+static bool file_index_open(struct file_index *index)
+{
+	const char *data = index->data;
+	size_t size = index->size;
+
+	if (size < sizeof(struct file_index_header)) {
+		return false;
+	}
+	const struct file_index_header *header = (const struct file_index_header *)data;
+	if (memcmp(header->magic, FILE_INDEX_MAGIC, sizeof(header->magic)) != 0
+			|| header->version != FILE_INDEX_VERSION) {
+		log_debug("File index is from a different version, ignoring.\n");
+		return false;
+	}
+
+	if (header->records_offset % alignof(struct file_index_record) != 0
+			|| header->records_offset > size
+			|| header->total > (size - header->records_offset) / sizeof(struct file_index_record)
+			|| header->count > header->total
+			|| header->app_count > header->count
+			|| header->dirs_offset % alignof(struct file_index_dir) != 0
+			|| header->dirs_offset > size
+			|| header->dir_count > (size - header->dirs_offset) / sizeof(struct file_index_dir)
+			|| header->strings_offset > size
+			|| header->strings_size > size - header->strings_offset
+			|| (header->exclude != FILE_INDEX_NO_EXCLUDE
+				&& header->exclude >= header->strings_size)
+			|| header->trigrams_offset % alignof(struct trigram_entry) != 0
+			|| header->trigrams_offset > size
+			|| header->trigram_count > (size - header->trigrams_offset) / sizeof(struct trigram_entry)
+			|| header->postings_offset > size
+			|| header->postings_size > size - header->postings_offset) {
+		log_error("File index is corrupt.\n");
+		return false;
+	}
+
+	/*
+	 * As long as the strings section ends with a NUL and every record
+	 * points inside it, no string can run off the end of the mapping.
+	 */
+	const char *strings = &data[header->strings_offset];
+	const struct file_index_record *records =
+		(const struct file_index_record *)&data[header->records_offset];
+	const struct file_index_dir *dirs =
+		(const struct file_index_dir *)&data[header->dirs_offset];
+	if ((header->total > 0 || header->dir_count > 0 || header->exclude != FILE_INDEX_NO_EXCLUDE)
+			&& (header->strings_size == 0
+				|| strings[header->strings_size - 1] != '\0')) {
+		log_error("File index is corrupt.\n");
+		return false;
+	}
+	for (size_t i = 0; i < header->total; i++) {
+		uint32_t name_len = records[i].name_len & ~FILE_INDEX_FOLDED;
+		if (records[i].offset >= header->strings_size
+				|| name_len >= header->strings_size - records[i].offset) {
+			log_error("File index is corrupt.\n");
+			return false;
+		}
+		if (records[i].name_len & FILE_INDEX_FOLDED) {
+			const char *str = &strings[records[i].offset];
+			if (strlen(str) + 1 >= header->strings_size - records[i].offset) {
+				log_error("File index is corrupt.\n");
+				return false;
+			}
+		}
+	}
+	for (size_t i = 0; i < header->dir_count; i++) {
+		if (dirs[i].path >= header->strings_size
+				|| (dirs[i].parent >= i && dirs[i].parent != FILE_INDEX_NO_PARENT)
+				|| dirs[i].first_file > header->total
+				|| dirs[i].file_count > header->total - dirs[i].first_file) {
+			log_error("File index is corrupt.\n");
+			return false;
+		}
+	}
+
+	/*
+	 * Lists are decoded with bounds checks, so just make sure they
+	 * start in the right place.
+	 */
+	const struct trigram_entry *trigrams =
+		(const struct trigram_entry *)&data[header->trigrams_offset];
+	for (size_t i = 0; i < header->trigram_count; i++) {
+		if (trigrams[i].count == 0
+				|| trigrams[i].offset >= header->postings_size
+				|| trigrams[i].count > header->postings_size - trigrams[i].offset) {
+			log_error("File index is corrupt.\n");
+			return false;
+		}
+	}
+
+	index->header = header;
+	index->records = records;
+	index->dirs = dirs;
+	index->strings = strings;
+	index->trigrams = (struct trigram_index){
+		.count = header->trigram_count,
+		.table = trigrams,
+		.postings_size = header->postings_size,
+		.postings = (const uint8_t *)&data[header->postings_offset],
+		.limit = header->count
+	};
+	return true;
+}
+
+bool file_index_build(struct file_index *index, struct file_index_builder *builder)
+{
+	size_t count = builder->count;
+	if (builder->visible_count < count) {
+		count = builder->visible_count;
+	}
+
+	/* Apps are matched on their whole string, files on their basename. */
+	struct trigram_builder trigrams = { 0 };
+	if (builder->trigrams) {
+		trigram_builder_init(&trigrams);
+		for (size_t i = 0; i < count; i++) {
+			trigram_builder_add(
+					&trigrams,
+					i,
+					&builder->strings[builder->records[i].offset],
+					builder->records[i].name_len & ~FILE_INDEX_FOLDED);
+		}
+	}
+
+	size_t records_offset = sizeof(struct file_index_header);
+	size_t dirs_offset = records_offset + builder->count * sizeof(struct file_index_record);
+	dirs_offset = (dirs_offset + alignof(struct file_index_dir) - 1)
+		/ alignof(struct file_index_dir) * alignof(struct file_index_dir);
+	size_t trigrams_offset = dirs_offset + builder->dir_count * sizeof(struct file_index_dir);
+	trigrams_offset = (trigrams_offset + alignof(struct trigram_entry) - 1)
+		/ alignof(struct trigram_entry) * alignof(struct trigram_entry);
+	size_t strings_offset = trigrams_offset + trigrams.count * sizeof(struct trigram_entry);
+	size_t postings_offset = strings_offset + builder->strings_len;
+	size_t size = postings_offset + trigrams.postings_size;
+
+	char *data = xcalloc(size, 1);
+	struct file_index_header header = {
+		.magic = FILE_INDEX_MAGIC,
+		.version = FILE_INDEX_VERSION,
+		.count = count,
+		.app_count = builder->app_count,
+		.total = builder->count,
+		.dir_count = builder->dir_count,
+		.max_depth = builder->max_depth,
+		.max_files = builder->max_files,
+		.exclude = builder->exclude,
+		.flags = builder->flags,
+		.trigram_count = trigrams.count,
+		.records_offset = records_offset,
+		.dirs_offset = dirs_offset,
+		.strings_offset = strings_offset,
+		.strings_size = builder->strings_len,
+		.trigrams_offset = trigrams_offset,
+		.postings_offset = postings_offset,
+		.postings_size = trigrams.postings_size
+	};
+	memcpy(data, &header, sizeof(header));
+	memcpy(&data[records_offset], builder->records, builder->count * sizeof(struct file_index_record));
+	memcpy(&data[dirs_offset], builder->dirs, builder->dir_count * sizeof(struct file_index_dir));
+	memcpy(&data[strings_offset], builder->strings, builder->strings_len);
+	if (builder->trigrams) {
+		trigram_builder_write(
+				&trigrams,
+				(struct trigram_entry *)&data[trigrams_offset],
+				(uint8_t *)&data[postings_offset]);
+	}
+	file_index_builder_destroy(builder);
+
+	index->data = data;
+	index->size = size;
+	index->mapped = false;
+	if (!file_index_open(index)) {
+		log_error("Built a file index that doesn't pass its own checks.\n");
+		file_index_destroy(index);
+		return false;
+	}
+	return true;
+}
+
+static bool write_index(FILE *file, void *data)
+{
+	const struct file_index *index = data;
+	return fwrite(index->data, 1, index->size, file) == index->size;
+}
+
+bool file_index_write(const struct file_index *index, const char *path)
+{
+	return atomic_write(path, write_index, (void *)index);
+}
+
+bool file_index_map(struct file_index *index, const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	struct stat sb;
+	if (fstat(fd, &sb) == -1 || sb.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	void *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		log_error("Failed to map \"%s\": %s\n", path, strerror(errno));
+		return false;
+	}
+
+	index->data = data;
+	index->size = sb.st_size;
+	index->mapped = true;
+	if (!file_index_open(index)) {
+		file_index_destroy(index);
+		return false;
+	}
+	return true;
+}
+
+void file_index_destroy(struct file_index *index)
+{
+	if (index->data == NULL) {
+		return;
+	}
+	if (index->mapped) {
+		munmap(index->data, index->size);
+	} else {
+		free(index->data);
+	}
+	index->data = NULL;
+	index->size = 0;
+	index->header = NULL;
+	index->records = NULL;
+	index->dirs = NULL;
+	index->strings = NULL;
+	index->trigrams = (struct trigram_index){ 0 };
+}
+
+const char *file_index_string(const struct file_index *index, size_t i)
+{
+	return &index->strings[index->records[i].offset];
+}
+
+size_t file_index_name_len(const struct file_index *index, size_t i)
+{
+	return index->records[i].name_len & ~FILE_INDEX_FOLDED;
+}
+
+const char *file_index_exclude(const struct file_index *index)
+{
+	if (index->header->exclude == FILE_INDEX_NO_EXCLUDE) {
+		return NULL;
+	}
+	return &index->strings[index->header->exclude];
+}
+
+struct string_ref_vec file_index_commands(const struct file_index *index)
+{
+	if (index->header == NULL) {
+		return string_ref_vec_create();
+	}
+
+	/* There may be millions of files, so allocate everything up front. */
+	size_t count = index->header->count;
+	struct string_ref_vec vec = {
+		.count = count,
+		.size = count > 0 ? count : 1,
+		.buf = xcalloc(count > 0 ? count : 1, sizeof(*vec.buf))
+	};
+	for (size_t i = 0; i < count; i++) {
+		/*
+		 * The cast discards const, but nothing ever writes through
+		 * a string_ref_vec.
+		 */
+		char *str = (char *)file_index_string(index, i);
+		uint32_t len = file_index_name_len(index, i);
+		vec.buf[i].string = str;
+		vec.buf[i].key = (struct match_key){
+			.len = len,
+			.nchars = len,
+			.sig = index->records[i].sig
+		};
+		if (index->records[i].name_len & FILE_INDEX_FOLDED) {
+			vec.buf[i].key.folded = str + strlen(str) + 1;
+			vec.buf[i].key.nchars = utf8_strnlen(str, len);
+		}
+	}
+	return vec;
+}
+
+/*
+ * Narrow the count ids down to those also in indices, both of which are in
+ * ascending order, returning how many are left.
+ */
+static size_t intersect(uint32_t *ids, size_t count, const uint32_t *indices, size_t nindices)
+{
+	size_t n = 0;
+	size_t j = 0;
+	for (size_t i = 0; i < count && j < nindices; i++) {
+		while (j < nindices && indices[j] < ids[i]) {
+			j++;
+		}
+		if (j < nindices && indices[j] == ids[i]) {
+			ids[n++] = ids[i];
+		}
+	}
+	return n;
+}
+
+void file_index_filter(
+		const struct file_index *index,
+		const struct string_ref_vec *commands,
+		const uint32_t *indices,
+		size_t count,
+		const char *substr,
+		enum matching_algorithm algorithm,
+		const atomic_bool *cancel,
+		struct result_vec *results)
+{
+	uint32_t *ids;
+	size_t nids;
+
+	/*
+	 * Fuzzy and approximate matches needn't contain any of the query's
+	 * trigrams, and the commands can only be trusted to line up with the
+	 * records if there are the right number of them.
+	 */
+	if (index->header == NULL
+			|| index->trigrams.count == 0
+			|| algorithm == MATCHING_ALGORITHM_FUZZY
+			|| algorithm == MATCHING_ALGORITHM_APPROX
+			|| commands->count != index->header->count
+			|| !trigram_search(&index->trigrams, substr, &ids, &nids)) {
+		if (indices == NULL) {
+			string_ref_vec_filter(commands, substr, algorithm, cancel, results);
+		} else {
+			string_ref_vec_filter_subset(commands, indices, count, substr, algorithm, cancel, results);
+		}
+		return;
+	}
+	if (indices != NULL) {
+		nids = intersect(ids, nids, indices, count);
+	}
+	string_ref_vec_filter_subset(commands, ids, nids, substr, algorithm, cancel, results);
+	free(ids);
+}
@@ -0,0 +1,268 @@
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "matching.h"
+#include "string_vec.h"
+#include "trigram.h"
+
+/*
+ * Binary cache of the sofi-files list, designed to be mmap()ed and used
+ * in place, without any parsing or copying.
+ *
+ * The file consists of a header, a table of records, a manifest of the
+ * directories that were scanned, a block of NUL-terminated strings that
+ * the records and directories point into, and optionally a trigram index of
+ * the listed names, to narrow down searches. Apps come first, followed by
+ * files, each stored as "basename|||path" along with the length of the
+ * basename and its match signature, and followed by the casefolded basename
+ * if it isn't plain ASCII, so that it's ready for matching. Everything is
+ * stored in native byte order, as the cache is never shared between machines.
+ *
+ * Only the first count records are listed. Any files past that (beyond the
+ * limit on the number of files shown) are kept so that the manifest
+ * describes every directory in full, and the index can be refreshed by
+ * rereading just the directories that have changed.
+ *
+ * Nothing limits the number of files by default, so the index needs to cope
+ * with millions of them. Each costs a 16 byte record plus its string (about
+ * twice the basename plus the directory path) in the mapping, only the parts
+ * of which a search touches are ever read in, and 40 bytes (the string and
+ * its match key) in each of the commands and results lists. The trigram index
+ * adds about 15 bytes per file, of which a search only reads the lists for its
+ * trigrams. For a million files, that comes to around 100MB on disk and 60MB
+ * resident once loaded.
+ * Scanning is the peak: the scan tree and the builder briefly hold two copies
+ * of everything, roughly 200MB, plus around 30MB for building the trigrams.
+ */
+
+#define FILE_INDEX_MAGIC "SOFIIDX"
+#define FILE_INDEX_VERSION 7
+
+/* Parent of the root directories. */
+#define FILE_INDEX_NO_PARENT UINT32_MAX
+
+/* Header flag set if .gitignore and .ignore files were honoured. */
+#define FILE_INDEX_IGNORE_FILES (1u << 0)
+
+/*
+ * Flag set in a record's name_len if the name isn't plain ASCII, in which
+ * case the string is followed by the casefolded name.
+ */
+#define FILE_INDEX_FOLDED (1u << 31)
+
+/* Value of the exclude field when there were no extra exclude rules. */
+#define FILE_INDEX_NO_EXCLUDE UINT32_MAX
+
+struct file_index_header {
+	char magic[8];
+	uint32_t version;
+
+	/*
+	 * Number of records to list, the first app_count of which are apps,
+	 * and the total number of records including unlisted files.
+	 */
+	uint32_t count;
+	uint32_t app_count;
+	uint32_t total;
+
+	uint32_t dir_count;
+
+	/*
+	 * The options the files were scanned with: the limits, or UINT32_MAX
+	 * for none, the offset of the exclude rules in the strings section,
+	 * and flags.
+	 */
+	uint32_t max_depth;
+	uint32_t max_files;
+	uint32_t exclude;
+	uint32_t flags;
+
+	/* Number of trigram lists, or 0 if there's no trigram index. */
+	uint32_t trigram_count;
+
+	/* Byte offsets of each section from the start of the file. */
+	uint64_t records_offset;
+	uint64_t dirs_offset;
+	uint64_t strings_offset;
+	uint64_t strings_size;
+	uint64_t trigrams_offset;
+	uint64_t postings_offset;
+	uint64_t postings_size;
+};
+
+struct file_index_record {
+	/* Offset of the string from the start of the strings section. */
+	uint32_t offset;
+
+	/*
+	 * Length of the basename, or of the whole string for apps, which is
+	 * what's matched against, plus FILE_INDEX_FOLDED if set.
+	 */
+	uint32_t name_len;
+
+	/* The name's match_key signature. */
+	uint64_t sig;
+};
+
+/*
+ * A scanned directory. Directories are stored in depth-first order, and each
+ * one's files are stored contiguously, before those of its subdirectories.
+ */
+struct file_index_dir {
+	/* Identity and modification time when the directory was read. */
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+
+	/* Offset of the directory's path in the strings section. */
+	uint32_t path;
+
+	/* Index of the parent directory, or FILE_INDEX_NO_PARENT. */
+	uint32_t parent;
+	int32_t depth;
+
+	/* The range of records holding this directory's files. */
+	uint32_t first_file;
+	uint32_t file_count;
+};
+
+/* A loaded index, either mapped from disk or held in memory. */
+struct file_index {
+	char *data;
+	size_t size;
+	bool mapped;
+	const struct file_index_header *header;
+	const struct file_index_record *records;
+	const struct file_index_dir *dirs;
+	const char *strings;
+	struct trigram_index trigrams;
+};
+
+struct file_index_builder {
+	size_t count;
+	size_t size;
+	struct file_index_record *records;
+	size_t dir_count;
+	size_t dir_size;
+	struct file_index_dir *dirs;
+	size_t strings_len;
+	size_t strings_size;
+	char *strings;
+	size_t app_count;
+	size_t visible_count;
+	uint32_t max_depth;
+	uint32_t max_files;
+	uint32_t exclude;
+	uint32_t flags;
+	bool trigrams;
+};
+
+void file_index_builder_init(struct file_index_builder *builder);
+void file_index_builder_destroy(struct file_index_builder *builder);
+
+/*
+ * Add a string to the index. For files, name_len is the length of the
+ * basename before the "|||" separator. Returns false if the index is full.
+ */
+bool file_index_builder_add(struct file_index_builder *builder, const char *str, size_t name_len);
+
+/*
+ * Add a file called name in the directory at path, stored as
+ * "name|||path/name". Returns false if the index is full.
+ */
+bool file_index_builder_add_file(struct file_index_builder *builder, const char *path, const char *name);
+
+/* Mark everything added so far as an app, and everything after as a file. */
+void file_index_builder_end_apps(struct file_index_builder *builder);
+
+/*
+ * Start a new directory, whose files are the ones added until the next call.
+ * dir supplies everything but the path and file range. Returns the index of
+ * the directory, for use as its subdirectories' parent.
+ */
+uint32_t file_index_builder_add_dir(
+		struct file_index_builder *builder,
+		const char *path,
+		const struct file_index_dir *dir);
+
+/*
+ * Only list the first count files, keeping the rest just for the manifest.
+ * By default, everything is listed.
+ */
+void file_index_builder_set_visible(struct file_index_builder *builder, size_t count);
+
+/* Record the options the files were scanned with. exclude may be NULL. */
+void file_index_builder_set_options(
+		struct file_index_builder *builder,
+		uint32_t max_depth,
+		uint32_t max_files,
+		const char *exclude,
+		uint32_t flags);
+
+/*
+ * Build a trigram index of the listed names, so that searches don't have to
+ * look at all of them. Off by default, as it's not worth the time for
+ * short-lived indexes.
+ */
+void file_index_builder_set_trigrams(struct file_index_builder *builder, bool trigrams);
+
+/* Return the exclude rules an index was scanned with, or NULL if none. */
+const char *file_index_exclude(const struct file_index *index);
+
+/*
+ * Lay out the builder's contents in the on-disk format, in memory. The
+ * builder is left empty. Returns false, leaving index empty, if the result
+ * doesn't pass the checks made on an index read from disk.
+ */
+bool file_index_build(struct file_index *index, struct file_index_builder *builder);
+
+/*
+ * Write an index to path, via a temporary file that's renamed into place so
+ * that no-one ever sees a partial index.
+ */
+bool file_index_write(const struct file_index *index, const char *path);
+
+/*
+ * Map the index at path. Returns false if it doesn't exist, or is corrupt or
+ * from a different version of sofi.
+ */
+bool file_index_map(struct file_index *index, const char *path);
+
+void file_index_destroy(struct file_index *index);
+
+/* Return the string for record i. */
+const char *file_index_string(const struct file_index *index, size_t i);
+
+/* Return the length of record i's name, or of its whole string for apps. */
+size_t file_index_name_len(const struct file_index *index, size_t i);
+
+/*
+ * Fill a string_ref_vec with references to each listed string in the index.
+ * The strings are read-only, and only valid until the index is destroyed.
+ */
+[[nodiscard("memory leaked")]]
+struct string_ref_vec file_index_commands(const struct file_index *index);
+
+/*
+ * Filter commands, which must be the index's, as returned by
+ * file_index_commands(), or if indices isn't NULL, just the count of them at
+ * those indices, as string_ref_vec_filter_subset() does. If the trigram index
+ * can narrow the search down further, only the candidates it finds are
+ * checked.
+ */
+void file_index_filter(
+		const struct file_index *index,
+		const struct string_ref_vec *commands,
+		const uint32_t *indices,
+		size_t count,
+		const char *substr,
+		enum matching_algorithm algorithm,
+		const atomic_bool *cancel,
+		struct result_vec *results);
+
+#endif /* FILE_INDEX_H */
@@ -1,9 +1,11 @@
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
@@ -11,31 +13,23 @@
 #include "files.h"
 #include "drun.h"
 #include "desktop_vec.h"
+#include "file_index.h"
 #include "log.h"
 #include "mkdirp.h"
+#include "nelem.h"
+#include "scan.h"
 #include "xmalloc.h"
 
 static const char *default_cache_dir = ".cache";
 static const char *cache_basename = "sofi-files";
 
-/* Directories to exclude from search */
-static const char *exclude_dirs[] = {
-    "/proc", "/sys", "/dev", "/run", "/tmp",
-    "/var/lib/docker", "/snap", "/mnt", "/media",
-    "/.git", "/node_modules", "/.cache", "/lost+found",
+/* Directories in $HOME to scan first, in order. */
+static const char *const priority_dirs[] = {
+    "Documents", "Downloads", "Desktop", "Pictures", "Videos",
     NULL
 };
 
-static bool should_exclude(const char *path) {
-    for (int i = 0; exclude_dirs[i] != NULL; i++) {
-        if (strstr(path, exclude_dirs[i]) != NULL) {
-            return true;
-        }
-    }
-    return false;
-}
-
-static char *get_cache_path() {
+char *files_cache_path(void) {
     char *cache_name = NULL;
     const char *cache_path = getenv("XDG_CACHE_HOME");
     if (cache_path == NULL) {
@@ -57,154 +51,151 @@ static char *get_cache_path() {
     return cache_name;
 }
 
-static void scan_directory_to_buffer(const char *dir_path, FILE *output, int depth, int *count) {
-    if (depth > 3) return;
-    if (should_exclude(dir_path)) return;
-    if (*count > 5000) return;  /* Limit total files */
+struct scan_tree files_scan(
+        const char *cache_path,
+        struct scan_options options,
+        scan_progress_fn *progress,
+        void *data) {
+    const char *home = getenv("HOME");
+    if (home == NULL) {
+        return scan_tree_create(NULL, 0, options, NULL, NULL);
+    }
     
-    DIR *dir = opendir(dir_path);
-    if (dir == NULL) return;
+    /*
+     * Scan priority directories first, then the rest of the home
+     * directory, skipping the priority directories so we don't list
+     * anything twice.
+     */
+    char paths[N_ELEM(priority_dirs)][PATH_MAX];
+    struct scan_root roots[N_ELEM(priority_dirs)];
+    size_t nroots = 0;
+    for (size_t i = 0; priority_dirs[i] != NULL; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/%s", home, priority_dirs[i]);
+        roots[nroots++] = (struct scan_root){ .path = paths[i] };
+    }
+    roots[nroots++] = (struct scan_root){
+        .path = home,
+        .top_level = true,
+        .skip = priority_dirs
+    };
     
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (*count > 5000) break;
-        
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
-        }
-        
-        char full_path[PATH_MAX];
-        snprintf(full_path, sizeof(full_path), "%s/%s", dir_path, entry->d_name);
-        
-        struct stat st;
-        if (stat(full_path, &st) == -1) continue;
-        
-        if (S_ISREG(st.st_mode)) {
-            /* Store as: basename|||full_path for special parsing */
-            const char *basename = strrchr(full_path, '/');
-            if (basename) {
-                basename++; /* Skip the '/' */
-                fprintf(output, "%s|||%s\n", basename, full_path);
-            } else {
-                fprintf(output, "%s|||%s\n", entry->d_name, full_path);
-            }
-            (*count)++;
-        } else if (S_ISDIR(st.st_mode)) {
-            scan_directory_to_buffer(full_path, output, depth + 1, count);
+    /*
+     * If there's an old index, only reread the directories that have
+     * changed since it was written.
+     */
+    struct file_index old = { 0 };
+    if (cache_path != NULL && file_index_map(&old, cache_path)) {
+        struct scan_tree tree;
+        bool found = scan_tree_from_index(&tree, &old, roots, nroots, options);
+        file_index_destroy(&old);
+        if (found) {
+            log_debug("Refreshing file index.\n");
+            scan_tree_refresh(&tree);
+            return tree;
         }
     }
-    
-    closedir(dir);
+    return scan_tree_create(roots, nroots, options, progress, data);
 }
 
-static int cached_app_count = -1;
-
-static char *generate_file_list() {
-    /* Create temporary file for building the list */
-    char tmp_path[] = "/tmp/sofi-files-XXXXXX";
-    int fd = mkstemp(tmp_path);
-    if (fd == -1) {
-        log_error("Failed to create temp file.\n");
-        return xstrdup("");
+static bool build_index(
+        struct file_index *index,
+        const struct desktop_vec *apps,
+        const struct scan_tree *tree,
+        bool trigrams) {
+    struct file_index_builder builder;
+    file_index_builder_init(&builder);
+    file_index_builder_set_trigrams(&builder, trigrams);
+    
+    /* First, add all desktop apps */
+    for (size_t i = 0; i < apps->count; i++) {
+        file_index_builder_add(&builder, apps->buf[i].name, strlen(apps->buf[i].name));
     }
+    file_index_builder_end_apps(&builder);
     
-    FILE *tmp = fdopen(fd, "w+");
-    if (tmp == NULL) {
-        close(fd);
-        unlink(tmp_path);
-        return xstrdup("");
+    size_t count = scan_tree_write(tree, &builder);
+    if (!file_index_build(index, &builder)) {
+        return false;
     }
     
-    /* First, add all desktop apps */
+    log_debug("Generated %zu files.\n", count);
+    return true;
+}
+
+bool files_build_index(struct file_index *index, const struct scan_tree *tree) {
     log_debug("Adding apps to unified list.\n");
-    struct desktop_vec apps = drun_generate_cached();
-    cached_app_count = 0;
-    for (size_t i = 0; i < apps.count; i++) {
-        fprintf(tmp, "%s\n", apps.buf[i].name);
-        cached_app_count++;
-    }
+    struct desktop_vec apps = drun_generate_cached(NULL);
+    bool built = build_index(index, &apps, tree, true);
     desktop_vec_destroy(&apps);
-    
-    /* Add separator line between apps and files */
-    if (cached_app_count > 0) {
-        fprintf(tmp, "\n");
-        cached_app_count++;
+    return built;
+}
+
+struct progress {
+    const struct desktop_vec *apps;
+    files_progress_fn *callback;
+    void *data;
+};
+
+/*
+ * Pass on the index of the roots scanned so far. It'll soon be replaced, so
+ * don't spend time on a trigram index.
+ */
+static void report_progress(const struct scan_tree *tree, size_t nscanned, void *data) {
+    struct progress *progress = data;
+    struct scan_tree scanned = {
+        .count = nscanned,
+        .roots = tree->roots,
+        .options = tree->options
+    };
+    struct file_index index;
+    if (build_index(&index, progress->apps, &scanned, false)) {
+        progress->callback(&index, progress->data);
     }
-    
-    int count = 0;
-    const char *home = getenv("HOME");
-    
-    if (home != NULL) {
-        char path[PATH_MAX];
-        
-        /* Scan priority directories */
-        snprintf(path, sizeof(path), "%s/Documents", home);
-        scan_directory_to_buffer(path, tmp, 0, &count);
-        
-        snprintf(path, sizeof(path), "%s/Downloads", home);
-        scan_directory_to_buffer(path, tmp, 0, &count);
-        
-        snprintf(path, sizeof(path), "%s/Desktop", home);
-        scan_directory_to_buffer(path, tmp, 0, &count);
-        
-        snprintf(path, sizeof(path), "%s/Pictures", home);
-        scan_directory_to_buffer(path, tmp, 0, &count);
-        
-        snprintf(path, sizeof(path), "%s/Videos", home);
-        scan_directory_to_buffer(path, tmp, 0, &count);
-        
-        /* Scan home directory root level only to avoid duplicates with subdirs already scanned */
-        if (count < 4000) {
-            DIR *dir = opendir(home);
-            if (dir != NULL) {
-                struct dirent *entry;
-                while ((entry = readdir(dir)) != NULL && count < 5000) {
-                    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                        continue;
-                    }
-                    
-                    /* Skip directories we already scanned */
-                    if (strcmp(entry->d_name, "Documents") == 0 || 
-                        strcmp(entry->d_name, "Downloads") == 0 ||
-                        strcmp(entry->d_name, "Desktop") == 0 ||
-                        strcmp(entry->d_name, "Pictures") == 0 ||
-                        strcmp(entry->d_name, "Videos") == 0) {
-                        continue;
-                    }
-                    
-                    char full_path[PATH_MAX];
-                    snprintf(full_path, sizeof(full_path), "%s/%s", home, entry->d_name);
-                    
-                    struct stat st;
-                    if (stat(full_path, &st) == -1) continue;
-                    
-                    if (S_ISREG(st.st_mode)) {
-                        fprintf(tmp, "%s|||%s\n", entry->d_name, full_path);
-                        count++;
-                    } else if (S_ISDIR(st.st_mode)) {
-                        scan_directory_to_buffer(full_path, tmp, 0, &count);
-                    }
-                }
-                closedir(dir);
-            }
-        }
+}
+
+bool files_save_index(const struct file_index *index, const char *cache_path) {
+    /* Create cache directory if needed */
+    if (!mkdirp(cache_path)) {
+        return false;
     }
-    
-    /* Get file size */
-    fseek(tmp, 0, SEEK_END);
-    long size = ftell(tmp);
-    fseek(tmp, 0, SEEK_SET);
-    
-    /* Read into buffer */
-    char *buffer = xmalloc(size + 1);
-    fread(buffer, 1, size, tmp);
-    buffer[size] = '\0';
-    
-    fclose(tmp);
-    unlink(tmp_path);
-    
-    log_debug("Generated %d files.\n", count);
-    return buffer;
+    return file_index_write(index, cache_path);
+}
+
+[[nodiscard("memory leaked")]]
+static char *get_lock_path(const char *cache_path) {
+    size_t len = strlen(cache_path) + strlen(".lock") + 1;
+    char *lock_path = xmalloc(len);
+    snprintf(lock_path, len, "%s.lock", cache_path);
+    return lock_path;
+}
+
+int files_watch_lock(const char *cache_path) {
+    char *lock_path = get_lock_path(cache_path);
+    errno = 0;
+    int fd = open(lock_path, O_RDONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        log_error("Failed to open lock file %s: %s.\n", lock_path, strerror(errno));
+    } else if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    free(lock_path);
+    return fd;
+}
+
+/*
+ * Whether sofi-files-watch is keeping the index up to date, i.e. whether
+ * someone is holding the lock.
+ */
+static bool watcher_running(const char *cache_path) {
+    char *lock_path = get_lock_path(cache_path);
+    int fd = open(lock_path, O_RDONLY | O_CLOEXEC);
+    free(lock_path);
+    if (fd == -1) {
+        return false;
+    }
+    bool running = flock(fd, LOCK_SH | LOCK_NB) == -1 && errno == EWOULDBLOCK;
+    close(fd);
+    return running;
 }
 
 static bool should_refresh_cache(const char *cache_path) {
@@ -226,10 +217,8 @@ static bool should_refresh_cache(const char *cache_path) {
     const char *home = getenv("HOME");
     if (home != NULL) {
         char path[PATH_MAX];
-        const char *dirs[] = {"Documents", "Downloads", "Desktop", "Pictures", "Videos", NULL};
-        
-        for (int i = 0; dirs[i] != NULL; i++) {
-            snprintf(path, sizeof(path), "%s/%s", home, dirs[i]);
+        for (int i = 0; priority_dirs[i] != NULL; i++) {
+            snprintf(path, sizeof(path), "%s/%s", home, priority_dirs[i]);
             struct stat dir_stat;
             if (stat(path, &dir_stat) == 0 && dir_stat.st_mtime > cache_stat.st_mtime) {
                 log_debug("Directory %s is newer than cache, refreshing.\n", path);
@@ -241,94 +230,103 @@ static bool should_refresh_cache(const char *cache_path) {
     return false;
 }
 
-char *files_generate_cached() {
-    char *cache_path = get_cache_path();
+bool files_cached_options(const char *cache_path, struct scan_options *options) {
+    struct file_index index = { 0 };
+    if (!file_index_map(&index, cache_path)) {
+        return false;
+    }
+    const char *exclude = file_index_exclude(&index);
+    *options = (struct scan_options){
+        .max_depth = index.header->max_depth,
+        .max_files = index.header->max_files,
+        .exclude = exclude == NULL ? NULL : xstrdup(exclude),
+        .ignore_files = index.header->flags & FILE_INDEX_IGNORE_FILES
+    };
+    file_index_destroy(&index);
+    return true;
+}
+
+struct string_ref_vec files_generate_cached(
+        struct file_index *index,
+        struct scan_options options,
+        bool *stale) {
+    if (stale != NULL) {
+        *stale = false;
+    }
+    char *cache_path = files_cache_path();
     
     if (cache_path == NULL) {
         log_error("Failed to get cache path.\n");
-        return generate_file_list();
+        files_update(index, options, NULL, NULL);
+        return file_index_commands(index);
     }
     
-    /* Check if we should refresh the cache */
-    if (!should_refresh_cache(cache_path)) {
-        /* Try to read from cache */
-        FILE *cache = fopen(cache_path, "r");
-        if (cache != NULL) {
-            fseek(cache, 0, SEEK_END);
-            long size = ftell(cache);
-            fseek(cache, 0, SEEK_SET);
-            
-            char *buffer = xmalloc(size + 1);
-            fread(buffer, 1, size, cache);
-            buffer[size] = '\0';
-            
-            fclose(cache);
-            
-            /* Count apps in cached data */
-            struct desktop_vec apps = drun_generate_cached();
-            cached_app_count = apps.count;
-            desktop_vec_destroy(&apps);
-            
+    /*
+     * If the watcher's running, the index is always current, otherwise
+     * check if we should refresh it.
+     */
+    bool watched = watcher_running(cache_path);
+    if (watched) {
+        log_debug("sofi-files-watch is running, skipping refresh check.\n");
+    }
+    bool refresh = !watched && should_refresh_cache(cache_path);
+    if (file_index_map(index, cache_path)) {
+        if (!scan_options_match(index, options)) {
+            log_debug("File options have changed, refreshing.\n");
+            refresh = true;
+        }
+        if (!refresh || stale != NULL) {
             free(cache_path);
-            
-            log_debug("Loaded files from cache with %d apps.\n", cached_app_count);
-            return buffer;
+            log_debug("Loaded files from cache with %u apps.\n", index->header->app_count);
+            if (refresh) {
+                log_debug("Refreshing it in the background.\n");
+                *stale = true;
+            }
+            return file_index_commands(index);
         }
+        file_index_destroy(index);
     }
+    free(cache_path);
     
-    /* Generate new list */
-    char *buffer = generate_file_list();
-    
-    /* Save to cache */
-    /* Create cache directory if needed */
-    char *dir = strdup(cache_path);
-    char *last_slash = strrchr(dir, '/');
-    if (last_slash != NULL) {
-        *last_slash = '\0';
-        mkdirp(dir);
+    /* There's nothing usable cached, so show nothing until there is. */
+    if (stale != NULL) {
+        log_debug("No usable cache, creating it in the background.\n");
+        *stale = true;
+        return file_index_commands(index);
     }
-    free(dir);
     
-    FILE *cache = fopen(cache_path, "w");
-    if (cache != NULL) {
-        fputs(buffer, cache);
-        fclose(cache);
-        log_debug("Saved files to cache.\n");
-    }
-    
-    free(cache_path);
-    return buffer;
+    files_update(index, options, NULL, NULL);
+    return file_index_commands(index);
 }
 
-static int get_item_index(const char *item) {
-    /* Read the cache to find item's position */
-    char *cache_path = get_cache_path();
-    if (cache_path == NULL) return -1;
+void files_update(
+        struct file_index *index,
+        struct scan_options options,
+        files_progress_fn *progress,
+        void *data) {
+    char *cache_path = files_cache_path();
     
-    FILE *cache = fopen(cache_path, "r");
-    if (cache == NULL) {
-        free(cache_path);
-        return -1;
-    }
+    log_debug("Adding apps to unified list.\n");
+    struct desktop_vec apps = drun_generate_cached(NULL);
     
-    char line[PATH_MAX * 2];  /* Increased size for basename|||path format */
-    int index = 0;
-    while (fgets(line, sizeof(line), cache) != NULL) {
-        size_t len = strlen(line);
-        if (len > 0 && line[len - 1] == '\n') {
-            line[len - 1] = '\0';
-        }
-        if (strcmp(line, item) == 0) {
-            fclose(cache);
-            free(cache_path);
-            return index;
-        }
-        index++;
-    }
+    struct progress state = {
+        .apps = &apps,
+        .callback = progress,
+        .data = data
+    };
+    struct scan_tree tree = files_scan(
+            cache_path,
+            options,
+            progress == NULL ? NULL : report_progress,
+            &state);
+    bool built = build_index(index, &apps, &tree, true);
+    scan_tree_destroy(&tree);
+    desktop_vec_destroy(&apps);
     
-    fclose(cache);
+    if (built && cache_path != NULL && files_save_index(index, cache_path)) {
+        log_debug("Saved files to cache.\n");
+    }
     free(cache_path);
-    return -1;
 }
 
 void files_launch(const char *path) {
@@ -355,8 +353,8 @@ void files_launch(const char *path) {
             execlp("gio", "gio", "open", actual_path, NULL);
             /* If gio fails, try xdg-open */
             execlp("xdg-open", "xdg-open", actual_path, NULL);
-            /* If both fail, exit */
-            exit(1);
+            /* If both fail, exit without running our exit handlers */
+            _exit(1);
         } else if (pid > 0) {
             /* Parent process - fork another process to focus Firefox after a delay */
             log_debug("Launched file opener with PID: %d\n", pid);
@@ -382,7 +380,7 @@ void files_launch(const char *path) {
                 fprintf(stderr, "Focus command returned: %d\n", ret);
                 
                 if (log) fclose(log);
-                exit(0);
+                _exit(0);
             }
         } else {
             log_error("Failed to fork: %s\n", strerror(errno));
@@ -396,7 +394,7 @@ void files_launch(const char *path) {
     }
     
     /* Otherwise it's an app - find and launch it */
-    struct desktop_vec apps = drun_generate_cached();
+    struct desktop_vec apps = drun_generate_cached(NULL);
     for (size_t i = 0; i < apps.count; i++) {
         if (strcmp(apps.buf[i].name, path) == 0) {
             drun_launch(apps.buf[i].path);
@@ -1,7 +1,75 @@
 #ifndef FILES_H
 #define FILES_H
 
-char *files_generate_cached(void);
+#include <stdbool.h>
+#include "file_index.h"
+#include "scan.h"
+#include "string_vec.h"
+
+/*
+ * Load the cached file index and return references to its entries. The index
+ * must outlive the returned vector. If stale is NULL, the index is
+ * regenerated first if it's missing, stale or was scanned with different
+ * options. Otherwise, it's returned as-is (empty if missing) with *stale set,
+ * and the caller should arrange for files_update() to be called.
+ */
+[[nodiscard("memory leaked")]]
+struct string_ref_vec files_generate_cached(
+        struct file_index *index,
+        struct scan_options options,
+        bool *stale);
+
+/*
+ * Called with an index of everything found so far as files_update() works
+ * through each of the directories it scans (the priority directories, then
+ * the rest of $HOME). The callback takes ownership of the index.
+ */
+typedef void files_progress_fn(struct file_index *index, void *data);
+
+/*
+ * Regenerate the file index, and write it to the cache. If progress isn't
+ * NULL, it's called with partial results as the scan goes on.
+ */
+void files_update(
+        struct file_index *index,
+        struct scan_options options,
+        files_progress_fn *progress,
+        void *data);
 void files_launch(const char *path);
 
+[[nodiscard("memory leaked")]]
+char *files_cache_path(void);
+
+/*
+ * Scan the user's files. If cache_path isn't NULL, the index there is
+ * refreshed rather than scanning everything from scratch. When scanning from
+ * scratch, progress (if not NULL) is called as each root is finished with.
+ */
+[[nodiscard("memory leaked")]]
+struct scan_tree files_scan(
+        const char *cache_path,
+        struct scan_options options,
+        scan_progress_fn *progress,
+        void *data);
+
+/*
+ * Read the options the cached index was scanned with, returning false if
+ * there isn't one. The exclude string is allocated, for the caller to free.
+ */
+bool files_cached_options(const char *cache_path, struct scan_options *options);
+
+/*
+ * Build an index of the installed apps and the files in tree, returning false
+ * (with index left empty) if it couldn't be.
+ */
+bool files_build_index(struct file_index *index, const struct scan_tree *tree);
+
+bool files_save_index(const struct file_index *index, const char *cache_path);
+
+/*
+ * Take the lock marking sofi-files-watch as running, returning the locked
+ * file descriptor, or -1 if another watcher already holds it.
+ */
+int files_watch_lock(const char *cache_path);
+
 #endif /* FILES_H */
\ No newline at end of file
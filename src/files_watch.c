@@ -0,0 +1,364 @@
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "files.h"
+#include "files_watch.h"
+#include "log.h"
+#include "scan.h"
+#include "xmalloc.h"
+
+/*
+ * Changes tend to come in bursts (e.g. unpacking an archive), so wait for
+ * things to settle before writing the index out.
+ */
+#define SETTLE_TIME_MS 500
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+		| IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+struct watcher {
+	int fd;
+	const char *cache_path;
+	struct scan_tree tree;
+
+	/* Every directory in tree, kept up to date as they come and go. */
+	struct scan_dir_set seen;
+
+	/* Map from watch descriptor to directory. */
+	size_t nwatches;
+	struct scan_dir **watches;
+
+	/* Whether the index needs writing out. */
+	bool dirty;
+
+	/* Whether we've lost track of things and need to start again. */
+	bool rescan;
+
+	/*
+	 * Whether the rescan needs to read everything, as an ignore file has
+	 * changed, rather than just the directories that have.
+	 */
+	bool rescan_all;
+};
+
+static void add_watches(struct watcher *watcher, struct scan_dir *dir)
+{
+	errno = 0;
+	int wd = inotify_add_watch(watcher->fd, dir->path, WATCH_MASK);
+	if (wd == -1) {
+		log_error("Failed to watch \"%s\": %s.\n", dir->path, strerror(errno));
+	} else {
+		if ((size_t)wd >= watcher->nwatches) {
+			size_t nwatches = watcher->nwatches ? watcher->nwatches : 1024;
+			while (nwatches <= (size_t)wd) {
+				nwatches *= 2;
+			}
+			watcher->watches = xrealloc(watcher->watches, nwatches * sizeof(*watcher->watches));
+			memset(
+				&watcher->watches[watcher->nwatches],
+				0,
+				(nwatches - watcher->nwatches) * sizeof(*watcher->watches));
+			watcher->nwatches = nwatches;
+		}
+		/*
+		 * If we somehow reach the same directory twice, inotify
+		 * hands back the same descriptor, which stays with the first.
+		 */
+		if (watcher->watches[wd] == NULL) {
+			watcher->watches[wd] = dir;
+			dir->watch = wd;
+		}
+	}
+
+	for (size_t i = 0; i < dir->count; i++) {
+		if (dir->items[i].dir != NULL) {
+			add_watches(watcher, dir->items[i].dir);
+		}
+	}
+}
+
+static void remove_watches(struct watcher *watcher, struct scan_dir *dir)
+{
+	if (dir->watch != -1) {
+		inotify_rm_watch(watcher->fd, dir->watch);
+		watcher->watches[dir->watch] = NULL;
+		dir->watch = -1;
+	}
+	for (size_t i = 0; i < dir->count; i++) {
+		if (dir->items[i].dir != NULL) {
+			remove_watches(watcher, dir->items[i].dir);
+		}
+	}
+}
+
+static void write_index(struct watcher *watcher)
+{
+	/*
+	 * If sofi has rescanned with different options since we started,
+	 * start again with those rather than overwriting its index.
+	 */
+	struct file_index old = { 0 };
+	if (file_index_map(&old, watcher->cache_path)) {
+		bool changed = !scan_options_match(&old, watcher->tree.options);
+		file_index_destroy(&old);
+		if (changed) {
+			log_debug("File options have changed.\n");
+			watcher->rescan = true;
+			return;
+		}
+	}
+
+	struct file_index index;
+	if (files_build_index(&index, &watcher->tree)
+			&& files_save_index(&index, watcher->cache_path)) {
+		log_debug("Saved files to cache.\n");
+	}
+	file_index_destroy(&index);
+	watcher->dirty = false;
+}
+
+/*
+ * Throw everything away and start again from the index on disk, rereading
+ * whatever's changed since it was written, or from scratch if rescan_all is
+ * set.
+ */
+static bool rebuild(struct watcher *watcher)
+{
+	if (watcher->fd != -1) {
+		/* Closing the inotify instance removes all its watches. */
+		close(watcher->fd);
+		scan_tree_destroy(&watcher->tree);
+		scan_dir_set_destroy(&watcher->seen);
+		free(watcher->watches);
+		watcher->watches = NULL;
+		watcher->nwatches = 0;
+	}
+	errno = 0;
+	watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watcher->fd == -1) {
+		log_error("Failed to initialise inotify: %s.\n", strerror(errno));
+		return false;
+	}
+
+	/* Stick to whatever options sofi last scanned with. */
+	struct scan_options options = {
+		.max_depth = SCAN_UNLIMITED,
+		.max_files = SCAN_UNLIMITED,
+		.ignore_files = true
+	};
+	files_cached_options(watcher->cache_path, &options);
+	watcher->tree = files_scan(
+			watcher->rescan_all ? NULL : watcher->cache_path,
+			options,
+			NULL,
+			NULL);
+	free(options.exclude);
+	scan_dir_set_from_tree(&watcher->seen, &watcher->tree);
+	for (size_t i = 0; i < watcher->tree.count; i++) {
+		if (watcher->tree.roots[i] != NULL) {
+			add_watches(watcher, watcher->tree.roots[i]);
+		}
+	}
+	watcher->rescan = false;
+	watcher->rescan_all = false;
+	write_index(watcher);
+	return true;
+}
+
+static bool is_root(const struct watcher *watcher, const struct scan_dir *dir)
+{
+	for (size_t i = 0; i < watcher->tree.count; i++) {
+		if (watcher->tree.roots[i] == dir) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void remove_entry(struct watcher *watcher, struct scan_dir *dir, const char *name)
+{
+	struct scan_dir *subdir;
+	if (scan_dir_remove(dir, name, &subdir)) {
+		if (subdir != NULL) {
+			remove_watches(watcher, subdir);
+			scan_dir_set_remove(&watcher->seen, subdir);
+			scan_dir_destroy(subdir);
+		}
+		watcher->dirty = true;
+	}
+}
+
+static void add_entry(struct watcher *watcher, struct scan_dir *dir, const char *name)
+{
+	if (scan_dir_skips(dir, name)) {
+		/*
+		 * Skipped entries are the roots scanned before $HOME, which
+		 * must have just been created.
+		 */
+		watcher->rescan = true;
+		return;
+	}
+
+	/* Anything renamed over an existing entry replaces it. */
+	remove_entry(watcher, dir, name);
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir->path, name);
+	struct stat sb;
+	if (stat(path, &sb) == -1) {
+		return;
+	}
+	if (S_ISDIR(sb.st_mode)) {
+		struct scan_dir *subdir = scan_dir_add_subdir(&watcher->tree, &watcher->seen, dir, name);
+		if (subdir != NULL) {
+			add_watches(watcher, subdir);
+			watcher->dirty = true;
+		}
+	} else if (S_ISREG(sb.st_mode) && !scan_dir_ignores(&watcher->tree, dir, name, false)) {
+		scan_dir_add_file(dir, name);
+		watcher->dirty = true;
+	}
+}
+
+static void handle_event(struct watcher *watcher, const struct inotify_event *event)
+{
+	if (event->mask & IN_Q_OVERFLOW) {
+		log_debug("inotify queue overflowed.\n");
+		watcher->rescan = true;
+		return;
+	}
+	if (event->wd < 0 || (size_t)event->wd >= watcher->nwatches) {
+		return;
+	}
+	struct scan_dir *dir = watcher->watches[event->wd];
+	if (dir == NULL) {
+		return;
+	}
+
+	if (event->mask & IN_IGNORED) {
+		watcher->watches[event->wd] = NULL;
+		dir->watch = -1;
+		return;
+	}
+	if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+		/*
+		 * Subdirectories are dealt with when their parent sees them
+		 * go, but nothing's watching above the roots.
+		 */
+		if (is_root(watcher, dir)) {
+			watcher->rescan = true;
+		}
+		return;
+	}
+	if (event->len == 0) {
+		return;
+	}
+	if (watcher->tree.options.ignore_files
+			&& (strcmp(event->name, ".gitignore") == 0
+				|| strcmp(event->name, ".ignore") == 0)) {
+		log_debug("\"%s/%s\" has changed.\n", dir->path, event->name);
+		watcher->rescan = true;
+		watcher->rescan_all = true;
+	}
+
+	if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		remove_entry(watcher, dir, event->name);
+	} else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+		add_entry(watcher, dir, event->name);
+	}
+}
+
+static bool read_events(struct watcher *watcher)
+{
+	alignas(struct inotify_event) char buf[4096];
+	while (true) {
+		ssize_t len = read(watcher->fd, buf, sizeof(buf));
+		if (len == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				return true;
+			}
+			log_error("Failed to read inotify events: %s.\n", strerror(errno));
+			return false;
+		}
+		for (ssize_t i = 0; i < len; ) {
+			const struct inotify_event *event = (const struct inotify_event *)&buf[i];
+			handle_event(watcher, event);
+			i += sizeof(*event) + event->len;
+		}
+	}
+}
+
+int files_watch(void)
+{
+	char *cache_path = files_cache_path();
+	if (cache_path == NULL) {
+		log_error("Failed to get cache path.\n");
+		return EXIT_FAILURE;
+	}
+
+	int lock = files_watch_lock(cache_path);
+	if (lock == -1) {
+		log_error("sofi-files-watch is already running.\n");
+		free(cache_path);
+		return EXIT_FAILURE;
+	}
+
+	struct watcher watcher = {
+		.fd = -1,
+		.cache_path = cache_path
+	};
+	int ret = EXIT_FAILURE;
+	if (!rebuild(&watcher)) {
+		goto cleanup;
+	}
+
+	while (true) {
+		bool pending = watcher.dirty || watcher.rescan;
+		struct pollfd pfd = { .fd = watcher.fd, .events = POLLIN };
+		int res = poll(&pfd, 1, pending ? SETTLE_TIME_MS : -1);
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_error("Failed to poll inotify: %s.\n", strerror(errno));
+			break;
+		}
+		if (res == 0) {
+			/* Things have gone quiet. */
+			if (watcher.rescan) {
+				log_debug("Rescanning files.\n");
+				if (!rebuild(&watcher)) {
+					break;
+				}
+			} else if (watcher.dirty) {
+				write_index(&watcher);
+			}
+			continue;
+		}
+		if (!read_events(&watcher)) {
+			break;
+		}
+	}
+
+cleanup:
+	if (watcher.fd != -1) {
+		close(watcher.fd);
+	}
+	scan_tree_destroy(&watcher.tree);
+	scan_dir_set_destroy(&watcher.seen);
+	free(watcher.watches);
+	close(lock);
+	free(cache_path);
+	return ret;
+}
@@ -0,0 +1,10 @@
+#ifndef FILES_WATCH_H
+#define FILES_WATCH_H
+
+/*
+ * Keep the sofi-files index up to date as files are created, deleted and
+ * renamed, so that sofi-files never has to rescan. Runs until killed.
+ */
+int files_watch(void);
+
+#endif /* FILES_WATCH_H */
@@ -0,0 +1,137 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "filter_thread.h"
+#include "log.h"
+#include "xmalloc.h"
+
+void filter_request_run(
+		const struct filter_request *request,
+		const atomic_bool *cancel,
+		struct result_vec *results)
+{
+	const uint32_t *indices = NULL;
+	size_t count = request->commands->count;
+	if (request->mode == TOFI_MODE_DRUN) {
+		count = request->apps->count;
+	}
+	if (request->base != NULL) {
+		indices = request->base->index;
+		count = request->base->count;
+	}
+
+	switch (request->mode) {
+		case TOFI_MODE_DRUN:
+			/* Keywords have to be checked too, so filter the apps. */
+			desktop_vec_filter(
+					request->apps,
+					indices,
+					count,
+					request->query,
+					request->algorithm,
+					cancel,
+					results);
+			break;
+		case TOFI_MODE_FILES:
+			file_index_filter(
+					request->file_index,
+					request->commands,
+					indices,
+					count,
+					request->query,
+					request->algorithm,
+					cancel,
+					results);
+			break;
+		default:
+			if (indices == NULL) {
+				string_ref_vec_filter(
+						request->commands,
+						request->query,
+						request->algorithm,
+						cancel,
+						results);
+			} else {
+				string_ref_vec_filter_subset(
+						request->commands,
+						indices,
+						count,
+						request->query,
+						request->algorithm,
+						cancel,
+						results);
+			}
+			break;
+	}
+}
+
+static int filter_thread_run(void *arg)
+{
+	struct filter_thread *filter = arg;
+
+	filter_request_run(&filter->request, &filter->cancel, &filter->results);
+
+	uint64_t one = 1;
+	errno = 0;
+	if (write(filter->fd, &one, sizeof(one)) == -1) {
+		log_error("Failed to signal filter completion: %s.\n", strerror(errno));
+	}
+	return 0;
+}
+
+bool filter_thread_start(
+		struct filter_thread *filter,
+		const struct filter_request *request,
+		struct result_vec *results)
+{
+	*filter = (struct filter_thread){
+		.request = *request,
+		.query = xstrdup(request->query),
+		.results = *results,
+		.fd = -1
+	};
+	filter->request.query = filter->query;
+	atomic_init(&filter->cancel, false);
+
+	errno = 0;
+	filter->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (filter->fd == -1) {
+		log_error("Failed to create eventfd: %s.\n", strerror(errno));
+		free(filter->query);
+		return false;
+	}
+	if (thrd_create(&filter->thread, filter_thread_run, filter) != thrd_success) {
+		log_error("Failed to start filter thread.\n");
+		close(filter->fd);
+		filter->fd = -1;
+		free(filter->query);
+		return false;
+	}
+	*results = result_vec_create();
+	return true;
+}
+
+struct result_vec filter_thread_finish(struct filter_thread *filter)
+{
+	if (filter->fd == -1) {
+		return result_vec_create();
+	}
+	thrd_join(filter->thread, NULL);
+	close(filter->fd);
+	filter->fd = -1;
+	free(filter->query);
+	filter->query = NULL;
+	return filter->results;
+}
+
+struct result_vec filter_thread_cancel(struct filter_thread *filter)
+{
+	if (filter->fd == -1) {
+		return result_vec_create();
+	}
+	atomic_store(&filter->cancel, true);
+	return filter_thread_finish(filter);
+}
@@ -0,0 +1,88 @@
+#ifndef FILTER_THREAD_H
+#define FILTER_THREAD_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <threads.h>
+#include "desktop_vec.h"
+#include "entry.h"
+#include "file_index.h"
+#include "matching.h"
+#include "string_vec.h"
+
+/*
+ * Filtering a big enough list takes long enough to hold up key repeat and
+ * the compositor's pings, so it's done on a background thread instead, while
+ * the previous results stay on screen. fd is an eventfd that becomes readable
+ * when the results are ready, and is -1 when no filter is running.
+ *
+ * A newer keypress just cancels the running filter and starts another, as
+ * its results would be out of date by the time they were ready anyway.
+ */
+
+/*
+ * Everything needed to filter the results. Whatever it points to must be
+ * left alone until the filter's finished or been cancelled.
+ */
+struct filter_request {
+	enum tofi_mode mode;
+	enum matching_algorithm algorithm;
+	const char *query;
+
+	/*
+	 * Results for a prefix of the query, to filter just those, or NULL
+	 * to filter everything.
+	 */
+	const struct result_vec *base;
+
+	const struct string_ref_vec *commands;
+	const struct desktop_vec *apps;
+	const struct file_index *file_index;
+};
+
+struct filter_thread {
+	int fd;
+	thrd_t thread;
+	atomic_bool cancel;
+	struct filter_request request;
+
+	/* Our own copy of the query, as the input changes under us. */
+	char *query;
+
+	struct result_vec results;
+};
+
+/*
+ * Filter the results for request into results, straight away. If cancel is
+ * set part way through, the results are incomplete.
+ */
+void filter_request_run(
+		const struct filter_request *request,
+		const atomic_bool *cancel,
+		struct result_vec *results);
+
+/*
+ * Start filtering into results on a background thread, which takes them over.
+ * Returns false if that's not possible, in which case results are left alone,
+ * and the caller should just filter straight away.
+ */
+bool filter_thread_start(
+		struct filter_thread *filter,
+		const struct filter_request *request,
+		struct result_vec *results);
+
+/*
+ * Stop a running filter, if there is one. Its results are garbage, but the
+ * caller takes ownership of them, to reuse their memory.
+ */
+[[nodiscard("memory leaked")]]
+struct result_vec filter_thread_cancel(struct filter_thread *filter);
+
+/*
+ * Wait for a running filter to finish, which it has once fd is readable, and
+ * clean up after it. The caller takes ownership of the results.
+ */
+[[nodiscard("memory leaked")]]
+struct result_vec filter_thread_finish(struct filter_thread *filter);
+
+#endif /* FILTER_THREAD_H */
@@ -0,0 +1,242 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "cpu.h"
+#include "fuzzy_batch.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+/*
+ * A cell that can't be reached. This is far enough below any real score that
+ * adding every possible bonus along the way still leaves it below NONE / 2,
+ * which is what's checked for at the end, and far enough above INT16_MIN that
+ * the saturating adds never wrap it around.
+ */
+#define NONE (-16384)
+
+/*
+ * Lowercase pattern characters outside ASCII can't match anything, and
+ * neither can the 0s past the end of each string.
+ */
+static int16_t pattern_char(uint32_t c)
+{
+	return c < 128 ? (int16_t)c : -1;
+}
+
+static int32_t lane_best(int16_t best)
+{
+	return best > NONE / 2 ? best : INT32_MIN;
+}
+
+#ifndef __x86_64__
+
+static int16_t max16(int16_t a, int16_t b)
+{
+	return a > b ? a : b;
+}
+
+static int16_t adds16(int16_t a, int16_t b)
+{
+	int32_t sum = (int32_t)a + b;
+	if (sum > INT16_MAX) {
+		return INT16_MAX;
+	}
+	if (sum < INT16_MIN) {
+		return INT16_MIN;
+	}
+	return (int16_t)sum;
+}
+
+/*
+ * The same recurrence as fuzzy_match(), one lane at a time. Unreachable cells
+ * are NONE rather than INT32_MIN, so they can go through the same arithmetic
+ * as any other, and only need picking out at the end.
+ */
+static void run_scalar(
+		const struct fuzzy_batch *restrict batch,
+		const uint32_t *restrict pattern,
+		size_t plen,
+		int16_t adjacency_bonus,
+		int32_t best[FUZZY_BATCH_SIZE])
+{
+	const size_t slen = batch->max_len;
+	for (size_t lane = 0; lane < batch->count; lane++) {
+		int16_t rows[2][FUZZY_BATCH_MAX_LEN];
+		int16_t *cur = rows[0];
+		int16_t c = pattern_char(pattern[0]);
+		for (size_t i = 0; i < slen; i++) {
+			bool eq = batch->chars[i][lane] == c;
+			cur[i] = eq ? batch->first[i][lane] : NONE;
+		}
+		for (size_t k = 1; k < plen; k++) {
+			const int16_t *prev = cur;
+			cur = rows[k % 2];
+			c = pattern_char(pattern[k]);
+			int16_t best_before = NONE;
+			cur[0] = NONE;
+			for (size_t i = 1; i < slen; i++) {
+				if (i >= 2) {
+					best_before = max16(best_before, prev[i - 2]);
+				}
+				int16_t from = max16(best_before, adds16(prev[i - 1], adjacency_bonus));
+				bool eq = batch->chars[i][lane] == c;
+				cur[i] = eq ? adds16(from, batch->bonus[i][lane]) : NONE;
+			}
+		}
+		int16_t lane_max = NONE;
+		for (size_t i = 0; i < slen; i++) {
+			lane_max = max16(lane_max, cur[i]);
+		}
+		best[lane] = lane_best(lane_max);
+	}
+}
+
+#else
+
+/*
+ * SSE2 has no blend, so pick a where mask is set and NONE elsewhere with
+ * plain bitwise operations.
+ */
+static __m128i select_sse2(__m128i mask, __m128i a)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, _mm_set1_epi16(NONE)));
+}
+
+/* Run the lanes from half * 8 onwards, 8 at a time. */
+static void run_sse2_half(
+		const struct fuzzy_batch *restrict batch,
+		size_t half,
+		const uint32_t *restrict pattern,
+		size_t plen,
+		int16_t adjacency_bonus,
+		int32_t best[FUZZY_BATCH_SIZE])
+{
+	const size_t slen = batch->max_len;
+	const size_t off = half * 8;
+	const __m128i none = _mm_set1_epi16(NONE);
+	const __m128i adj = _mm_set1_epi16(adjacency_bonus);
+	__m128i rows[2][FUZZY_BATCH_MAX_LEN];
+
+	__m128i *cur = rows[0];
+	__m128i c = _mm_set1_epi16(pattern_char(pattern[0]));
+	for (size_t i = 0; i < slen; i++) {
+		__m128i chars = _mm_loadu_si128((const __m128i *)&batch->chars[i][off]);
+		__m128i first = _mm_loadu_si128((const __m128i *)&batch->first[i][off]);
+		cur[i] = select_sse2(_mm_cmpeq_epi16(chars, c), first);
+	}
+	for (size_t k = 1; k < plen; k++) {
+		const __m128i *prev = cur;
+		cur = rows[k % 2];
+		c = _mm_set1_epi16(pattern_char(pattern[k]));
+		__m128i best_before = none;
+		cur[0] = none;
+		for (size_t i = 1; i < slen; i++) {
+			if (i >= 2) {
+				best_before = _mm_max_epi16(best_before, prev[i - 2]);
+			}
+			__m128i from = _mm_max_epi16(best_before, _mm_adds_epi16(prev[i - 1], adj));
+			__m128i chars = _mm_loadu_si128((const __m128i *)&batch->chars[i][off]);
+			__m128i bonus = _mm_loadu_si128((const __m128i *)&batch->bonus[i][off]);
+			cur[i] = select_sse2(_mm_cmpeq_epi16(chars, c), _mm_adds_epi16(from, bonus));
+		}
+	}
+	__m128i lane_max = none;
+	for (size_t i = 0; i < slen; i++) {
+		lane_max = _mm_max_epi16(lane_max, cur[i]);
+	}
+	int16_t out[8];
+	_mm_storeu_si128((__m128i *)out, lane_max);
+	for (size_t lane = 0; lane < 8; lane++) {
+		best[off + lane] = lane_best(out[lane]);
+	}
+}
+
+static void run_sse2(
+		const struct fuzzy_batch *restrict batch,
+		const uint32_t *restrict pattern,
+		size_t plen,
+		int16_t adjacency_bonus,
+		int32_t best[FUZZY_BATCH_SIZE])
+{
+	run_sse2_half(batch, 0, pattern, plen, adjacency_bonus, best);
+	if (batch->count > 8) {
+		run_sse2_half(batch, 1, pattern, plen, adjacency_bonus, best);
+	}
+}
+
+[[gnu::target("avx2")]]
+static void run_avx2(
+		const struct fuzzy_batch *restrict batch,
+		const uint32_t *restrict pattern,
+		size_t plen,
+		int16_t adjacency_bonus,
+		int32_t best[FUZZY_BATCH_SIZE])
+{
+	const size_t slen = batch->max_len;
+	const __m256i none = _mm256_set1_epi16(NONE);
+	const __m256i adj = _mm256_set1_epi16(adjacency_bonus);
+	__m256i rows[2][FUZZY_BATCH_MAX_LEN];
+
+	__m256i *cur = rows[0];
+	__m256i c = _mm256_set1_epi16(pattern_char(pattern[0]));
+	for (size_t i = 0; i < slen; i++) {
+		__m256i chars = _mm256_loadu_si256((const __m256i *)batch->chars[i]);
+		__m256i first = _mm256_loadu_si256((const __m256i *)batch->first[i]);
+		cur[i] = _mm256_blendv_epi8(none, first, _mm256_cmpeq_epi16(chars, c));
+	}
+	for (size_t k = 1; k < plen; k++) {
+		const __m256i *prev = cur;
+		cur = rows[k % 2];
+		c = _mm256_set1_epi16(pattern_char(pattern[k]));
+		__m256i best_before = none;
+		cur[0] = none;
+		for (size_t i = 1; i < slen; i++) {
+			if (i >= 2) {
+				best_before = _mm256_max_epi16(best_before, prev[i - 2]);
+			}
+			__m256i from = _mm256_max_epi16(best_before, _mm256_adds_epi16(prev[i - 1], adj));
+			__m256i chars = _mm256_loadu_si256((const __m256i *)batch->chars[i]);
+			__m256i bonus = _mm256_loadu_si256((const __m256i *)batch->bonus[i]);
+			cur[i] = _mm256_blendv_epi8(
+					none,
+					_mm256_adds_epi16(from, bonus),
+					_mm256_cmpeq_epi16(chars, c));
+		}
+	}
+	__m256i lane_max = none;
+	for (size_t i = 0; i < slen; i++) {
+		lane_max = _mm256_max_epi16(lane_max, cur[i]);
+	}
+	int16_t out[FUZZY_BATCH_SIZE];
+	_mm256_storeu_si256((__m256i *)out, lane_max);
+	for (size_t lane = 0; lane < FUZZY_BATCH_SIZE; lane++) {
+		best[lane] = lane_best(out[lane]);
+	}
+}
+
+#endif /* __x86_64__ */
+
+void fuzzy_batch_run(
+		const struct fuzzy_batch *restrict batch,
+		const uint32_t *restrict pattern,
+		size_t plen,
+		int16_t adjacency_bonus,
+		int32_t best[FUZZY_BATCH_SIZE])
+{
+	if (plen == 0 || plen > batch->max_len) {
+		for (size_t lane = 0; lane < FUZZY_BATCH_SIZE; lane++) {
+			best[lane] = INT32_MIN;
+		}
+		return;
+	}
+#ifdef __x86_64__
+	if (batch->count > 8 && cpu_has_avx2()) {
+		run_avx2(batch, pattern, plen, adjacency_bonus, best);
+		return;
+	}
+	run_sse2(batch, pattern, plen, adjacency_bonus, best);
+#else
+	run_scalar(batch, pattern, plen, adjacency_bonus, best);
+#endif
+}
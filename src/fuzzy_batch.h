@@ -0,0 +1,53 @@
+#ifndef FUZZY_BATCH_H
+#define FUZZY_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Fuzzy matching fills in a table of scores for each string, with a cell for
+ * each pair of characters of the pattern and the string. For short strings,
+ * like command names, the table's so small that most of the time goes on
+ * getting started and looping rather than on the cells themselves. Instead,
+ * a batch of up to FUZZY_BATCH_SIZE short strings is laid out side by side,
+ * each in its own lane, so that the same cell of every string's table can be
+ * worked out at once, with each lane a 16-bit integer.
+ *
+ * On x86-64, that's 8 lanes at a time with SSE2, or all 16 with AVX2 where
+ * the CPU has it. Elsewhere, it's a plain loop over the lanes.
+ */
+#define FUZZY_BATCH_SIZE 16
+#define FUZZY_BATCH_MAX_LEN 32
+
+struct fuzzy_batch {
+	size_t count;
+
+	/* The length of each string, and of the longest. */
+	uint32_t len[FUZZY_BATCH_SIZE];
+	size_t max_len;
+
+	/*
+	 * For each position, the character there in each string, lowercased,
+	 * the score for matching it as the first character of the pattern,
+	 * and the bonus for matching it as any other. Positions past the end
+	 * of a string hold 0, which matches nothing.
+	 */
+	int16_t chars[FUZZY_BATCH_MAX_LEN][FUZZY_BATCH_SIZE];
+	int16_t first[FUZZY_BATCH_MAX_LEN][FUZZY_BATCH_SIZE];
+	int16_t bonus[FUZZY_BATCH_MAX_LEN][FUZZY_BATCH_SIZE];
+};
+
+/*
+ * Find the best score of the lowercased pattern against each string in the
+ * batch, before any penalty for unmatched characters, or INT32_MIN where the
+ * pattern isn't found. A character directly following the previous one's
+ * match gets adjacency_bonus on top of its own bonus.
+ */
+void fuzzy_batch_run(
+		const struct fuzzy_batch *restrict batch,
+		const uint32_t *restrict pattern,
+		size_t plen,
+		int16_t adjacency_bonus,
+		int32_t best[FUZZY_BATCH_SIZE]);
+
+#endif /* FUZZY_BATCH_H */
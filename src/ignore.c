@@ -0,0 +1,599 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ignore.h"
+#include "xmalloc.h"
+
+/*
+ * Automaton states. Each state matches one character (or, for the
+ * wildcards, a run of them) and moves on to the next, so each pattern is
+ * just a run of states ending in a match.
+ */
+enum glob_op {
+	GLOB_CHAR,
+	/* "?", any character but "/". */
+	GLOB_ANY,
+	/* "[...]", any character in classes[arg] but "/". */
+	GLOB_CLASS,
+	/* "*", any run of characters without a "/". */
+	GLOB_STAR,
+	/* "**\/", any run of whole directories, including none. */
+	GLOB_DIRS,
+	/* A trailing "**", anything at all. */
+	GLOB_ALL,
+	/* The end of rule arg. */
+	GLOB_MATCH
+};
+
+/* Enough states to check most sets of rules without allocating. */
+#define STACK_WORDS 16
+
+static uint64_t hash_name(const char *name)
+{
+	/* FNV-1a */
+	uint64_t hash = 0xcbf29ce484222325u;
+	for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; c++) {
+		hash ^= *c;
+		hash *= 0x100000001b3u;
+	}
+	return hash;
+}
+
+static bool same_parent(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL) {
+		return a == b;
+	}
+	return strcmp(a, b) == 0;
+}
+
+static size_t literal_slot(
+		const struct ignore_literal *buf,
+		size_t size,
+		const char *name,
+		const char *parent)
+{
+	size_t i = hash_name(name) & (size - 1);
+	while (buf[i].name != NULL
+			&& (strcmp(buf[i].name, name) != 0 || !same_parent(buf[i].parent, parent))) {
+		i = (i + 1) & (size - 1);
+	}
+	return i;
+}
+
+static void add_literal(
+		struct ignore *ignore,
+		const char *name,
+		const char *parent,
+		int32_t rule,
+		bool dir_only)
+{
+	if (ignore->literals_size == 0) {
+		ignore->literals_size = 16;
+		ignore->literals = xcalloc(ignore->literals_size, sizeof(*ignore->literals));
+	}
+	size_t i = literal_slot(ignore->literals, ignore->literals_size, name, parent);
+	struct ignore_literal *literal = &ignore->literals[i];
+	if (literal->name == NULL) {
+		*literal = (struct ignore_literal){
+			.name = xstrdup(name),
+			.parent = parent == NULL ? NULL : xstrdup(parent),
+			.rule = -1,
+			.dir_rule = -1
+		};
+		ignore->nliterals++;
+	}
+	if (dir_only) {
+		literal->dir_rule = rule;
+	} else {
+		literal->rule = rule;
+	}
+
+	if (ignore->nliterals > ignore->literals_size / 2) {
+		size_t size = ignore->literals_size * 2;
+		struct ignore_literal *buf = xcalloc(size, sizeof(*buf));
+		for (size_t j = 0; j < ignore->literals_size; j++) {
+			struct ignore_literal *old = &ignore->literals[j];
+			if (old->name != NULL) {
+				buf[literal_slot(buf, size, old->name, old->parent)] = *old;
+			}
+		}
+		free(ignore->literals);
+		ignore->literals = buf;
+		ignore->literals_size = size;
+	}
+}
+
+/*
+ * Find the last plain rule matching the entry called name in the directory
+ * at rel, relative to the base. Entries sharing a name sit next to each
+ * other, so they're all checked.
+ */
+static int32_t match_literal(const struct ignore *ignore, const char *rel, const char *name, bool is_dir)
+{
+	int32_t best = -1;
+	size_t size = ignore->literals_size;
+	size_t i = hash_name(name) & (size - 1);
+	for (; ignore->literals[i].name != NULL; i = (i + 1) & (size - 1)) {
+		const struct ignore_literal *literal = &ignore->literals[i];
+		if (strcmp(literal->name, name) != 0
+				|| (literal->parent != NULL && strcmp(literal->parent, rel) != 0)) {
+			continue;
+		}
+		if (literal->rule > best) {
+			best = literal->rule;
+		}
+		if (is_dir && literal->dir_rule > best) {
+			best = literal->dir_rule;
+		}
+	}
+	return best;
+}
+
+static void glob_emit(struct ignore_glob *glob, enum glob_op op, uint8_t c, uint32_t arg)
+{
+	if (glob->count == glob->size) {
+		glob->size = glob->size ? glob->size * 2 : 32;
+		glob->states = xrealloc(glob->states, glob->size * sizeof(*glob->states));
+	}
+	glob->states[glob->count++] = (struct ignore_glob_state){
+		.op = op,
+		.c = c,
+		.arg = arg
+	};
+}
+
+static void class_set(uint64_t *class, unsigned char c)
+{
+	class[c / 64] |= (uint64_t)1 << (c % 64);
+}
+
+static bool class_has(const uint64_t *class, unsigned char c)
+{
+	return class[c / 64] & ((uint64_t)1 << (c % 64));
+}
+
+/*
+ * Compile the character class starting at pattern[i] (the "["), returning
+ * the index just past it, or 0 if it's not terminated.
+ */
+static size_t glob_emit_class(struct ignore_glob *glob, const char *pattern, size_t len, size_t i)
+{
+	uint64_t class[4] = { 0 };
+	size_t j = i + 1;
+	bool negate = j < len && (pattern[j] == '!' || pattern[j] == '^');
+	if (negate) {
+		j++;
+	}
+	/* A "]" straight after the opening bracket is literal. */
+	bool first = true;
+	while (j < len && (pattern[j] != ']' || first)) {
+		first = false;
+		unsigned char lo = pattern[j];
+		if (lo == '\\' && j + 1 < len) {
+			lo = pattern[++j];
+		}
+		j++;
+		unsigned char hi = lo;
+		if (j + 1 < len && pattern[j] == '-' && pattern[j + 1] != ']') {
+			hi = pattern[j + 1];
+			if (hi == '\\' && j + 2 < len) {
+				hi = pattern[j + 2];
+				j++;
+			}
+			j += 2;
+		}
+		for (unsigned int c = lo; c <= hi; c++) {
+			class_set(class, c);
+		}
+	}
+	if (j >= len) {
+		return 0;
+	}
+	if (negate) {
+		for (size_t k = 0; k < 4; k++) {
+			class[k] = ~class[k];
+		}
+	}
+
+	glob->classes = xrealloc(glob->classes, (glob->nclasses + 1) * sizeof(*glob->classes));
+	memcpy(glob->classes[glob->nclasses], class, sizeof(class));
+	glob_emit(glob, GLOB_CLASS, 0, glob->nclasses);
+	glob->nclasses++;
+	return j + 1;
+}
+
+static void glob_add_pattern(
+		struct ignore_glob *glob,
+		const char *pattern,
+		size_t len,
+		bool anchored,
+		int32_t rule,
+		bool dir_only)
+{
+	glob->starts = xrealloc(glob->starts, (glob->nstarts + 1) * sizeof(*glob->starts));
+	glob->starts[glob->nstarts++] = glob->count;
+
+	/* Anchored patterns are matched against paths starting with "/". */
+	if (anchored) {
+		glob_emit(glob, GLOB_CHAR, '/', 0);
+	}
+	size_t i = 0;
+	while (i < len) {
+		char c = pattern[i];
+		if (c == '*') {
+			size_t n = 1;
+			while (i + n < len && pattern[i + n] == '*') {
+				n++;
+			}
+			bool whole = anchored && n == 2 && (i == 0 || pattern[i - 1] == '/');
+			if (whole && i + 2 == len) {
+				glob_emit(glob, GLOB_ALL, 0, 0);
+				i += 2;
+			} else if (whole && pattern[i + 2] == '/') {
+				glob_emit(glob, GLOB_DIRS, 0, 0);
+				i += 3;
+			} else {
+				glob_emit(glob, GLOB_STAR, 0, 0);
+				i += n;
+			}
+			continue;
+		}
+		if (c == '?') {
+			glob_emit(glob, GLOB_ANY, 0, 0);
+			i++;
+			continue;
+		}
+		if (c == '[') {
+			size_t next = glob_emit_class(glob, pattern, len, i);
+			if (next != 0) {
+				i = next;
+				continue;
+			}
+		}
+		if (c == '\\' && i + 1 < len) {
+			c = pattern[++i];
+		}
+		glob_emit(glob, GLOB_CHAR, c, 0);
+		i++;
+	}
+	glob_emit(glob, GLOB_MATCH, 0, rule);
+	glob->states[glob->count - 1].dir_only = dir_only;
+}
+
+/*
+ * Add state s to set, along with everything reachable without input. A
+ * "**\/" is only ever reached at the start of a name, where it can match no
+ * directories at all.
+ */
+static void glob_add_state(const struct ignore_glob *glob, uint64_t *set, uint32_t s)
+{
+	while (!(set[s / 64] & ((uint64_t)1 << (s % 64)))) {
+		set[s / 64] |= (uint64_t)1 << (s % 64);
+		enum glob_op op = glob->states[s].op;
+		if (op != GLOB_STAR && op != GLOB_DIRS && op != GLOB_ALL) {
+			break;
+		}
+		s++;
+	}
+}
+
+/*
+ * Run the automaton over the concatenation of parts, returning the last rule
+ * that matches, or -1.
+ */
+static int32_t glob_match(const struct ignore_glob *glob, const char *const *parts, size_t nparts, bool is_dir)
+{
+	size_t words = (glob->count + 63) / 64;
+	uint64_t stack[2 * STACK_WORDS];
+	uint64_t *buf = stack;
+	if (words > STACK_WORDS) {
+		buf = xmalloc(2 * words * sizeof(*buf));
+	}
+	uint64_t *cur = buf;
+	uint64_t *next = buf + words;
+	memset(cur, 0, words * sizeof(*cur));
+	for (size_t i = 0; i < glob->nstarts; i++) {
+		glob_add_state(glob, cur, glob->starts[i]);
+	}
+
+	bool alive = true;
+	for (size_t p = 0; p < nparts && alive; p++) {
+		for (const char *str = parts[p]; *str != '\0' && alive; str++) {
+			unsigned char c = *str;
+			memset(next, 0, words * sizeof(*next));
+			alive = false;
+			for (size_t w = 0; w < words; w++) {
+				uint64_t bits = cur[w];
+				while (bits != 0) {
+					uint32_t s = w * 64 + __builtin_ctzll(bits);
+					bits &= bits - 1;
+					const struct ignore_glob_state *state = &glob->states[s];
+					bool advance = false;
+					switch (state->op) {
+						case GLOB_CHAR:
+							advance = c == state->c;
+							break;
+						case GLOB_ANY:
+							advance = c != '/';
+							break;
+						case GLOB_CLASS:
+							advance = c != '/' && class_has(glob->classes[state->arg], c);
+							break;
+						case GLOB_STAR:
+							if (c != '/') {
+								glob_add_state(glob, next, s);
+								alive = true;
+							}
+							break;
+						case GLOB_DIRS:
+							/*
+							 * The rest of the pattern can only
+							 * start again at the beginning of a
+							 * name, straight after a "/".
+							 */
+							if (c == '/') {
+								glob_add_state(glob, next, s);
+							} else {
+								next[s / 64] |= (uint64_t)1 << (s % 64);
+							}
+							alive = true;
+							break;
+						case GLOB_ALL:
+							glob_add_state(glob, next, s);
+							alive = true;
+							break;
+						case GLOB_MATCH:
+							break;
+					}
+					if (advance) {
+						glob_add_state(glob, next, s + 1);
+						alive = true;
+					}
+				}
+			}
+			uint64_t *tmp = cur;
+			cur = next;
+			next = tmp;
+		}
+	}
+
+	int32_t best = -1;
+	for (size_t w = 0; w < words && alive; w++) {
+		uint64_t bits = cur[w];
+		while (bits != 0) {
+			uint32_t s = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			const struct ignore_glob_state *state = &glob->states[s];
+			if (state->op == GLOB_MATCH
+					&& (is_dir || !state->dir_only)
+					&& (int32_t)state->arg > best) {
+				best = state->arg;
+			}
+		}
+	}
+	if (buf != stack) {
+		free(buf);
+	}
+	return best;
+}
+
+static void glob_destroy(struct ignore_glob *glob)
+{
+	free(glob->states);
+	free(glob->classes);
+	free(glob->starts);
+}
+
+struct ignore *ignore_create(const char *base)
+{
+	struct ignore *ignore = xcalloc(1, sizeof(*ignore));
+	ignore->base = xstrdup(base);
+	ignore->base_len = strlen(base);
+	return ignore;
+}
+
+void ignore_destroy(struct ignore *ignore)
+{
+	for (size_t i = 0; i < ignore->literals_size; i++) {
+		free(ignore->literals[i].name);
+		free(ignore->literals[i].parent);
+	}
+	free(ignore->literals);
+	glob_destroy(&ignore->names);
+	glob_destroy(&ignore->paths);
+	free(ignore->negate);
+	free(ignore->base);
+	free(ignore);
+}
+
+/* Copy a plain pattern, removing any escapes. */
+[[nodiscard("memory leaked")]]
+static char *unescape(const char *pattern, size_t len)
+{
+	char *str = xmalloc(len + 1);
+	size_t n = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (pattern[i] == '\\' && i + 1 < len) {
+			i++;
+		}
+		str[n++] = pattern[i];
+	}
+	str[n] = '\0';
+	return str;
+}
+
+static bool is_glob(const char *pattern, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		if (pattern[i] == '\\') {
+			i++;
+		} else if (pattern[i] == '*' || pattern[i] == '?' || pattern[i] == '[') {
+			return true;
+		}
+	}
+	return false;
+}
+
+void ignore_add_rule(struct ignore *ignore, const char *rule)
+{
+	size_t len = strlen(rule);
+
+	/* Trailing whitespace is ignored, unless it's escaped. */
+	while (len > 0 && strchr(" \t\r\n", rule[len - 1]) != NULL) {
+		if (rule[len - 1] == ' ' && len > 1 && rule[len - 2] == '\\') {
+			break;
+		}
+		len--;
+	}
+	if (len == 0 || rule[0] == '#') {
+		return;
+	}
+
+	bool negate = rule[0] == '!';
+	if (negate) {
+		rule++;
+		len--;
+	}
+	bool dir_only = len > 0 && rule[len - 1] == '/';
+	if (dir_only) {
+		len--;
+	}
+
+	/* A slash anywhere else anchors the rule to the base directory. */
+	bool anchored = memchr(rule, '/', len) != NULL;
+	if (len > 0 && rule[0] == '/') {
+		rule++;
+		len--;
+	}
+	if (len == 0) {
+		return;
+	}
+
+	if (ignore->nrules == ignore->rules_size) {
+		ignore->rules_size = ignore->rules_size ? ignore->rules_size * 2 : 16;
+		ignore->negate = xrealloc(ignore->negate, ignore->rules_size * sizeof(*ignore->negate));
+	}
+	int32_t index = ignore->nrules++;
+	ignore->negate[index] = negate;
+
+	if (is_glob(rule, len)) {
+		glob_add_pattern(
+				anchored ? &ignore->paths : &ignore->names,
+				rule,
+				len,
+				anchored,
+				index,
+				dir_only);
+		return;
+	}
+
+	char *name = unescape(rule, len);
+	if (!anchored) {
+		add_literal(ignore, name, NULL, index, dir_only);
+		free(name);
+		return;
+	}
+
+	/* Split "a/b/c" into the parent "/a/b" and the name "c". */
+	char *slash = strrchr(name, '/');
+	char *parent;
+	if (slash == NULL) {
+		parent = xstrdup("");
+		slash = name - 1;
+	} else {
+		*slash = '\0';
+		size_t parent_len = strlen(name) + 2;
+		parent = xmalloc(parent_len);
+		snprintf(parent, parent_len, "/%s", name);
+	}
+	add_literal(ignore, slash + 1, parent, index, dir_only);
+	free(parent);
+	free(name);
+}
+
+void ignore_add_list(struct ignore *ignore, const char *list)
+{
+	const char *home = getenv("HOME");
+	char *copy = xstrdup(list);
+	char *saveptr = NULL;
+	char *rule = strtok_r(copy, ",", &saveptr);
+	while (rule != NULL) {
+		while (*rule == ' ' || *rule == '\t') {
+			rule++;
+		}
+		const char *negate = "";
+		if (rule[0] == '!') {
+			negate = "!";
+			rule++;
+		}
+		if (rule[0] == '~' && rule[1] == '/' && home != NULL) {
+			size_t len = strlen(negate) + strlen(home) + strlen(rule);
+			char *expanded = xmalloc(len);
+			snprintf(expanded, len, "%s%s%s", negate, home, &rule[1]);
+			ignore_add_rule(ignore, expanded);
+			free(expanded);
+		} else {
+			if (negate[0] != '\0') {
+				rule--;
+			}
+			ignore_add_rule(ignore, rule);
+		}
+		rule = strtok_r(NULL, ",", &saveptr);
+	}
+	free(copy);
+}
+
+bool ignore_add_file(struct ignore *ignore, int dirfd, const char *name)
+{
+	int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	FILE *fp = fdopen(fd, "rb");
+	if (fp == NULL) {
+		close(fd);
+		return false;
+	}
+	char *line = NULL;
+	size_t size = 0;
+	while (getline(&line, &size, fp) != -1) {
+		ignore_add_rule(ignore, line);
+	}
+	free(line);
+	fclose(fp);
+	return true;
+}
+
+enum ignore_result ignore_match(
+		const struct ignore *ignore,
+		const char *dir_path,
+		const char *name,
+		bool is_dir)
+{
+	const char *rel = &dir_path[ignore->base_len];
+	int32_t best = -1;
+	if (ignore->nliterals > 0) {
+		best = match_literal(ignore, rel, name, is_dir);
+	}
+	if (ignore->names.nstarts > 0) {
+		const char *parts[] = { name };
+		int32_t rule = glob_match(&ignore->names, parts, 1, is_dir);
+		if (rule > best) {
+			best = rule;
+		}
+	}
+	if (ignore->paths.nstarts > 0) {
+		const char *parts[] = { rel, "/", name };
+		int32_t rule = glob_match(&ignore->paths, parts, 3, is_dir);
+		if (rule > best) {
+			best = rule;
+		}
+	}
+	if (best < 0) {
+		return IGNORE_NO_MATCH;
+	}
+	return ignore->negate[best] ? IGNORE_INCLUDE : IGNORE_EXCLUDE;
+}
@@ -0,0 +1,113 @@
+#ifndef IGNORE_H
+#define IGNORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A set of gitignore-style rules, compiled so that checking an entry never
+ * means comparing it against each rule in turn.
+ *
+ * Rules that are plain names or paths go in a hash set keyed by their last
+ * component, so checking one costs a single lookup of the entry's name.
+ * Rules with wildcards are combined into two automata, one run over the
+ * entry's name, for rules without a slash, and one over its path relative to
+ * the directory the rules came from, for those with one.
+ *
+ * As with git, later rules take precedence over earlier ones, a leading "!"
+ * re-includes anything excluded by an earlier rule, a trailing "/" only
+ * matches directories, and "**" matches any number of directories.
+ */
+
+enum ignore_result {
+	IGNORE_NO_MATCH,
+	IGNORE_EXCLUDE,
+	IGNORE_INCLUDE
+};
+
+struct ignore_literal {
+	char *name;
+
+	/*
+	 * Relative path of the directory the name must be in, starting with
+	 * a "/" (or empty for the base directory), or NULL for anywhere.
+	 */
+	char *parent;
+
+	/* The last rule matching anything, and only directories, or -1. */
+	int32_t rule;
+	int32_t dir_rule;
+};
+
+struct ignore_glob_state {
+	uint8_t op;
+	uint8_t c;
+	bool dir_only;
+	uint32_t arg;
+};
+
+/* A nondeterministic automaton matching several patterns at once. */
+struct ignore_glob {
+	size_t count;
+	size_t size;
+	struct ignore_glob_state *states;
+
+	/* 256-bit character classes, for "[...]". */
+	size_t nclasses;
+	uint64_t (*classes)[4];
+
+	/* The first state of each pattern. */
+	size_t nstarts;
+	uint32_t *starts;
+};
+
+struct ignore {
+	/* Directory the rules are relative to, "" for the filesystem root. */
+	char *base;
+	size_t base_len;
+
+	/* Whether each rule re-includes rather than excludes. */
+	size_t nrules;
+	size_t rules_size;
+	bool *negate;
+
+	/* Hash set of the plain rules. */
+	size_t nliterals;
+	size_t literals_size;
+	struct ignore_literal *literals;
+
+	struct ignore_glob names;
+	struct ignore_glob paths;
+};
+
+[[nodiscard("memory leaked")]]
+struct ignore *ignore_create(const char *base);
+void ignore_destroy(struct ignore *ignore);
+
+/*
+ * Add a single rule, in .gitignore syntax. Blank lines and comments are
+ * skipped.
+ */
+void ignore_add_rule(struct ignore *ignore, const char *rule);
+
+/* Add every rule in a comma-separated list, expanding a leading "~/". */
+void ignore_add_list(struct ignore *ignore, const char *list);
+
+/*
+ * Add the rules from the file called name in the directory open at dirfd.
+ * Returns false if it couldn't be read.
+ */
+bool ignore_add_file(struct ignore *ignore, int dirfd, const char *name);
+
+/*
+ * Check the entry called name in the directory at dir_path, which must be
+ * the rules' base directory or below it.
+ */
+enum ignore_result ignore_match(
+		const struct ignore *ignore,
+		const char *dir_path,
+		const char *name,
+		bool is_dir);
+
+#endif /* IGNORE_H */
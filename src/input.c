@@ -2,12 +2,23 @@
 #include <fcntl.h>
 #include <linux/input-event-codes.h>
 #include <unistd.h>
+#include "filter_thread.h"
 #include "input.h"
 #include "log.h"
 #include "nelem.h"
 #include "sofi.h"
 #include "unicode.h"
+#include "xmalloc.h"
 
+/*
+ * Cap on the memory used by the results saved for earlier prefixes of the
+ * input. Short prefixes can match most of a huge list, so they're the first
+ * to go, and are no slower to redo than they were the first time.
+ */
+#define MAX_PREFIX_BYTES (64 * 1024 * 1024)
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 static uint32_t keysym_to_key(xkb_keysym_t sym);
 static void add_character(struct sofi *sofi, xkb_keycode_t keycode);
@@ -102,10 +113,6 @@ void input_handle_keypress(struct sofi *sofi, xkb_keycode_t keycode)
 		return;
 	}
 
-	if (sofi->auto_accept_single && sofi->window.entry.results.count == 1) {
-		sofi->submit = true;
-	}
-
 	sofi->window.surface.redraw = true;
 }
 
@@ -173,6 +180,307 @@ void reset_selection(struct sofi *sofi)
 	entry->first_result = 0;
 }
 
+static bool starts_with(const char *str, const char *prefix)
+{
+	return strncmp(str, prefix, strlen(prefix)) == 0;
+}
+
+/*
+ * Save results as those for query, a prefix of the input, taking ownership of
+ * them.
+ */
+static void push_results(struct entry *entry, const char *query, struct result_vec results)
+{
+	if (entry->prefix_count == entry->prefix_size) {
+		entry->prefix_size = entry->prefix_size ? 2 * entry->prefix_size : 16;
+		entry->prefixes = xrealloc(
+				entry->prefixes,
+				entry->prefix_size * sizeof(*entry->prefixes));
+	}
+	entry->prefixes[entry->prefix_count++] = (struct prefix_results){
+		.query = xstrdup(query),
+		.results = results
+	};
+	entry->prefix_bytes += result_vec_bytes(&results);
+
+	/* Keep the newest results, even if they're over the limit by themselves. */
+	size_t ndrop = 0;
+	while (entry->prefix_bytes > MAX_PREFIX_BYTES && ndrop + 1 < entry->prefix_count) {
+		struct prefix_results *prefix = &entry->prefixes[ndrop++];
+		entry->prefix_bytes -= result_vec_bytes(&prefix->results);
+		free(prefix->query);
+		result_vec_destroy(&prefix->results);
+	}
+	entry->prefix_count -= ndrop;
+	memmove(entry->prefixes, &entry->prefixes[ndrop], entry->prefix_count * sizeof(*entry->prefixes));
+}
+
+/* Take back the results for the longest saved prefix. */
+[[nodiscard("memory leaked")]]
+static struct result_vec pop_results(struct entry *entry)
+{
+	struct prefix_results *prefix = &entry->prefixes[--entry->prefix_count];
+	entry->prefix_bytes -= result_vec_bytes(&prefix->results);
+	free(prefix->query);
+	return prefix->results;
+}
+
+/* Keep the bigger of results and the spare ones, for reuse, taking ownership. */
+static void recycle_results(struct entry *entry, struct result_vec results)
+{
+	if (results.size > entry->spare_results.size) {
+		struct result_vec tmp = entry->spare_results;
+		entry->spare_results = results;
+		results = tmp;
+	}
+	result_vec_destroy(&results);
+}
+
+/* Take the spare results, to filter into. */
+[[nodiscard("memory leaked")]]
+static struct result_vec take_spare_results(struct entry *entry)
+{
+	struct result_vec results = entry->spare_results;
+	entry->spare_results = result_vec_create();
+	return results;
+}
+
+static void drop_prefix(struct entry *entry)
+{
+	struct result_vec results = pop_results(entry);
+	if (entry->results_shared && results.index == entry->results.index) {
+		/* They're still on show, so they're just the shown results' again. */
+		entry->results_shared = false;
+		return;
+	}
+	recycle_results(entry, results);
+}
+
+static void cancel_filter(struct sofi *sofi)
+{
+	recycle_results(&sofi->window.entry, filter_thread_cancel(&sofi->filter));
+}
+
+void input_clear_prefix_results(struct sofi *sofi)
+{
+	struct entry *entry = &sofi->window.entry;
+
+	/* A running filter could be looking at any of them. */
+	cancel_filter(sofi);
+
+	while (entry->prefix_count > 0) {
+		drop_prefix(entry);
+	}
+	free(entry->prefixes);
+	entry->prefixes = NULL;
+	entry->prefix_size = 0;
+}
+
+/*
+ * Work out how to filter against the current input, starting from the results
+ * for the longest saved prefix of it, if there are any. With approximate
+ * matching, a prefix whose words allow fewer typos won't have matched
+ * everything the input does, so the next one down has to do instead.
+ */
+static struct filter_request filter_request(struct sofi *sofi)
+{
+	struct entry *entry = &sofi->window.entry;
+	struct filter_request request = {
+		.mode = entry->mode,
+		.algorithm = sofi->matching_algorithm,
+		.query = entry->input_utf8,
+		.commands = &entry->commands,
+		.apps = &entry->apps,
+		.file_index = &entry->file_index
+	};
+	for (size_t i = entry->prefix_count; i > 0; i--) {
+		struct prefix_results *prefix = &entry->prefixes[i - 1];
+		if (match_words_narrow(request.algorithm, prefix->query, request.query)) {
+			request.base = &prefix->results;
+			break;
+		}
+	}
+	return request;
+}
+
+void input_save_selection(struct sofi *sofi)
+{
+	struct entry *entry = &sofi->window.entry;
+	if (entry->reloading || entry->results.count == 0) {
+		/* Anything selected before an earlier reload is still kept. */
+		return;
+	}
+	uint32_t selection = entry->first_result + entry->selection;
+	string_ref_vec_rank(&entry->commands, &entry->results_query, &entry->results, selection + 1);
+	uint32_t index = result_vec_nth(&entry->results, selection);
+	entry->reload_selection = xstrdup(entry->commands.buf[index].string);
+}
+
+/*
+ * Select the result saved by input_save_selection() again, if it's still
+ * there. It could be anywhere in the list, so it's looked for unranked first,
+ * and then only as much of the list is ranked as it takes to find it.
+ */
+static void restore_selection(struct entry *entry)
+{
+	char *selection = entry->reload_selection;
+	entry->reload_selection = NULL;
+	if (selection == NULL) {
+		return;
+	}
+	bool found = false;
+	for (size_t i = 0; i < entry->results.count && !found; i++) {
+		found = strcmp(entry->commands.buf[entry->results.index[i]].string, selection) == 0;
+	}
+	uint32_t nsel = MAX(MIN(entry->num_results_drawn, entry->results.count), 1);
+	size_t nranked = 0;
+	for (size_t i = 0; found && i < entry->results.count; i++) {
+		if (i == nranked) {
+			nranked = MIN(MAX(2 * nranked, nsel), entry->results.count);
+			string_ref_vec_rank(&entry->commands, &entry->results_query, &entry->results, nranked);
+		}
+		uint32_t index = result_vec_nth(&entry->results, i);
+		if (strcmp(entry->commands.buf[index].string, selection) == 0) {
+			entry->first_result = i / nsel * nsel;
+			entry->selection = i % nsel;
+			break;
+		}
+	}
+	free(selection);
+}
+
+/*
+ * Show results, which are for the current input. This is the only place the
+ * current input's results are known, so it's where a single one gets
+ * accepted, rather than on the keypress, which may have left older results on
+ * show while a filter runs.
+ */
+static void set_results(struct sofi *sofi, struct result_vec results)
+{
+	struct entry *entry = &sofi->window.entry;
+	if (entry->results_shared) {
+		/* Only the ranking is theirs, the rest is the saved prefix's. */
+		free(entry->results.ranked);
+		entry->results_shared = false;
+	} else {
+		recycle_results(entry, entry->results);
+	}
+	entry->results = results;
+	memcpy(entry->results_input, entry->input_utf8, entry->input_utf8_length + 1);
+	match_query_destroy(&entry->results_query);
+	entry->results_query = match_query_create(sofi->matching_algorithm, entry->results_input);
+	reset_selection(sofi);
+	restore_selection(entry);
+	entry->reloading = false;
+
+	if (sofi->auto_accept_single && entry->results.count == 1 && sofi->filter.fd == -1) {
+		sofi->submit = true;
+	}
+}
+
+/*
+ * Bring the results up to date with the input, which has just changed.
+ *
+ * Lists too short to be worth the bother are filtered straight away. Longer
+ * ones are filtered in the background, with the current results left on show
+ * until input_finish_results() is called.
+ */
+static void update_results(struct sofi *sofi)
+{
+	struct entry *entry = &sofi->window.entry;
+
+	/* Whatever's being filtered is out of date now. */
+	cancel_filter(sofi);
+	if (strcmp(entry->results_input, entry->input_utf8) == 0) {
+		if (!entry->reloading) {
+			return;
+		}
+	} else {
+		/* The selection's reset by typing, so don't bring it back. */
+		free(entry->reload_selection);
+		entry->reload_selection = NULL;
+	}
+
+	/*
+	 * Drop back to the results for the longest prefix the edit left
+	 * alone, which are either exactly what we want, or a head start on
+	 * filtering.
+	 */
+	while (entry->prefix_count > 0
+			&& !starts_with(entry->input_utf8, entry->prefixes[entry->prefix_count - 1].query)) {
+		drop_prefix(entry);
+	}
+	if (entry->prefix_count > 0
+			&& strcmp(entry->prefixes[entry->prefix_count - 1].query, entry->input_utf8) == 0) {
+		set_results(sofi, pop_results(entry));
+		return;
+	}
+
+	/*
+	 * If the results on show are for a longer prefix still (e.g. after
+	 * typing another character), they're a better place to start, and
+	 * worth keeping for when the input's cut back to them. Results for
+	 * the empty query are just the commands, so aren't worth keeping.
+	 *
+	 * They stay on show until the new results are ready though, so rather
+	 * than copying them, they're shared with the saved prefix. Filtering
+	 * only reads which commands they are, so only the ranking done to show
+	 * them needs keeping apart, and that stays with the results on show.
+	 */
+	size_t len = strlen(entry->results_input);
+	if (len > 0 && !entry->reloading && starts_with(entry->input_utf8, entry->results_input)
+			&& (entry->prefix_count == 0
+				|| len > strlen(entry->prefixes[entry->prefix_count - 1].query))) {
+		struct result_vec saved = entry->results;
+		saved.nranked = 0;
+		saved.ranked_size = 0;
+		saved.ranked = NULL;
+		push_results(entry, entry->results_input, saved);
+		entry->results_shared = true;
+	}
+
+	struct filter_request request = filter_request(sofi);
+	size_t count = request.commands->count;
+	if (request.base != NULL) {
+		count = request.base->count;
+	}
+	struct result_vec results = take_spare_results(entry);
+	if (count < FILTER_PARALLEL_THRESHOLD || !filter_thread_start(&sofi->filter, &request, &results)) {
+		filter_request_run(&request, NULL, &results);
+		set_results(sofi, results);
+	}
+}
+
+void input_finish_results(struct sofi *sofi)
+{
+	if (sofi->filter.fd == -1) {
+		return;
+	}
+	set_results(sofi, filter_thread_finish(&sofi->filter));
+	sofi->window.surface.redraw = true;
+}
+
+void input_reload_results(struct sofi *sofi)
+{
+	struct entry *entry = &sofi->window.entry;
+
+	input_clear_prefix_results(sofi);
+	struct filter_request request = filter_request(sofi);
+	struct result_vec results = take_spare_results(entry);
+	if (request.commands->count < FILTER_PARALLEL_THRESHOLD
+			|| !filter_thread_start(&sofi->filter, &request, &results)) {
+		filter_request_run(&request, NULL, &results);
+		set_results(sofi, results);
+		return;
+	}
+
+	/* The results on show point into the old commands, so they go now. */
+	recycle_results(entry, entry->results);
+	entry->results = result_vec_create();
+	reset_selection(sofi);
+	entry->reloading = true;
+}
+
 void add_character(struct sofi *sofi, xkb_keycode_t keycode)
 {
 	struct entry *entry = &sofi->window.entry;
@@ -197,17 +505,7 @@ void add_character(struct sofi *sofi, xkb_keycode_t keycode)
 				N_ELEM(buf));
 		entry->input_utf8_length += len;
 
-		if (entry->mode == TOFI_MODE_DRUN) {
-			struct string_ref_vec results = desktop_vec_filter(&entry->apps, entry->input_utf8, sofi->matching_algorithm);
-			string_ref_vec_destroy(&entry->results);
-			entry->results = results;
-		} else {
-			struct string_ref_vec tmp = entry->results;
-			entry->results = string_ref_vec_filter(&entry->results, entry->input_utf8, sofi->matching_algorithm);
-			string_ref_vec_destroy(&tmp);
-		}
-
-		reset_selection(sofi);
+		update_results(sofi);
 	} else {
 		for (size_t i = entry->input_utf32_length; i > entry->cursor_position; i--) {
 			entry->input_utf32[i] = entry->input_utf32[i - 1];
@@ -234,14 +532,8 @@ void input_refresh_results(struct sofi *sofi)
 	}
 	entry->input_utf8[bytes_written] = '\0';
 	entry->input_utf8_length = bytes_written;
-	string_ref_vec_destroy(&entry->results);
-	if (entry->mode == TOFI_MODE_DRUN) {
-		entry->results = desktop_vec_filter(&entry->apps, entry->input_utf8, sofi->matching_algorithm);
-	} else {
-		entry->results = string_ref_vec_filter(&entry->commands, entry->input_utf8, sofi->matching_algorithm);
-	}
 
-	reset_selection(sofi);
+	update_results(sofi);
 }
 
 void delete_character(struct sofi *sofi)
@@ -7,4 +7,32 @@
 void input_handle_keypress(struct sofi *sofi, xkb_keycode_t keycode);
 void input_refresh_results(struct sofi *sofi);
 
+/*
+ * Show the results of filtering in the background, once sofi->filter.fd is
+ * readable, or wait for them if they're needed now. Does nothing if no filter
+ * is running.
+ */
+void input_finish_results(struct sofi *sofi);
+
+/*
+ * Remember the selected result, to be selected again by
+ * input_reload_results(). This must be called before the commands are
+ * replaced, as the results on show point into the old ones.
+ */
+void input_save_selection(struct sofi *sofi);
+
+/*
+ * Filter the commands from scratch after they've been replaced. Long lists
+ * are filtered in the background, in which case there are no results until
+ * input_finish_results() is called, and the window shouldn't be redrawn.
+ */
+void input_reload_results(struct sofi *sofi);
+
+/*
+ * Forget the results saved for earlier versions of the input, and stop any
+ * filter that's running, which must be done before the commands they point
+ * into are replaced.
+ */
+void input_clear_prefix_results(struct sofi *sofi);
+
 #endif /* INPUT_H */
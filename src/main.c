@@ -23,6 +23,7 @@
 #include "log.h"
 #include "nelem.h"
 #include "lock.h"
+#include "pool.h"
 #include "scale.h"
 #include "shm.h"
 #include "string_vec.h"
@@ -921,6 +922,10 @@ const struct option long_options[] = {
 	{"physical-keybindings", required_argument, NULL, 0},
 	{"drun-launch", required_argument, NULL, 0},
 	{"drun-print-exec", required_argument, NULL, 0},
+	{"files-max-depth", required_argument, NULL, 0},
+	{"files-max-count", required_argument, NULL, 0},
+	{"files-exclude", required_argument, NULL, 0},
+	{"files-ignore-files", required_argument, NULL, 0},
 	{"terminal", required_argument, NULL, 0},
 	{"hint-font", required_argument, NULL, 0},
 	{"multi-instance", required_argument, NULL, 0},
@@ -1004,8 +1009,9 @@ static void parse_args(struct sofi *sofi, int argc, char *argv[])
 static bool do_submit(struct sofi *sofi)
 {
 	struct entry *entry = &sofi->window.entry;
-	uint32_t selection = entry->selection + entry->first_result;
-	char *res = entry->results.buf[selection].string;
+
+	/* Don't submit a result from before the last keypress. */
+	input_finish_results(sofi);
 
 	if (sofi->window.entry.results.count == 0) {
 		/* Always require a match in drun and files modes. */
@@ -1017,27 +1023,17 @@ static bool do_submit(struct sofi *sofi)
 		}
 	}
 
+	uint32_t selection = entry->selection + entry->first_result;
+	string_ref_vec_rank(&entry->commands, &entry->results_query, &entry->results, selection + 1);
+	size_t index = result_vec_nth(&entry->results, selection);
+	char *res = entry->commands.buf[index].string;
+
 	if (entry->mode == TOFI_MODE_FILES) {
 		files_launch(res);
 		return true;
 	} else if (entry->mode == TOFI_MODE_DRUN) {
-		/*
-		 * At this point, the list of apps is history sorted rather
-		 * than alphabetically sorted, so we can't use
-		 * desktop_vec_find_sorted().
-		 */
-		struct desktop_entry *app = NULL;
-		for (size_t i = 0; i < entry->apps.count; i++) {
-			if (!strcmp(res, entry->apps.buf[i].name)) {
-				app = &entry->apps.buf[i];
-				break;
-			}
-		}
-		if (app == NULL) {
-			log_error("Couldn't find application file! This shouldn't happen.\n");
-			return false;
-		}
-		char *path = app->path;
+		/* The commands are just the apps' names, in the same order. */
+		char *path = entry->apps.buf[index].path;
 		if (sofi->drun_launch) {
 			drun_launch(path);
 		} else {
@@ -1045,20 +1041,13 @@ static bool do_submit(struct sofi *sofi)
 		}
 	} else {
 		if (entry->mode == TOFI_MODE_PLAIN && sofi->print_index) {
-			for (size_t i = 0; i < entry->commands.count; i++) {
-				if (res == entry->commands.buf[i].string) {
-					printf("%zu\n", i + 1);
-					break;
-				}
-			}
+			printf("%zu\n", index + 1);
 		} else {
 			printf("%s\n", res);
 		}
 	}
 	if (sofi->use_history) {
-		history_add(
-				&entry->history,
-				entry->results.buf[selection].string);
+		history_add(&entry->history, res);
 		if (sofi->history_file[0] == 0) {
 			history_save_default_file(&entry->history, entry->mode == TOFI_MODE_DRUN);
 		} else {
@@ -1155,6 +1144,161 @@ static void read_clipboard(struct sofi *sofi)
 	sofi->window.surface.redraw = true;
 }
 
+/*
+ * The set_*_commands() functions replace the list of commands with a newly
+ * generated one, taking ownership of it. Any results saved for earlier
+ * versions of the input point into the old list, so they go too.
+ */
+static void set_run_commands(struct sofi *sofi, char *buffer)
+{
+	struct entry *entry = &sofi->window.entry;
+
+	input_clear_prefix_results(sofi);
+	string_ref_vec_destroy(&entry->commands);
+	free(entry->command_buffer);
+	entry->command_buffer = buffer;
+	struct string_ref_vec commands = string_ref_vec_from_buffer(buffer);
+	if (sofi->use_history) {
+		entry->commands = compgen_history_sort(&commands, &entry->history);
+		string_ref_vec_destroy(&commands);
+	} else {
+		entry->commands = commands;
+	}
+}
+
+static void set_drun_commands(struct sofi *sofi, struct desktop_vec apps)
+{
+	struct entry *entry = &sofi->window.entry;
+
+	input_clear_prefix_results(sofi);
+	if (sofi->use_history) {
+		drun_history_sort(&apps, &entry->history);
+	}
+	string_ref_vec_destroy(&entry->commands);
+	desktop_vec_destroy(&entry->apps);
+	struct string_ref_vec commands = string_ref_vec_create();
+	for (size_t i = 0; i < apps.count; i++) {
+		string_ref_vec_add(&commands, apps.buf[i].name);
+		commands.buf[i].key = apps.buf[i].name_key;
+	}
+	entry->commands = commands;
+	entry->apps = apps;
+}
+
+static void set_files_commands(struct sofi *sofi, struct file_index index)
+{
+	struct entry *entry = &sofi->window.entry;
+
+	input_clear_prefix_results(sofi);
+	string_ref_vec_destroy(&entry->commands);
+	file_index_destroy(&entry->file_index);
+	entry->file_index = index;
+	entry->commands = file_index_commands(&entry->file_index);
+}
+
+/*
+ * Start rebuilding a stale cache in the background. If that's not possible,
+ * rebuild it now instead, as it may have been missing entirely.
+ */
+static void start_refresh(struct sofi *sofi)
+{
+	enum tofi_mode mode = sofi->window.entry.mode;
+
+	/*
+	 * With nothing cached, stream files in as they're found, rather than
+	 * showing nothing until the whole scan is done.
+	 */
+	bool stream = sofi->window.entry.commands.count == 0;
+	if (refresh_start(&sofi->refresh, mode, sofi->files_options, stream)) {
+		return;
+	}
+	switch (mode) {
+		case TOFI_MODE_RUN:
+			set_run_commands(sofi, compgen_update());
+			break;
+		case TOFI_MODE_DRUN:
+			set_drun_commands(sofi, drun_update());
+			break;
+		case TOFI_MODE_FILES: {
+			struct file_index index = {0};
+			files_update(&index, sofi->files_options, NULL, NULL);
+			set_files_commands(sofi, index);
+			break;
+		}
+		case TOFI_MODE_PLAIN:
+			break;
+	}
+}
+
+/* Swap in the list from a finished background refresh. */
+static void finish_refresh(struct sofi *sofi)
+{
+	struct entry *entry = &sofi->window.entry;
+
+	refresh_finish(&sofi->refresh);
+	log_debug("Background refresh finished, updating results.\n");
+
+	input_save_selection(sofi);
+	switch (entry->mode) {
+		case TOFI_MODE_RUN:
+			set_run_commands(sofi, sofi->refresh.command_buffer);
+			break;
+		case TOFI_MODE_DRUN:
+			set_drun_commands(sofi, sofi->refresh.apps);
+			break;
+		case TOFI_MODE_FILES:
+			set_files_commands(sofi, sofi->refresh.file_index);
+			break;
+		case TOFI_MODE_PLAIN:
+			break;
+	}
+	input_reload_results(sofi);
+	if (!entry->reloading) {
+		sofi->window.surface.redraw = true;
+	}
+}
+
+/*
+ * Handle news from a background refresh, filtering whatever's new against
+ * the current input, and keeping the same result selected if it's still
+ * there.
+ */
+static void handle_refresh(struct sofi *sofi)
+{
+	struct entry *entry = &sofi->window.entry;
+
+	struct file_index partial = {0};
+	if (refresh_collect(&sofi->refresh, &partial)) {
+		finish_refresh(sofi);
+		return;
+	}
+	if (partial.data == NULL) {
+		return;
+	}
+	log_debug("Showing the %u files found so far.\n", partial.header->count - partial.header->app_count);
+	input_save_selection(sofi);
+	set_files_commands(sofi, partial);
+	input_reload_results(sofi);
+	if (!entry->reloading) {
+		sofi->window.surface.redraw = true;
+	}
+}
+
+/*
+ * Let any background refresh finish before we exit, so that the cache it's
+ * writing isn't thrown away. Our output's all been written by now, so close
+ * stdout first, so that anything reading it needn't wait for us.
+ */
+static void wait_for_refresh(struct sofi *sofi)
+{
+	if (sofi->refresh.fd == -1) {
+		return;
+	}
+	log_debug("Waiting for the background refresh to finish.\n");
+	fclose(stdout);
+	refresh_abandon(&sofi->refresh);
+}
+
 int main(int argc, char *argv[])
 {
 	/* Call log_debug to initialise the timers we use for perf checking. */
@@ -1204,6 +1348,12 @@ int main(int argc, char *argv[])
 		.require_match = true,
 		.use_scale = true,
 		.physical_keybindings = true,
+		.files_options = {
+			.max_depth = SCAN_UNLIMITED,
+			.max_files = SCAN_UNLIMITED,
+			.ignore_files = true
+		},
+		.filter.fd = -1
 	};
 	wl_list_init(&sofi.output_list);
 	if (getenv("TERMINAL") != NULL) {
@@ -1457,31 +1607,29 @@ int main(int argc, char *argv[])
 	 * If we were invoked as sofi-drun, generate the desktop app list.
 	 * Otherwise, just read standard input.
 	 */
+	bool stale = false;
 	if (strstr(argv[0], "-run")) {
 		log_debug("Generating command list.\n");
 		log_indent();
 		sofi.window.entry.mode = TOFI_MODE_RUN;
-		sofi.window.entry.command_buffer = compgen_cached();
-		struct string_ref_vec commands = string_ref_vec_from_buffer(sofi.window.entry.command_buffer);
 		if (sofi.use_history) {
 			if (sofi.history_file[0] == 0) {
 				sofi.window.entry.history = history_load_default_file(false);
 			} else {
 				sofi.window.entry.history = history_load(sofi.history_file);
 			}
-			sofi.window.entry.commands = compgen_history_sort(&commands, &sofi.window.entry.history);
-			string_ref_vec_destroy(&commands);
-		} else {
-			sofi.window.entry.commands = commands;
 		}
+		set_run_commands(&sofi, compgen_cached(&stale));
 		log_unindent();
 		log_debug("Command list generated.\n");
 	} else if (strstr(argv[0], "-files")) {
 		log_debug("Generating file list.\n");
 		log_indent();
 		sofi.window.entry.mode = TOFI_MODE_FILES;
-		sofi.window.entry.command_buffer = files_generate_cached();
-		sofi.window.entry.commands = string_ref_vec_from_buffer(sofi.window.entry.command_buffer);
+		sofi.window.entry.commands = files_generate_cached(
+				&sofi.window.entry.file_index,
+				sofi.files_options,
+				&stale);
 		log_unindent();
 		if (strcmp(sofi.window.entry.prompt_text, "run: ") == 0) {
 			snprintf(sofi.window.entry.prompt_text, N_ELEM(sofi.window.entry.prompt_text), "run: ");
@@ -1490,21 +1638,14 @@ int main(int argc, char *argv[])
 		log_debug("Generating desktop app list.\n");
 		log_indent();
 		sofi.window.entry.mode = TOFI_MODE_DRUN;
-		struct desktop_vec apps = drun_generate_cached();
 		if (sofi.use_history) {
 			if (sofi.history_file[0] == 0) {
 				sofi.window.entry.history = history_load_default_file(true);
 			} else {
 				sofi.window.entry.history = history_load(sofi.history_file);
 			}
-			drun_history_sort(&apps, &sofi.window.entry.history);
-		}
-		struct string_ref_vec commands = string_ref_vec_create();
-		for (size_t i = 0; i < apps.count; i++) {
-			string_ref_vec_add(&commands, apps.buf[i].name);
 		}
-		sofi.window.entry.commands = commands;
-		sofi.window.entry.apps = apps;
+		set_drun_commands(&sofi, drun_generate_cached(&stale));
 		log_unindent();
 		log_debug("App list generated.\n");
 	} else {
@@ -1522,11 +1663,22 @@ int main(int argc, char *argv[])
 		}
 		log_debug("Result list generated.\n");
 	}
-	sofi.window.entry.results = string_ref_vec_copy(&sofi.window.entry.commands);
 
-	if (sofi.auto_accept_single && sofi.window.entry.results.count == 1) {
+	/*
+	 * An out of date cache is shown as-is while it's rebuilt, so that we
+	 * never wait on the filesystem before the first frame.
+	 */
+	sofi.refresh.fd = -1;
+	if (stale) {
+		start_refresh(&sofi);
+	}
+	input_reload_results(&sofi);
+	input_finish_results(&sofi);
+
+	if (sofi.submit) {
 		log_debug("Only one result, exiting.\n");
 		do_submit(&sofi);
+		wait_for_refresh(&sofi);
 		return EXIT_SUCCESS;
 	}
 
@@ -1765,7 +1917,7 @@ int main(int argc, char *argv[])
 	 * order of the various functions called here.
 	 */
 	while (!sofi.closed) {
-		struct pollfd pollfds[2] = {{0}, {0}};
+		struct pollfd pollfds[4] = {{0}, {0}, {0}, {0}};
 		pollfds[0].fd = wl_display_get_fd(sofi.wl_display);
 
 		/* Make sure we're ready to receive events on the main queue. */
@@ -1794,19 +1946,23 @@ int main(int argc, char *argv[])
 		}
 
 		pollfds[0].events = POLLIN | POLLPRI;
-		int res;
-		if (sofi.clipboard.fd == 0) {
-			res = poll(&pollfds[0], 1, timeout);
-		} else {
-			/*
-			 * We're trying to paste from the clipboard, which is
-			 * done by reading from a pipe, so poll that file
-			 * descriptor as well.
-			 */
-			pollfds[1].fd = sofi.clipboard.fd;
-			pollfds[1].events = POLLIN | POLLPRI;
-			res = poll(pollfds, 2, timeout);
-		}
+
+		/*
+		 * If we're trying to paste from the clipboard, which is
+		 * done by reading from a pipe, poll that file descriptor as
+		 * well. Likewise for a background refresh of the commands,
+		 * or filtering of the results. poll() ignores negative
+		 * descriptors, so any of these can be left out. News of a
+		 * refresh waits until the results for the last one are in,
+		 * so that a stream of new lists can't keep them from showing.
+		 */
+		pollfds[1].fd = sofi.clipboard.fd == 0 ? -1 : sofi.clipboard.fd;
+		pollfds[1].events = POLLIN | POLLPRI;
+		pollfds[2].fd = sofi.window.entry.reloading ? -1 : sofi.refresh.fd;
+		pollfds[2].events = POLLIN;
+		pollfds[3].fd = sofi.filter.fd;
+		pollfds[3].events = POLLIN;
+		int res = poll(pollfds, N_ELEM(pollfds), timeout);
 		if (res == 0) {
 			/*
 			 * No events to process and no error - we presumably
@@ -1830,7 +1986,8 @@ int main(int argc, char *argv[])
 			} else {
 				/*
 				 * No events to read - we were woken up to
-				 * handle clipboard data.
+				 * handle clipboard data, or refreshed or
+				 * filtered results.
 				 */
 				wl_display_cancel_read(sofi.wl_display);
 			}
@@ -1847,6 +2004,12 @@ int main(int argc, char *argv[])
 				 */
 				clipboard_finish_paste(&sofi.clipboard);
 			}
+			if (pollfds[2].revents & POLLIN) {
+				handle_refresh(&sofi);
+			}
+			if (pollfds[3].revents & POLLIN) {
+				input_finish_results(&sofi);
+			}
 		}
 
 		/* Handle any events we read. */
@@ -1916,14 +2079,22 @@ int main(int argc, char *argv[])
 	xkb_keymap_unref(sofi.xkb_keymap);
 	xkb_context_unref(sofi.xkb_context);
 	wl_registry_destroy(sofi.wl_registry);
+	input_clear_prefix_results(&sofi);
 	if (sofi.window.entry.mode == TOFI_MODE_DRUN) {
 		desktop_vec_destroy(&sofi.window.entry.apps);
 	}
+	if (sofi.window.entry.mode == TOFI_MODE_FILES) {
+		file_index_destroy(&sofi.window.entry.file_index);
+	}
 	if (sofi.window.entry.command_buffer != NULL) {
 		free(sofi.window.entry.command_buffer);
 	}
 	string_ref_vec_destroy(&sofi.window.entry.commands);
-	string_ref_vec_destroy(&sofi.window.entry.results);
+	result_vec_destroy(&sofi.window.entry.results);
+	result_vec_destroy(&sofi.window.entry.spare_results);
+	free(sofi.window.entry.reload_selection);
+	match_query_destroy(&sofi.window.entry.results_query);
+	match_positions_destroy(&sofi.window.entry.match_positions);
 	if (sofi.use_history) {
 		history_destroy(&sofi.window.entry.history);
 	}
@@ -1934,6 +2105,13 @@ int main(int argc, char *argv[])
 	wl_display_roundtrip(sofi.wl_display);
 	wl_display_disconnect(sofi.wl_display);
 
+	/* The window's gone now, so there's nothing left to hold up. */
+	wait_for_refresh(&sofi);
+#ifdef DEBUG
+	/* A refresh may have been using the thread pool, so this comes last. */
+	pool_destroy();
+#endif
+
 	log_debug("Finished, exiting.\n");
 	if (sofi.closed) {
 		return EXIT_FAILURE;
@@ -5,7 +5,7 @@
 
 int main()
 {
-	char *buf = compgen_cached();
+	char *buf = compgen_cached(NULL);
 	struct string_ref_vec commands = string_ref_vec_from_buffer(buf);
 	for (size_t i = 0; i < commands.count; i++) {
 		fputs(commands.buf[i].string, stdout);
@@ -0,0 +1,6 @@
+#include "files_watch.h"
+
+int main()
+{
+	return files_watch();
+}
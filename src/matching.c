@@ -4,248 +4,607 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "ascii_search.h"
 #include "matching.h"
 #include "unicode.h"
 #include "xmalloc.h"
 
 #undef MAX
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#undef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-static int32_t simple_match_words(
-		const char *restrict patterns,
-		const char *restrict str);
+/*
+ * Strings up to this many bytes are matched using buffers on the stack, so
+ * that nothing needs allocating for the vast majority of candidates.
+ */
+#define STACK_LEN 256
 
-static int32_t prefix_match_words(
-		const char *restrict patterns,
-		const char *restrict str);
+/*
+ * Approximate matching keeps a bit for each character of a word in a
+ * uint64_t, so longer words have to match exactly.
+ */
+#define APPROX_MAX_LEN 64
+#define APPROX_MAX_EDITS 3
 
-static int32_t fuzzy_match_words(
-		const char *restrict patterns,
-		const char *restrict str);
+/*
+ * Fuzzy scoring, which fuzzy_match(), fuzzy_bound() and batches of short
+ * strings all have to agree on.
+ */
+static const int unmatched_letter_penalty = -1;
+static const int adjacency_bonus = 15;
+static const int first_letter_bonus = 15;
+static const int leading_letter_penalty = -5;
+static const int max_leading_letter_penalty = -15;
+
+/*
+ * Words of a character or two are matched in a single pass, so bounding
+ * their scores is about as quick as batching, and leaves far fewer to work
+ * out in full than there are matches. Any longer and it's worth batching.
+ */
+#define FUZZY_BATCH_MIN_WORD 3
+
+static int32_t simple_match(
+		const struct match_word *restrict word,
+		const char *restrict str,
+		const struct match_key *restrict key,
+		bool prefix,
+		struct match_positions *restrict positions);
 
 static int32_t fuzzy_match(
-		const char *restrict pattern,
-		const char *restrict str);
+		const struct match_word *restrict word,
+		const char *restrict str,
+		const struct match_key *restrict key,
+		struct match_positions *restrict positions);
 
-static int32_t fuzzy_match_recurse(
-		const char *restrict pattern,
+static int32_t approx_match(
+		const struct match_word *restrict word,
 		const char *restrict str,
-		int32_t score,
-		bool first_match_only,
-		bool first_char);
+		const struct match_key *restrict key,
+		struct match_positions *restrict positions);
 
-static int32_t compute_score(
-		int32_t jump,
-		bool first_char,
-		const char *restrict match);
+static int32_t fuzzy_bound(
+		const struct match_word *restrict word,
+		const char *restrict str,
+		const struct match_key *restrict key,
+		uint64_t sig);
 
-/*
- * Select the appropriate algorithm, and return its score.
- * Each algorithm returns larger scores for better matches,
- * and returns INT32_MIN if a word is not found.
- */
-int32_t match_words(
-		enum matching_algorithm algorithm,
-		const char *restrict patterns,
-		const char *restrict str)
+static bool is_upper(uint32_t c, bool ascii);
+static bool is_lower(uint32_t c, bool ascii);
+static bool is_alnum(uint32_t c, bool ascii);
+
+static int32_t compute_bonus(const uint32_t *str, size_t i, bool ascii);
+
+static void add_position(struct match_positions *positions, uint32_t offset);
+
+static void trace_fuzzy_match(
+		struct match_positions *positions,
+		const char *str,
+		bool ascii,
+		const int32_t *table,
+		const int32_t *bonus,
+		size_t slen,
+		size_t plen,
+		size_t end);
+
+static void trace_approx_match(
+		struct match_positions *positions,
+		const struct match_word *word,
+		const char *str,
+		const struct match_key *key,
+		size_t end,
+		uint32_t dist);
+
+static uint32_t ascii_tolower(uint32_t c)
 {
-	switch (algorithm) {
-		case MATCHING_ALGORITHM_NORMAL:
-			return simple_match_words(patterns, str);
-		case MATCHING_ALGORITHM_PREFIX:
-			return prefix_match_words(patterns, str);
-		case MATCHING_ALGORITHM_FUZZY:
-			return fuzzy_match_words(patterns, str);
-		default:
-			return INT32_MIN;
+	if (c >= 'A' && c <= 'Z') {
+		return c + ('a' - 'A');
 	}
+	return c;
 }
 
 /*
- * Split patterns into words, and perform simple matching against str for each.
- * Returns the negative sum of substring distances from the start of str.
- * If a word is not found, returns INT32_MIN.
+ * Signatures are worked out bytewise, so anything whose casefolded form is a
+ * substring of another's must have a subset of its bits. Each byte's bit is
+ * looked up, as the mix of letters, digits and punctuation in a typical
+ * string doesn't suit branching.
  */
-int32_t simple_match_words(const char *restrict patterns, const char *restrict str)
+#define SIGNATURE_BIT(c) (1ull << ( \
+		(unsigned int)(((c) | 0x20) - 'a') < 26 ? ((c) | 0x20) - 'a' \
+		: (unsigned int)((c) - '0') < 10 ? 26 + (c) - '0' \
+		: 36 + (c) % 28))
+#define SIGNATURE_BITS_4(c) SIGNATURE_BIT(c), SIGNATURE_BIT(c + 1), \
+	SIGNATURE_BIT(c + 2), SIGNATURE_BIT(c + 3)
+#define SIGNATURE_BITS_16(c) SIGNATURE_BITS_4(c), SIGNATURE_BITS_4(c + 4), \
+	SIGNATURE_BITS_4(c + 8), SIGNATURE_BITS_4(c + 12)
+#define SIGNATURE_BITS_64(c) SIGNATURE_BITS_16(c), SIGNATURE_BITS_16(c + 16), \
+	SIGNATURE_BITS_16(c + 32), SIGNATURE_BITS_16(c + 48)
+
+static const uint64_t signature_bits[256] = {
+	SIGNATURE_BITS_64(0),
+	SIGNATURE_BITS_64(64),
+	SIGNATURE_BITS_64(128),
+	SIGNATURE_BITS_64(192)
+};
+
+static uint64_t signature(const char *str, size_t len)
 {
-	int32_t score = 0;
-	char *saveptr = NULL;
-	char *tmp = utf8_normalize(patterns);
-	char *pattern = strtok_r(tmp, " ", &saveptr);
-	while (pattern != NULL) {
-		char *c = utf8_strcasestr(str, pattern);
-		if (c == NULL) {
-			score = INT32_MIN;
+	uint64_t sig = 0;
+	for (size_t i = 0; i < len; i++) {
+		sig |= signature_bits[(unsigned char)str[i]];
+	}
+	return sig;
+}
+
+void match_key_init(struct match_key *key, const char *str, size_t len)
+{
+	key->folded = NULL;
+	key->len = len;
+	key->nchars = len;
+	uint64_t sig = 0;
+	for (size_t i = 0; i < len; i++) {
+		if ((unsigned char)str[i] >= 0x80) {
+			key->folded = utf8_casefold(str, len);
+			key->nchars = utf8_strnlen(str, len);
+			sig = signature(key->folded, strlen(key->folded));
 			break;
-		} else {
-			score -= c - str;
 		}
-		pattern = strtok_r(NULL, " ", &saveptr);
+		sig |= signature_bits[(unsigned char)str[i]];
 	}
-	free(tmp);
-	return score;
+	key->sig = sig;
 }
 
 /*
- * Split patterns into words, and perform prefix matching against str for each.
- * Returns the negative sum of remaining string suffix lengths.
- * If a word is not found, returns INT32_MIN.
+ * Set word up for approximate matching, which compares casefolded characters,
+ * like substring matching, rather than the lowercased ones fuzzy matching
+ * uses.
  */
-int32_t prefix_match_words(const char *restrict patterns, const char *restrict str)
+static void approx_word_init(struct match_word *word)
 {
-	int32_t score = 0;
-	char *saveptr = NULL;
+	free(word->chars);
+	word->chars = utf8_string_to_utf32_string(word->folded);
+	word->nchars = utf32_strlen(word->chars);
+
+	/* Short words have to match exactly, or they'd match almost anything. */
+	word->max_edits = 0;
+	if (word->nchars > 3) {
+		word->max_edits = MIN((word->nchars - 1) / 3, APPROX_MAX_EDITS);
+	}
+
+	word->peq = xcalloc(128, sizeof(*word->peq));
+	for (size_t i = 0; i < MIN(word->nchars, APPROX_MAX_LEN); i++) {
+		uint32_t c = word->chars[i];
+		if (c < 128) {
+			word->peq[c] |= 1ull << i;
+		}
+		if (c >= 'a' && c <= 'z') {
+			word->peq[c - ('a' - 'A')] |= 1ull << i;
+		}
+	}
+}
+
+struct match_query match_query_create(enum matching_algorithm algorithm, const char *patterns)
+{
+	struct match_query query = {
+		.algorithm = algorithm
+	};
+
 	char *tmp = utf8_normalize(patterns);
+	if (tmp == NULL) {
+		/* Invalid UTF-8, so just take it as it is. */
+		tmp = xstrdup(patterns);
+	}
+	size_t size = 0;
+	char *saveptr = NULL;
 	char *pattern = strtok_r(tmp, " ", &saveptr);
 	while (pattern != NULL) {
-		char *c = utf8_strcasestr(str, pattern);
-		if (c != str) {
-			score = INT32_MIN;
-			break;
+		if (query.count == size) {
+			size = size ? 2 * size : 4;
+			query.words = xrealloc(query.words, size * sizeof(*query.words));
+		}
+		struct match_word *word = &query.words[query.count++];
+		*word = (struct match_word){ 0 };
+		word->folded = utf8_casefold(pattern, -1);
+		word->folded_len = strlen(word->folded);
+		word->chars = utf8_string_to_utf32_string(pattern);
+		word->nchars = utf32_strlen(word->chars);
+		for (size_t i = 0; i < word->nchars; i++) {
+			word->chars[i] = utf32_tolower(word->chars[i]);
+		}
+		if (algorithm == MATCHING_ALGORITHM_APPROX) {
+			/*
+			 * A match with typos needn't contain any particular
+			 * character, so there's nothing to add to the
+			 * signature.
+			 */
+			approx_word_init(word);
+		} else if (algorithm != MATCHING_ALGORITHM_FUZZY) {
+			query.sig |= signature(word->folded, word->folded_len);
 		} else {
-			score -= utf8_strlen(str) - utf8_strlen(pattern);
+			/*
+			 * Fuzzy matching compares lowercased rather than
+			 * casefolded characters, which only agree on ASCII.
+			 * Anything that lowercases to an ASCII character
+			 * (like the Kelvin sign) still casefolds to it.
+			 */
+			for (size_t i = 0; i < word->nchars; i++) {
+				if (word->chars[i] < 0x80) {
+					query.sig |= signature_bits[word->chars[i]];
+				}
+			}
 		}
 		pattern = strtok_r(NULL, " ", &saveptr);
 	}
 	free(tmp);
-	return score;
+	return query;
 }
 
+void match_query_destroy(struct match_query *query)
+{
+	for (size_t i = 0; i < query->count; i++) {
+		free(query->words[i].folded);
+		free(query->words[i].chars);
+		free(query->words[i].peq);
+	}
+	free(query->words);
+	query->words = NULL;
+	query->count = 0;
+}
 
 /*
- * Split patterns into words, and return the sum of fuzzy_match(word, str).
- * If a word is not found, returns INT32_MIN.
+ * Match each word of the query, and return the combined score. Each
+ * algorithm returns larger scores for better matches, and returns INT32_MIN
+ * if a word is not found.
+ *
+ *   - Simple matching returns the negative sum of substring distances from
+ *     the start of str.
+ *   - Prefix matching returns the negative sum of remaining string suffix
+ *     lengths.
+ *   - Fuzzy matching returns the sum of fuzzy_match(word, str).
+ *   - Approximate matching returns the negative sum of substring distances
+ *     from the start of str, less a penalty for each typo.
  */
-int32_t fuzzy_match_words(const char *restrict patterns, const char *restrict str)
+static int32_t match_query(
+		const struct match_query *restrict query,
+		const char *restrict str,
+		const struct match_key *restrict key,
+		struct match_positions *restrict positions)
 {
+	if ((key->sig & query->sig) != query->sig) {
+		return INT32_MIN;
+	}
 	int32_t score = 0;
-	char *saveptr = NULL;
-	char *tmp = utf8_normalize(patterns);
-	char *pattern = strtok_r(tmp, " ", &saveptr);
-	while (pattern != NULL) {
-		int32_t word_score = fuzzy_match(pattern, str);
+	for (size_t i = 0; i < query->count; i++) {
+		int32_t word_score;
+		switch (query->algorithm) {
+			case MATCHING_ALGORITHM_NORMAL:
+				word_score = simple_match(&query->words[i], str, key, false, positions);
+				break;
+			case MATCHING_ALGORITHM_PREFIX:
+				word_score = simple_match(&query->words[i], str, key, true, positions);
+				break;
+			case MATCHING_ALGORITHM_FUZZY:
+				word_score = fuzzy_match(&query->words[i], str, key, positions);
+				break;
+			case MATCHING_ALGORITHM_APPROX:
+				word_score = approx_match(&query->words[i], str, key, positions);
+				break;
+			default:
+				word_score = INT32_MIN;
+				break;
+		}
 		if (word_score == INT32_MIN) {
-			score = INT32_MIN;
-			break;
-		} else {
-			score += word_score;
+			return INT32_MIN;
 		}
-		pattern = strtok_r(NULL, " ", &saveptr);
+		score += word_score;
 	}
-	free(tmp);
 	return score;
 }
 
-/*
- * Returns score if each character in pattern is found sequentially within str.
- * Returns INT32_MIN otherwise.
- */
-int32_t fuzzy_match(const char *restrict pattern, const char *restrict str)
+int32_t match_query_score(
+		const struct match_query *restrict query,
+		const char *restrict str,
+		const struct match_key *restrict key)
 {
-	const int unmatched_letter_penalty = -1;
-	const size_t slen = utf8_strlen(str);
-	const size_t plen = utf8_strlen(pattern);
-	int32_t score = 0;
+	return match_query(query, str, key, NULL);
+}
 
-	if (*pattern == '\0') {
-		return score;
+int32_t match_query_bound(
+		const struct match_query *restrict query,
+		const char *restrict str,
+		const struct match_key *restrict key)
+{
+	if (query->algorithm != MATCHING_ALGORITHM_FUZZY) {
+		return match_query(query, str, key, NULL);
 	}
-	if (slen < plen) {
+	if ((key->sig & query->sig) != query->sig) {
 		return INT32_MIN;
 	}
+	int32_t bound = 0;
+	for (size_t i = 0; i < query->count; i++) {
+		int32_t word_bound = fuzzy_bound(&query->words[i], str, key, query->sig);
+		if (word_bound == INT32_MIN) {
+			return INT32_MIN;
+		}
+		bound += word_bound;
+	}
+	return bound;
+}
 
-	/* We can already penalise any unused letters. */
-	score += unmatched_letter_penalty * (int32_t)(slen - plen);
-
-        /*
-         * If the string is more than 100 characters, just find the first fuzzy
-         * match rather than the best.
-         *
-         * This is required as the number of possible matches (for patterns and
-         * strings all consisting of one letter) scales something like:
-         *
-         * slen! / (plen! (slen - plen)!)  ~  slen^plen for plen << slen
-         *
-         * This quickly grinds everything to a halt. 100 is chosen fairly
-         * arbitrarily from the following logic:
-         *
-         * - e is the most common character in English, at around 13% of
-         *   letters. Depending on the context, let's say this be up to 20%.
-         * - 100 * 0.20 = 20 repeats of the same character.
-         * - In the worst case here, 20! / (10! 10!) ~200,000 possible matches,
-         *   which is "slow but not frozen" for my machine.
-         *
-         * In reality, this worst case shouldn't be hit, and finding the "best"
-         * fuzzy match in lines of text > 100 characters isn't really in scope
-         * for a dmenu clone.
-         */
-        bool first_match_only = slen > 100;
-
-	/* Perform the match. */
-	score = fuzzy_match_recurse(pattern, str, score, first_match_only, true);
+bool match_query_batchable(
+		const struct match_query *restrict query,
+		const struct match_key *restrict key)
+{
+	if (query->algorithm != MATCHING_ALGORITHM_FUZZY
+			|| key->folded != NULL
+			|| key->nchars > FUZZY_BATCH_MAX_LEN) {
+		return false;
+	}
+	for (size_t i = 0; i < query->count; i++) {
+		if (query->words[i].nchars >= FUZZY_BATCH_MIN_WORD) {
+			return true;
+		}
+	}
+	return false;
+}
 
-	return score;
+void match_batch_add(
+		struct fuzzy_batch *restrict batch,
+		const char *restrict str,
+		const struct match_key *restrict key)
+{
+	const size_t lane = batch->count++;
+	const size_t slen = key->nchars;
+
+	/*
+	 * As for the first row of fuzzy_match()'s table. Most characters
+	 * are lowercase letters following another, which have no bonus, so
+	 * those are quickly skipped.
+	 */
+	uint32_t pair[2] = { 0, 0 };
+	for (size_t i = 0; i < slen; i++) {
+		pair[0] = pair[1];
+		pair[1] = (unsigned char)str[i];
+		int32_t bonus = 0;
+		int32_t first = first_letter_bonus;
+		if (i > 0) {
+			if (!is_lower(pair[1], true) || !is_alnum(pair[0], true)) {
+				bonus = compute_bonus(pair, 1, true);
+			}
+			first = MAX(leading_letter_penalty * (int32_t)i, max_leading_letter_penalty);
+			first += bonus;
+		}
+		batch->chars[i][lane] = ascii_tolower(pair[1]);
+		batch->first[i][lane] = first;
+		batch->bonus[i][lane] = bonus;
+	}
+
+	/*
+	 * Only the first max_len positions are ever looked at, so that's all
+	 * that needs clearing of whatever was there before: the rest of this
+	 * lane, and for every lane, any positions this string adds.
+	 */
+	for (size_t i = slen; i < batch->max_len; i++) {
+		batch->chars[i][lane] = 0;
+	}
+	for (size_t i = batch->max_len; i < slen; i++) {
+		for (size_t j = 0; j < lane; j++) {
+			batch->chars[i][j] = 0;
+		}
+	}
+	batch->len[lane] = slen;
+	batch->max_len = MAX(batch->max_len, slen);
+}
+
+void match_query_score_batch(
+		const struct match_query *restrict query,
+		const struct fuzzy_batch *restrict batch,
+		int32_t scores[FUZZY_BATCH_SIZE])
+{
+	for (size_t lane = 0; lane < batch->count; lane++) {
+		scores[lane] = 0;
+	}
+	size_t remaining = batch->count;
+	for (size_t i = 0; i < query->count && remaining > 0; i++) {
+		const struct match_word *word = &query->words[i];
+		if (word->nchars == 0) {
+			continue;
+		}
+		int32_t best[FUZZY_BATCH_SIZE];
+		fuzzy_batch_run(batch, word->chars, word->nchars, adjacency_bonus, best);
+		for (size_t lane = 0; lane < batch->count; lane++) {
+			if (scores[lane] == INT32_MIN) {
+				continue;
+			}
+			if (best[lane] == INT32_MIN) {
+				scores[lane] = INT32_MIN;
+				remaining--;
+				continue;
+			}
+			int32_t unmatched = batch->len[lane] - word->nchars;
+			scores[lane] += best[lane] + unmatched_letter_penalty * unmatched;
+		}
+	}
+}
+
+static void add_position(struct match_positions *positions, uint32_t offset)
+{
+	if (positions->count == positions->size) {
+		positions->size = positions->size ? 2 * positions->size : 64;
+		positions->buf = xrealloc(positions->buf, positions->size * sizeof(*positions->buf));
+	}
+	positions->buf[positions->count++] = offset;
 }
 
 /*
- * Recursively match the whole of pattern against str.
- * The score parameter is the score of the previously matched character.
- *
- * This reaches a maximum recursion depth of strlen(pattern) + 1. However, the
- * stack usage is small (the maximum I've seen on x86_64 is 144 bytes with
- * gcc -O3), so this shouldn't matter unless pattern contains thousands of
- * characters.
+ * Record the characters of str from first to last, counting from the start
+ * of the matched part of its key. Characters are only counted as the same in
+ * the original and the casefolded copy if there are as many of each.
  */
-int32_t fuzzy_match_recurse(
-		const char *restrict pattern,
+static void add_positions(
+		struct match_positions *positions,
+		const char *str,
+		const struct match_key *key,
+		size_t first,
+		size_t last)
+{
+	if (key->folded == NULL) {
+		for (size_t i = first; i <= last; i++) {
+			add_position(positions, i);
+		}
+		return;
+	}
+	if (utf8_strlen(key->folded) != key->nchars) {
+		return;
+	}
+	const char *c = str;
+	for (size_t i = 0; i <= last; i++) {
+		if (i >= first) {
+			add_position(positions, c - str);
+		}
+		c = utf8_next_char(c);
+	}
+}
+
+static int cmp_position(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+int32_t match_query_positions(
+		const struct match_query *restrict query,
 		const char *restrict str,
-		int32_t score,
-		bool first_match_only,
-		bool first_char)
+		const struct match_key *restrict key,
+		struct match_positions *restrict positions)
 {
-	if (*pattern == '\0') {
-		/* We've matched the full pattern. */
+	positions->count = 0;
+	int32_t score = match_query(query, str, key, positions);
+	if (score == INT32_MIN) {
+		positions->count = 0;
 		return score;
 	}
 
-	const char *match = str;
-	uint32_t search = utf8_to_utf32(pattern);
+	/* Words are matched separately, so can overlap. */
+	qsort(positions->buf, positions->count, sizeof(*positions->buf), cmp_position);
+	size_t count = 0;
+	for (size_t i = 0; i < positions->count; i++) {
+		if (count == 0 || positions->buf[i] != positions->buf[count - 1]) {
+			positions->buf[count++] = positions->buf[i];
+		}
+	}
+	positions->count = count;
+	return score;
+}
 
-	int32_t best_score = INT32_MIN;
+void match_positions_destroy(struct match_positions *positions)
+{
+	free(positions->buf);
+	free(positions->table);
+	*positions = (struct match_positions){0};
+}
 
-	/*
-	 * Find all occurrences of the next pattern character in str, and
-	 * recurse on them.
-	 */
-	while ((match = utf8_strcasechr(match, search)) != NULL) {
-		int32_t jump = 0;
-		for (const char *tmp = str; tmp != match; tmp = utf8_next_char(tmp)) {
-			jump++;
-		}
-		int32_t subscore = fuzzy_match_recurse(
-				utf8_next_char(pattern),
-				utf8_next_char(match),
-				compute_score(jump, first_char, match),
-				first_match_only,
-				false);
-		best_score = MAX(best_score, subscore);
-		match = utf8_next_char(match);
-
-		if (first_match_only) {
-			break;
+bool match_words_narrow(enum matching_algorithm algorithm, const char *prefix, const char *patterns)
+{
+	if (algorithm != MATCHING_ALGORITHM_APPROX) {
+		return true;
+	}
+	struct match_query shorter = match_query_create(algorithm, prefix);
+	struct match_query longer = match_query_create(algorithm, patterns);
+	bool narrow = true;
+	for (size_t i = 0; i < shorter.count && i < longer.count; i++) {
+		if (longer.words[i].max_edits > shorter.words[i].max_edits) {
+			narrow = false;
 		}
 	}
+	match_query_destroy(&longer);
+	match_query_destroy(&shorter);
+	return narrow;
+}
 
-	if (best_score == INT32_MIN) {
-		/* We couldn't match the rest of the pattern. */
-		return INT32_MIN;
+/*
+ * Select the appropriate algorithm, and return its score.
+ * Each algorithm returns larger scores for better matches,
+ * and returns INT32_MIN if a word is not found.
+ */
+int32_t match_words(
+		enum matching_algorithm algorithm,
+		const char *restrict patterns,
+		const char *restrict str)
+{
+	struct match_query query = match_query_create(algorithm, patterns);
+	struct match_key key;
+	match_key_init(&key, str, strlen(str));
+	int32_t score = match_query_score(&query, str, &key);
+	free(key.folded);
+	match_query_destroy(&query);
+	return score;
+}
+
+/*
+ * Find the casefolded word in the part of str described by key,
+ * returning its negative distance from the start of str, or if prefix is set,
+ * the negative number of characters in str after it, provided it's at the
+ * start.
+ */
+int32_t simple_match(
+		const struct match_word *restrict word,
+		const char *restrict str,
+		const struct match_key *restrict key,
+		bool prefix,
+		struct match_positions *restrict positions)
+{
+	ptrdiff_t offset = -1;
+	size_t wlen = word->folded_len;
+	if (key->folded == NULL) {
+		/*
+		 * Casefolding ASCII just lowercases it, so compare bytes
+		 * directly.
+		 */
+		if (prefix) {
+			offset = ascii_starts_with(str, key->len, word->folded, wlen) ? 0 : -1;
+		} else {
+			offset = ascii_search(str, key->len, word->folded, wlen);
+		}
 	} else {
-		return score + best_score;
+		const char *c = strstr(key->folded, word->folded);
+		if (c != NULL) {
+			offset = c - key->folded;
+		}
 	}
+
+	if (offset == -1 || (prefix && offset != 0)) {
+		return INT32_MIN;
+	}
+	if (positions != NULL && wlen > 0) {
+		/* The offset's in bytes of the casefolded copy, if there is one. */
+		size_t first = offset;
+		size_t n = wlen;
+		if (key->folded != NULL) {
+			first = utf8_strnlen(key->folded, offset);
+			n = utf8_strnlen(word->folded, wlen);
+		}
+		add_positions(positions, str, key, first, first + n - 1);
+	}
+	if (prefix) {
+		return -(int32_t)(key->nchars - word->nchars);
+	}
+	return -(int32_t)offset;
 }
 
 /*
- * Calculate the score for a single matching letter.
+ * Returns score if each character in word is found sequentially within the
+ * first len bytes of str. Returns INT32_MIN otherwise.
+ *
+ * The score is that of the best possible alignment, found with a
+ * Smith-Waterman style dynamic programme rather than by trying every
+ * alignment in turn, which could take exponential time. The score of each
+ * matching character depends only on where it is in str, and whether it
+ * directly follows the previous match, so row k of the table only needs row
+ * k - 1, and the best score of each row can be found in one pass. This takes
+ * O(plen * slen) time for strings of any length.
+ *
  * The scoring system is taken from fts_fuzzy_match v0.2.0 by Forrest Smith,
  * which is licensed to the public domain.
  *
@@ -257,45 +616,511 @@ int32_t fuzzy_match_recurse(
  *
  *   - Penalties:
  *     - If there are letters before the first match.
- *     - If there are superfluous characters in str (already accounted for).
+ *     - If there are superfluous characters in str.
+ */
+int32_t fuzzy_match(
+		const struct match_word *restrict word,
+		const char *restrict str,
+		const struct match_key *restrict key,
+		struct match_positions *restrict positions)
+{
+	const uint32_t *pat = word->chars;
+	const size_t plen = word->nchars;
+	if (plen == 0) {
+		return 0;
+	}
+
+	const size_t slen = key->nchars;
+	if (slen < plen) {
+		return INT32_MIN;
+	}
+
+	uint32_t s_buf[STACK_LEN];
+	int32_t rows_buf[3 * STACK_LEN];
+	uint32_t *s = s_buf;
+	int32_t *bonus = rows_buf;
+	if (slen > STACK_LEN) {
+		s = xmalloc(slen * sizeof(*s));
+		bonus = xmalloc(3 * slen * sizeof(*bonus));
+	}
+	const bool ascii = key->folded == NULL;
+	if (ascii) {
+		for (size_t i = 0; i < slen; i++) {
+			s[i] = (unsigned char)str[i];
+		}
+	} else {
+		const char *c = str;
+		for (size_t i = 0; i < slen; i++) {
+			s[i] = utf8_to_utf32(c);
+			c = utf8_next_char(c);
+		}
+	}
+
+	/*
+	 * The bonuses depend on the original case, so work them out before
+	 * folding everything to lowercase for comparison. Plain ASCII can be
+	 * dealt with without any Unicode tables.
+	 */
+	for (size_t i = 0; i < slen; i++) {
+		bonus[i] = compute_bonus(s, i, ascii);
+	}
+	for (size_t i = 0; i < slen; i++) {
+		s[i] = ascii ? ascii_tolower(s[i]) : utf32_tolower(s[i]);
+	}
+
+	/*
+	 * Only two rows are needed to find the score, but working out where
+	 * the characters matched means going back through the whole table.
+	 */
+	int32_t *rows[2] = { &bonus[slen], &bonus[2 * slen] };
+	int32_t *table = NULL;
+	if (positions != NULL) {
+		if (positions->table_size < plen * slen) {
+			positions->table_size = plen * slen;
+			positions->table = xrealloc(
+					positions->table,
+					positions->table_size * sizeof(*positions->table));
+		}
+		table = positions->table;
+	}
+
+	/*
+	 * The first character is penalised for how far into str it is, and
+	 * gets a bonus if it's right at the start.
+	 */
+	int32_t *cur = table != NULL ? table : rows[0];
+	for (size_t i = 0; i < slen; i++) {
+		if (s[i] != pat[0]) {
+			cur[i] = INT32_MIN;
+			continue;
+		}
+		int32_t jump = MIN(i, (size_t)INT16_MAX);
+		cur[i] = MAX(leading_letter_penalty * jump, max_leading_letter_penalty);
+		cur[i] += i == 0 ? first_letter_bonus : bonus[i];
+	}
+
+	/*
+	 * Each later character either directly follows the previous one, or
+	 * comes after the best match of it anywhere earlier.
+	 */
+	for (size_t k = 1; k < plen; k++) {
+		const int32_t *prev = cur;
+		cur = table != NULL ? &table[k * slen] : rows[k % 2];
+
+		int32_t best_before = INT32_MIN;
+		for (size_t i = 0; i < slen; i++) {
+			if (i >= 2) {
+				best_before = MAX(best_before, prev[i - 2]);
+			}
+			cur[i] = INT32_MIN;
+			if (i < k || s[i] != pat[k]) {
+				continue;
+			}
+			int32_t best = best_before;
+			if (prev[i - 1] != INT32_MIN) {
+				best = MAX(best, prev[i - 1] + adjacency_bonus);
+			}
+			if (best != INT32_MIN) {
+				cur[i] = best + bonus[i];
+			}
+		}
+	}
+
+	int32_t score = INT32_MIN;
+	size_t end = 0;
+	for (size_t i = 0; i < slen; i++) {
+		if (cur[i] > score) {
+			score = cur[i];
+			end = i;
+		}
+	}
+	if (score != INT32_MIN) {
+		if (table != NULL) {
+			trace_fuzzy_match(positions, str, ascii, table, bonus, slen, plen, end);
+		}
+		/* We can penalise any unused letters. */
+		score += unmatched_letter_penalty * (int32_t)(slen - plen);
+	}
+
+	if (s != s_buf) {
+		free(s);
+		free(bonus);
+	}
+	return score;
+}
+
+/*
+ * Work back from the best match of the last character, at end, to find where
+ * each character of the best alignment matched. Each step either directly
+ * follows the previous match, or came after the previous character's best
+ * match further back, and whichever it was gives the score in the table.
+ */
+static void trace_fuzzy_match(
+		struct match_positions *positions,
+		const char *str,
+		bool ascii,
+		const int32_t *table,
+		const int32_t *bonus,
+		size_t slen,
+		size_t plen,
+		size_t end)
+{
+	size_t first = positions->count;
+	size_t i = end;
+	for (size_t k = plen - 1; k > 0; k--) {
+		add_position(positions, i);
+		const int32_t *prev = &table[(k - 1) * slen];
+		int32_t from = table[k * slen + i] - bonus[i];
+		if (prev[i - 1] != INT32_MIN && prev[i - 1] + adjacency_bonus == from) {
+			i--;
+		} else {
+			i -= 2;
+			while (prev[i] != from) {
+				i--;
+			}
+		}
+	}
+	add_position(positions, i);
+
+	/* Put them in order, and turn the character indices into offsets. */
+	uint32_t *buf = &positions->buf[first];
+	for (size_t j = 0; j < plen / 2; j++) {
+		uint32_t tmp = buf[j];
+		buf[j] = buf[plen - 1 - j];
+		buf[plen - 1 - j] = tmp;
+	}
+	if (!ascii) {
+		const char *c = str;
+		size_t index = 0;
+		for (size_t j = 0; j < plen; j++) {
+			while (index < buf[j]) {
+				c = utf8_next_char(c);
+				index++;
+			}
+			buf[j] = c - str;
+		}
+	}
+}
+
+/* Return the bitmask of where the casefolded character c appears in word. */
+static uint64_t approx_eq(const struct match_word *word, uint32_t c)
+{
+	if (c < 128) {
+		return word->peq[c];
+	}
+	uint64_t eq = 0;
+	for (size_t i = 0; i < MIN(word->nchars, APPROX_MAX_LEN); i++) {
+		if (word->chars[i] == c) {
+			eq |= 1ull << i;
+		}
+	}
+	return eq;
+}
+
+/*
+ * Find the casefolded word in the part of str described by key, allowing
+ * for up to word->max_edits typos, i.e. characters inserted, deleted or
+ * substituted. Returns the negative distance of the match from the start of
+ * str, less a penalty for each typo, or INT32_MIN if there's no match with
+ * few enough typos.
+ *
+ * This is Myers' bit-vector algorithm, from "A fast bit-vector algorithm for
+ * approximate string matching based on dynamic programming" (1999). The
+ * table of edit distances between prefixes of the word and substrings of str
+ * is worked out a column at a time, one for each character of str, but each
+ * column is kept as a pair of bitmasks, of where the distance goes up or
+ * down by one from the row above. That makes each character of str cost a
+ * handful of operations on 64-bit integers, however long the word is.
+ */
+int32_t approx_match(
+		const struct match_word *restrict word,
+		const char *restrict str,
+		const struct match_key *restrict key,
+		struct match_positions *restrict positions)
+{
+	const int typo_penalty = -100;
+
+	const size_t m = word->nchars;
+	if (m == 0) {
+		return 0;
+	}
+	if (m > APPROX_MAX_LEN) {
+		return simple_match(word, str, key, false, positions);
+	}
+
+	const uint64_t last = 1ull << (m - 1);
+	uint64_t pv = UINT64_MAX;
+	uint64_t mv = 0;
+	uint32_t dist = m;
+	uint32_t best = word->max_edits + 1;
+	size_t end = 0;
+
+	const bool ascii = key->folded == NULL;
+	const char *c = key->folded;
+	for (size_t i = 0; ascii ? i < key->len : *c != '\0'; i++) {
+		uint64_t eq;
+		if (ascii) {
+			eq = word->peq[(unsigned char)str[i] & 0x7F];
+		} else {
+			eq = approx_eq(word, utf8_to_utf32(c));
+			c = utf8_next_char(c);
+		}
+		uint64_t xv = eq | mv;
+		uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+		uint64_t ph = mv | ~(xh | pv);
+		uint64_t mh = pv & xh;
+		if (ph & last) {
+			dist++;
+		} else if (mh & last) {
+			dist--;
+		}
+		/*
+		 * A match can start anywhere in str, so the distance along
+		 * the top row is always zero, and nothing's shifted in.
+		 */
+		ph <<= 1;
+		mh <<= 1;
+		pv = mh | ~(xv | ph);
+		mv = ph & xv;
+		if (dist < best) {
+			best = dist;
+			end = i;
+			if (best == 0) {
+				/* Nothing beats the first exact match. */
+				break;
+			}
+		}
+	}
+
+	if (best > word->max_edits) {
+		return INT32_MIN;
+	}
+	if (positions != NULL) {
+		trace_approx_match(positions, word, str, key, end, best);
+	}
+	int32_t start = end + 1 > m ? end + 1 - m : 0;
+	return typo_penalty * (int32_t)best - start;
+}
+
+/*
+ * Find which characters of str matched the word, in the best match, which
+ * ends at character end with dist typos. Only the stretch of str before end
+ * as long as the word plus the typos can be involved, so the table of edit
+ * distances is worked out again for just that, in full this time, and then
+ * worked back through from the end.
  */
-int32_t compute_score(int32_t jump, bool first_char, const char *restrict match)
+static void trace_approx_match(
+		struct match_positions *positions,
+		const struct match_word *word,
+		const char *str,
+		const struct match_key *key,
+		size_t end,
+		uint32_t dist)
+{
+	const size_t m = word->nchars;
+	size_t start = end + 1 > m + dist ? end + 1 - (m + dist) : 0;
+	size_t n = end + 1 - start;
+
+	uint32_t *text = xmalloc(n * sizeof(*text));
+	if (key->folded == NULL) {
+		for (size_t j = 0; j < n; j++) {
+			text[j] = ascii_tolower((unsigned char)str[start + j]);
+		}
+	} else {
+		const char *c = key->folded;
+		for (size_t j = 0; j < start; j++) {
+			c = utf8_next_char(c);
+		}
+		for (size_t j = 0; j < n; j++) {
+			text[j] = utf8_to_utf32(c);
+			c = utf8_next_char(c);
+		}
+	}
+
+	const size_t cols = n + 1;
+	if (positions->table_size < (m + 1) * cols) {
+		positions->table_size = (m + 1) * cols;
+		positions->table = xrealloc(
+				positions->table,
+				positions->table_size * sizeof(*positions->table));
+	}
+	int32_t *d = positions->table;
+	for (size_t j = 0; j <= n; j++) {
+		d[j] = 0;
+	}
+	for (size_t i = 1; i <= m; i++) {
+		int32_t *row = &d[i * cols];
+		const int32_t *prev = &d[(i - 1) * cols];
+		row[0] = i;
+		for (size_t j = 1; j <= n; j++) {
+			int32_t sub = prev[j - 1] + (word->chars[i - 1] != text[j - 1]);
+			row[j] = MIN(sub, MIN(prev[j], row[j - 1]) + 1);
+		}
+	}
+
+	size_t i = m;
+	size_t j = n;
+	while (i > 0 && j > 0) {
+		int32_t here = d[i * cols + j];
+		bool same = word->chars[i - 1] == text[j - 1];
+		if (d[(i - 1) * cols + j - 1] + !same == here) {
+			if (same) {
+				add_positions(positions, str, key, start + j - 1, start + j - 1);
+			}
+			i--;
+			j--;
+		} else if (d[(i - 1) * cols + j] + 1 == here) {
+			i--;
+		} else {
+			j--;
+		}
+	}
+	free(text);
+}
+
+static bool is_upper(uint32_t c, bool ascii)
+{
+	return ascii ? c >= 'A' && c <= 'Z' : utf32_isupper(c);
+}
+
+static bool is_lower(uint32_t c, bool ascii)
+{
+	return ascii ? c >= 'a' && c <= 'z' : utf32_islower(c);
+}
+
+static bool is_alnum(uint32_t c, bool ascii)
+{
+	if (ascii) {
+		return (c >= 'a' && c <= 'z')
+			|| (c >= 'A' && c <= 'Z')
+			|| (c >= '0' && c <= '9');
+	}
+	return utf32_isalnum(c);
+}
+
+/*
+ * Calculate the bonus for a match at str[i], for following a separator
+ * character, or for being uppercase after a lowercase letter.
+ */
+int32_t compute_bonus(const uint32_t *str, size_t i, bool ascii)
 {
-	const int adjacency_bonus = 15;
 	const int separator_bonus = 30;
 	const int camel_bonus = 30;
-	const int first_letter_bonus = 15;
 
-	const int leading_letter_penalty = -5;
-	const int max_leading_letter_penalty = -15;
+	if (i == 0) {
+		return 0;
+	}
 
 	int32_t score = 0;
+	const uint32_t cur = str[i];
+	const uint32_t prev = str[i - 1];
+	if (is_upper(cur, ascii) && is_lower(prev, ascii)) {
+		score += camel_bonus;
+	}
+	if (is_alnum(cur, ascii) && !is_alnum(prev, ascii)) {
+		score += separator_bonus;
+	}
+	return score;
+}
 
-	const uint32_t cur = utf8_to_utf32(match);
+/*
+ * Return an upper bound on fuzzy_match(word, str), or INT32_MIN if the
+ * characters of word aren't all in str, in order.
+ *
+ * Each character of word after the first scores at most the adjacency bonus
+ * plus a bonus from compute_bonus(), which it can only get where str has a
+ * separator or a change of case in front of a character that might be in
+ * the query, going by its signature. A character that follows a separator
+ * can't be adjacent to the last one matched, unless that was a separator too,
+ * so if word has none, it only beats the adjacency bonus by the difference.
+ * The first character scores no more than it would where it first appears in
+ * str, plus a bonus if there's one to be had. For long strings, though, it's
+ * mostly the penalty for each unmatched character that keeps the bound down.
+ */
+int32_t fuzzy_bound(
+		const struct match_word *restrict word,
+		const char *restrict str,
+		const struct match_key *restrict key,
+		uint64_t sig)
+{
+	const uint32_t *pat = word->chars;
+	const size_t plen = word->nchars;
+	if (plen == 0) {
+		return 0;
+	}
+	const size_t slen = key->nchars;
+	if (slen < plen) {
+		return INT32_MIN;
+	}
 
-	/* Apply bonuses. */
-	if (!first_char && jump == 0) {
-		score += adjacency_bonus;
+	const bool ascii = key->folded == NULL;
+	bool alnum = ascii;
+	for (size_t i = 0; alnum && i < plen; i++) {
+		alnum = is_alnum(pat[i], true);
 	}
-	if (!first_char || jump > 0) {
-		const uint32_t prev = utf8_to_utf32(utf8_prev_char(match));
-		if (utf32_isupper(cur) && utf32_islower(prev)) {
-			score += camel_bonus;
+
+	const char *c = str;
+	/* The previous character of str, and this one, for compute_bonus(). */
+	uint32_t pair[2] = { 0, 0 };
+	size_t first = 0;
+	size_t found = 0;
+	size_t ncamel = 0;
+	size_t nseparator = 0;
+	int32_t camel_bonus = 0;
+	int32_t separator_bonus = 0;
+	for (size_t i = 0; i < slen; i++) {
+		pair[0] = pair[1];
+		if (ascii) {
+			pair[1] = (unsigned char)str[i];
+		} else {
+			pair[1] = utf8_to_utf32(c);
+			c = utf8_next_char(c);
 		}
-		if (utf32_isalnum(cur) && !utf32_isalnum(prev)) {
-			score += separator_bonus;
+		uint32_t lower = ascii ? ascii_tolower(pair[1]) : utf32_tolower(pair[1]);
+		if (found < plen && lower == pat[found]) {
+			if (found == 0) {
+				first = i;
+			}
+			found++;
+		}
+		if (i == 0 || (lower < 0x80 && !(signature_bits[lower] & sig))) {
+			continue;
+		}
+		int32_t bonus = compute_bonus(pair, 1, ascii);
+		if (bonus == 0) {
+			continue;
+		}
+		if (is_upper(pair[1], ascii) && is_lower(pair[0], ascii)) {
+			ncamel++;
+			camel_bonus = MAX(camel_bonus, bonus);
+		} else {
+			nseparator++;
+			separator_bonus = MAX(separator_bonus, bonus);
 		}
 	}
-	if (first_char && jump == 0) {
-		/* Match at start of string gets separator bonus. */
-		score += first_letter_bonus;
+	if (found < plen) {
+		return INT32_MIN;
 	}
 
-	/* Apply penalties. */
-	if (first_char) {
-		score += MAX(leading_letter_penalty * jump,
-				max_leading_letter_penalty);
+	int64_t bound;
+	if (first == 0) {
+		bound = first_letter_bonus;
+	} else {
+		int32_t jump = MIN(first, (size_t)INT16_MAX);
+		bound = MAX(leading_letter_penalty * jump, max_leading_letter_penalty);
 	}
+	bound += adjacency_bonus * (int64_t)(plen - 1);
 
-	return score;
+	/* Each character can only have one bonus, and camel case's are biggest. */
+	size_t ncamel_matched = MIN(plen, ncamel);
+	size_t nseparator_matched = MIN(plen - ncamel_matched, nseparator);
+	bound += camel_bonus * (int64_t)ncamel_matched;
+	if (alnum && nseparator > 0) {
+		bound += (separator_bonus - adjacency_bonus) * (int64_t)nseparator_matched;
+		bound += adjacency_bonus;
+	} else {
+		bound += separator_bonus * (int64_t)nseparator_matched;
+	}
+	bound += unmatched_letter_penalty * (int64_t)(slen - plen);
+	return MAX(bound, INT32_MIN + 1);
 }
@@ -1,14 +1,179 @@
 #ifndef MATCHING_H
 #define MATCHING_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include "fuzzy_batch.h"
 
 enum matching_algorithm {
 	MATCHING_ALGORITHM_NORMAL,
 	MATCHING_ALGORITHM_PREFIX,
-	MATCHING_ALGORITHM_FUZZY
+	MATCHING_ALGORITHM_FUZZY,
+	MATCHING_ALGORITHM_APPROX
 };
 
+/* A single space-separated word of a query. */
+struct match_word {
+	/* Normalised and casefolded, for substring matching. */
+	char *folded;
+	size_t folded_len;
+
+	/*
+	 * Normalised and lowercased codepoints, for fuzzy matching, or
+	 * casefolded ones, for approximate matching.
+	 */
+	uint32_t *chars;
+	size_t nchars;
+
+	/*
+	 * For approximate matching, a bitmask for each ASCII character of the
+	 * positions in the word where it appears, in either case, and the
+	 * number of typos allowed.
+	 */
+	uint64_t *peq;
+	uint32_t max_edits;
+};
+
+/*
+ * A query, normalised and split into words once per search, so that matching
+ * it against each candidate doesn't have to.
+ */
+struct match_query {
+	enum matching_algorithm algorithm;
+	size_t count;
+	struct match_word *words;
+
+	/*
+	 * Signature of the characters any match must contain. A candidate
+	 * whose key's signature doesn't include all of these bits can be
+	 * rejected without looking at it.
+	 */
+	uint64_t sig;
+};
+
+[[nodiscard("memory leaked")]]
+struct match_query match_query_create(enum matching_algorithm algorithm, const char *patterns);
+void match_query_destroy(struct match_query *query);
+
+/*
+ * What's matched of a candidate string, worked out once when it's loaded
+ * rather than on every search.
+ */
+struct match_key {
+	/* Casefolded copy of the matched part, or NULL if it's plain ASCII. */
+	char *folded;
+
+	/* Length of the matched part, in bytes and in characters. */
+	uint32_t len;
+	uint32_t nchars;
+
+	/*
+	 * Signature of the characters in the matched part, once casefolded:
+	 * a bit for each ASCII letter and digit, and the rest hashed into the
+	 * remaining 28 bits.
+	 */
+	uint64_t sig;
+};
+
+/*
+ * Make the key for matching the first len bytes of str. The folded copy, if
+ * any, is allocated, for the caller to free.
+ */
+void match_key_init(struct match_key *key, const char *str, size_t len);
+
+/*
+ * Match the query against str, with key from match_key_init(). Plain ASCII
+ * strings are matched without any calls into GLib, and nothing is allocated
+ * unless fuzzy matching a string over 256 characters long.
+ */
+int32_t match_query_score(
+		const struct match_query *restrict query,
+		const char *restrict str,
+		const struct match_key *restrict key);
+
+/*
+ * Return an upper bound on match_query_score() for a fuzzy query, or
+ * INT32_MIN if str doesn't match, without working out the best alignment.
+ * That takes a single pass over str rather than one per character of the
+ * query. Other algorithms are quick enough already, so this just returns the
+ * score for them.
+ */
+int32_t match_query_bound(
+		const struct match_query *restrict query,
+		const char *restrict str,
+		const struct match_key *restrict key);
+
+/*
+ * Whether a string with key is best matched against query as part of a batch,
+ * which it can be if query is fuzzy, and the string is plain ASCII and no more
+ * than FUZZY_BATCH_MAX_LEN characters long. It's only worth it if query has a
+ * word of a few characters, though.
+ */
+bool match_query_batchable(
+		const struct match_query *restrict query,
+		const struct match_key *restrict key);
+
+/*
+ * Add str, with key, to the next lane of batch, which must have room for it.
+ * It's up to the caller to empty the batch, by setting its count and max_len
+ * to 0, before starting another.
+ */
+void match_batch_add(
+		struct fuzzy_batch *restrict batch,
+		const char *restrict str,
+		const struct match_key *restrict key);
+
+/*
+ * Fill scores with match_query_score() of each string in batch, all of which
+ * must have keys with all of query's signature bits.
+ */
+void match_query_score_batch(
+		const struct match_query *restrict query,
+		const struct fuzzy_batch *restrict batch,
+		int32_t scores[FUZZY_BATCH_SIZE]);
+
+/*
+ * Where a query matched a string, for highlighting: the byte offset of each
+ * matched character, in ascending order. The buffers are kept from one match
+ * to the next, so once they're big enough, nothing is allocated.
+ */
+struct match_positions {
+	size_t count;
+	size_t size;
+	uint32_t *buf;
+
+	/*
+	 * The whole table of scores, for working back through fuzzy and
+	 * approximate matches.
+	 */
+	size_t table_size;
+	int32_t *table;
+};
+
+void match_positions_destroy(struct match_positions *positions);
+
+/*
+ * As match_query_score(), but also fill positions with the characters that
+ * matched. Characters of non-ASCII strings whose casefolded form has a
+ * different number of characters can't be lined up with the original, so
+ * are left out.
+ */
+int32_t match_query_positions(
+		const struct match_query *restrict query,
+		const char *restrict str,
+		const struct match_key *restrict key,
+		struct match_positions *restrict positions);
+
+/*
+ * Whether everything that matches patterns is sure to match prefix, one of
+ * its prefixes, so that only prefix's matches need checking. That's always
+ * the case, apart from approximate matching, where a longer word can allow
+ * more typos.
+ */
+bool match_words_narrow(enum matching_algorithm algorithm, const char *prefix, const char *patterns);
+
+/* Compile patterns and match them against str in one go. */
 int32_t match_words(enum matching_algorithm algorithm, const char *restrict patterns, const char *restrict str);
 
 #endif /* MATCHING_H */
@@ -0,0 +1,160 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <unistd.h>
+#include "log.h"
+#include "pool.h"
+#include "xmalloc.h"
+
+/*
+ * Matching is memory-bound well before this many threads, so there's no
+ * point in more.
+ */
+#define MAX_THREADS 16
+
+static struct {
+	bool started;
+
+	/* Including the thread that calls pool_run(). */
+	size_t nthreads;
+	thrd_t *threads;
+
+	/* Guards everything below, apart from next. */
+	mtx_t lock;
+	cnd_t work_cond;
+	cnd_t done_cond;
+	bool quit;
+
+	/* Bumped for each call to pool_run(), to wake the workers. */
+	uint64_t generation;
+
+	/* The current batch of jobs. */
+	void (*job)(void *data, size_t i);
+	void *data;
+	size_t count;
+	atomic_size_t next;
+
+	/* Number of workers yet to finish with the current batch. */
+	size_t active;
+} pool;
+
+static void run_jobs(void)
+{
+	size_t i;
+	while ((i = atomic_fetch_add(&pool.next, 1)) < pool.count) {
+		pool.job(pool.data, i);
+	}
+}
+
+static int worker(void *arg)
+{
+	uint64_t generation = 0;
+	mtx_lock(&pool.lock);
+	while (true) {
+		while (!pool.quit && pool.generation == generation) {
+			cnd_wait(&pool.work_cond, &pool.lock);
+		}
+		if (pool.quit) {
+			break;
+		}
+		generation = pool.generation;
+		mtx_unlock(&pool.lock);
+
+		run_jobs();
+
+		mtx_lock(&pool.lock);
+		if (--pool.active == 0) {
+			cnd_signal(&pool.done_cond);
+		}
+	}
+	mtx_unlock(&pool.lock);
+	return 0;
+}
+
+static void pool_start(void)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t nthreads = ncpu < 1 ? 1 : ncpu;
+	if (nthreads > MAX_THREADS) {
+		nthreads = MAX_THREADS;
+	}
+
+	pool.started = true;
+	pool.nthreads = 1;
+	pool.threads = xcalloc(nthreads, sizeof(*pool.threads));
+	mtx_init(&pool.lock, mtx_plain);
+	cnd_init(&pool.work_cond);
+	cnd_init(&pool.done_cond);
+	for (size_t i = 1; i < nthreads; i++) {
+		if (thrd_create(&pool.threads[i], worker, NULL) != thrd_success) {
+			/* Not a problem, we'll just be a little slower. */
+			log_error("Failed to start worker thread.\n");
+			break;
+		}
+		pool.nthreads++;
+	}
+	log_debug("Started %zu worker threads.\n", pool.nthreads - 1);
+}
+
+size_t pool_thread_count(void)
+{
+	if (!pool.started) {
+		pool_start();
+	}
+	return pool.nthreads;
+}
+
+void pool_run(size_t count, void (*job)(void *data, size_t i), void *data)
+{
+	if (pool_thread_count() == 1 || count <= 1) {
+		for (size_t i = 0; i < count; i++) {
+			job(data, i);
+		}
+		return;
+	}
+
+	mtx_lock(&pool.lock);
+	pool.job = job;
+	pool.data = data;
+	pool.count = count;
+	atomic_store(&pool.next, 0);
+	pool.active = pool.nthreads - 1;
+	pool.generation++;
+	cnd_broadcast(&pool.work_cond);
+	mtx_unlock(&pool.lock);
+
+	run_jobs();
+
+	/*
+	 * Every worker has to check in, even if there was nothing left for
+	 * it, so that none of them is still looking at this batch when the
+	 * next one starts.
+	 */
+	mtx_lock(&pool.lock);
+	while (pool.active > 0) {
+		cnd_wait(&pool.done_cond, &pool.lock);
+	}
+	mtx_unlock(&pool.lock);
+}
+
+void pool_destroy(void)
+{
+	if (!pool.started) {
+		return;
+	}
+	mtx_lock(&pool.lock);
+	pool.quit = true;
+	cnd_broadcast(&pool.work_cond);
+	mtx_unlock(&pool.lock);
+	for (size_t i = 1; i < pool.nthreads; i++) {
+		thrd_join(pool.threads[i], NULL);
+	}
+	free(pool.threads);
+	cnd_destroy(&pool.done_cond);
+	cnd_destroy(&pool.work_cond);
+	mtx_destroy(&pool.lock);
+	pool.started = false;
+	pool.quit = false;
+}
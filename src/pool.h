@@ -0,0 +1,29 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/*
+ * A pool of worker threads, for splitting up work that's too slow for one
+ * thread, like filtering hundreds of thousands of candidates on every
+ * keypress. The threads are started the first time they're needed, and then
+ * wait around for more work, rather than being started again every time.
+ *
+ * There's just the one pool, which should only be used from one thread at a
+ * time.
+ */
+
+/* Number of threads work is spread across, including the caller. */
+size_t pool_thread_count(void);
+
+/*
+ * Call job(data, i) for each i below count, in parallel, and wait for them
+ * all to finish. The calling thread does its share of the work too. Jobs are
+ * handed out in order, but can finish in any order.
+ */
+void pool_run(size_t count, void (*job)(void *data, size_t i), void *data);
+
+/* Stop the threads, if they were ever started. */
+void pool_destroy(void);
+
+#endif /* POOL_H */
@@ -0,0 +1,54 @@
+#include <string.h>
+#include "radix_sort.h"
+
+/* Only the top four bytes hold anything to sort by. */
+#define RADIX_PASSES 4
+#define RADIX_SHIFT 32
+
+void radix_sort(uint64_t *restrict keys, uint64_t *restrict tmp, size_t count)
+{
+	if (count < 2) {
+		return;
+	}
+
+	/* Count each byte value for every pass at once. */
+	size_t counts[RADIX_PASSES][256] = { 0 };
+	for (size_t i = 0; i < count; i++) {
+		uint64_t key = keys[i] >> RADIX_SHIFT;
+		for (size_t pass = 0; pass < RADIX_PASSES; pass++) {
+			counts[pass][(key >> (8 * pass)) & 0xFF]++;
+		}
+	}
+
+	uint64_t *src = keys;
+	uint64_t *dest = tmp;
+	for (size_t pass = 0; pass < RADIX_PASSES; pass++) {
+		size_t *bucket = counts[pass];
+		unsigned int shift = RADIX_SHIFT + 8 * pass;
+
+		/*
+		 * Scores are usually small, so most keys share their top
+		 * bytes, and there's nothing to do when they all do.
+		 */
+		if (bucket[(src[0] >> shift) & 0xFF] == count) {
+			continue;
+		}
+
+		size_t offset = 0;
+		for (size_t i = 0; i < 256; i++) {
+			size_t n = bucket[i];
+			bucket[i] = offset;
+			offset += n;
+		}
+		for (size_t i = 0; i < count; i++) {
+			dest[bucket[(src[i] >> shift) & 0xFF]++] = src[i];
+		}
+
+		uint64_t *swap = src;
+		src = dest;
+		dest = swap;
+	}
+	if (src != keys) {
+		memcpy(keys, src, count * sizeof(*keys));
+	}
+}
@@ -0,0 +1,26 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Sorting results by comparing their scores through qsort() means a function
+ * call per comparison, and gets slow once there are hundreds of thousands of
+ * them. Instead, each result is packed into a 64-bit key, with what it's
+ * sorted by in the top 32 bits, smallest first, and its position in the
+ * bottom 32 bits. The keys are then put in order a byte at a time, least
+ * significant first, which never compares two keys at all.
+ *
+ * As the keys are passed in order of position, and each pass keeps equal
+ * bytes in the order they came in, only the top half needs sorting for the
+ * keys to end up completely in order, so ties stay in their original order.
+ */
+
+/*
+ * Sort count keys, which must be in ascending order of their bottom 32 bits,
+ * using tmp, which must have room for count keys, as scratch space.
+ */
+void radix_sort(uint64_t *restrict keys, uint64_t *restrict tmp, size_t count);
+
+#endif /* RADIX_SORT_H */
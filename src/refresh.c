@@ -0,0 +1,141 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "compgen.h"
+#include "drun.h"
+#include "files.h"
+#include "log.h"
+#include "refresh.h"
+
+static void notify(struct refresh *refresh)
+{
+	uint64_t one = 1;
+	errno = 0;
+	if (write(refresh->fd, &one, sizeof(one)) == -1) {
+		log_error("Failed to signal refresh progress: %s.\n", strerror(errno));
+	}
+}
+
+/* Replace any partial list that's not been collected yet with a newer one. */
+static void publish_partial(struct file_index *index, void *data)
+{
+	struct refresh *refresh = data;
+	mtx_lock(&refresh->lock);
+	file_index_destroy(&refresh->partial);
+	refresh->partial = *index;
+	mtx_unlock(&refresh->lock);
+	notify(refresh);
+}
+
+static int refresh_thread(void *arg)
+{
+	struct refresh *refresh = arg;
+
+	switch (refresh->mode) {
+		case TOFI_MODE_RUN:
+			refresh->command_buffer = compgen_update();
+			break;
+		case TOFI_MODE_DRUN:
+			refresh->apps = drun_update();
+			break;
+		case TOFI_MODE_FILES:
+			files_update(
+					&refresh->file_index,
+					refresh->files_options,
+					refresh->stream ? publish_partial : NULL,
+					refresh);
+			break;
+		case TOFI_MODE_PLAIN:
+			break;
+	}
+
+	mtx_lock(&refresh->lock);
+	refresh->done = true;
+	mtx_unlock(&refresh->lock);
+	notify(refresh);
+	return 0;
+}
+
+bool refresh_start(
+		struct refresh *refresh,
+		enum tofi_mode mode,
+		struct scan_options files_options,
+		bool stream)
+{
+	*refresh = (struct refresh){
+		.mode = mode,
+		.stream = stream,
+		.files_options = files_options,
+		.fd = -1
+	};
+
+	errno = 0;
+	refresh->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (refresh->fd == -1) {
+		log_error("Failed to create eventfd: %s.\n", strerror(errno));
+		return false;
+	}
+	mtx_init(&refresh->lock, mtx_plain);
+	if (thrd_create(&refresh->thread, refresh_thread, refresh) != thrd_success) {
+		log_error("Failed to start refresh thread.\n");
+		mtx_destroy(&refresh->lock);
+		close(refresh->fd);
+		refresh->fd = -1;
+		return false;
+	}
+	return true;
+}
+
+bool refresh_collect(struct refresh *refresh, struct file_index *partial)
+{
+	/* Reset the eventfd, however many times it's been signalled. */
+	uint64_t count;
+	if (read(refresh->fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		log_error("Failed to read refresh progress: %s.\n", strerror(errno));
+	}
+
+	mtx_lock(&refresh->lock);
+	bool done = refresh->done;
+	if (!done && refresh->partial.data != NULL) {
+		*partial = refresh->partial;
+		refresh->partial = (struct file_index){ 0 };
+	}
+	mtx_unlock(&refresh->lock);
+	return done;
+}
+
+void refresh_finish(struct refresh *refresh)
+{
+	if (refresh->fd == -1) {
+		return;
+	}
+	thrd_join(refresh->thread, NULL);
+	file_index_destroy(&refresh->partial);
+	mtx_destroy(&refresh->lock);
+	close(refresh->fd);
+	refresh->fd = -1;
+}
+
+void refresh_abandon(struct refresh *refresh)
+{
+	if (refresh->fd == -1) {
+		return;
+	}
+	refresh_finish(refresh);
+	switch (refresh->mode) {
+		case TOFI_MODE_RUN:
+			free(refresh->command_buffer);
+			break;
+		case TOFI_MODE_DRUN:
+			desktop_vec_destroy(&refresh->apps);
+			break;
+		case TOFI_MODE_FILES:
+			file_index_destroy(&refresh->file_index);
+			break;
+		case TOFI_MODE_PLAIN:
+			break;
+	}
+}
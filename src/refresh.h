@@ -0,0 +1,66 @@
+#ifndef REFRESH_H
+#define REFRESH_H
+
+#include <stdbool.h>
+#include <threads.h>
+#include "desktop_vec.h"
+#include "entry.h"
+#include "file_index.h"
+#include "scan.h"
+
+/*
+ * Rebuilding the run, drun or files lists can mean walking a fair chunk of
+ * the filesystem, so when a cache is out of date, we show it anyway and
+ * rebuild it on a background thread. fd is an eventfd that becomes readable
+ * whenever there's something new to show, and is -1 when no refresh is
+ * running.
+ *
+ * When streaming, the files list is also published as each directory is
+ * scanned, so that there's something to show straight away even when there's
+ * no cache at all.
+ */
+struct refresh {
+	enum tofi_mode mode;
+	bool stream;
+	struct scan_options files_options;
+	int fd;
+	thrd_t thread;
+
+	/* Guards done and partial. */
+	mtx_t lock;
+	bool done;
+	struct file_index partial;
+
+	/* The new list, depending on mode. */
+	char *command_buffer;
+	struct desktop_vec apps;
+	struct file_index file_index;
+};
+
+bool refresh_start(
+		struct refresh *refresh,
+		enum tofi_mode mode,
+		struct scan_options files_options,
+		bool stream);
+
+/*
+ * Check on a refresh once fd is readable. Returns true if it's finished, in
+ * which case refresh_finish() should be called. Otherwise, the latest
+ * partial files list is moved to partial, if one's been published since the
+ * last call.
+ */
+bool refresh_collect(struct refresh *refresh, struct file_index *partial);
+
+/*
+ * Wait for the refresh thread to finish and clean up after it. The new list
+ * is left for the caller to take ownership of.
+ */
+void refresh_finish(struct refresh *refresh);
+
+/*
+ * Wait for a refresh whose new list is no longer wanted, so that the cache
+ * it's writing still gets finished, then free the list.
+ */
+void refresh_abandon(struct refresh *refresh);
+
+#endif /* REFRESH_H */
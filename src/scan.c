@@ -0,0 +1,1220 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+#include "log.h"
+#include "scan.h"
+#include "traverse.h"
+#include "xmalloc.h"
+
+/*
+ * When the number of files listed is limited, top-level roots are only
+ * listed if the roots before them haven't already filled this fraction of
+ * the list.
+ */
+#define TOP_LEVEL_THRESHOLD(max_files) ((max_files) / 5 * 4)
+
+/* There's no point in more threads than this, we'll just be waiting on I/O. */
+#define MAX_THREADS 32
+
+/*
+ * Directories are opened as soon as they're found, relative to their parent,
+ * and the file descriptor handed over with the work item. Past this many,
+ * queued directories are closed again and reopened by path later, so we
+ * don't run out of file descriptors.
+ */
+#define MAX_QUEUED_FDS 256
+
+/*
+ * What's always left out, in .gitignore syntax. Rules from the options come
+ * after these, so can re-include any of them.
+ */
+static const char *const default_excludes[] = {
+	"/proc/", "/sys/", "/dev/", "/run/", "/tmp/",
+	"/var/lib/docker/", "/snap/", "/mnt/", "/media/",
+	".git/", "node_modules/", ".cache/", "lost+found/",
+	NULL
+};
+
+/*
+ * The scan is performed in parallel, so we can't write files out as we find
+ * them. Instead, each directory records its entries in the order they were
+ * read, with subdirectories stored as placeholders to be filled in by
+ * whichever thread reads them. Once everything has been read, the tree is
+ * walked depth-first, listing each directory's files before descending into
+ * its subdirectories, so the output doesn't depend on the number of threads.
+ * This isn't the order a sequential scan would interleave them in, so
+ * files-max-count keeps a directory's own files ahead of anything below it.
+ *
+ * Symlinked directories are deferred until everything else has been read,
+ * then resolved in depth-first order, so that a directory reachable by
+ * several paths is always listed under the same one (and symlink loops are
+ * never followed).
+ */
+
+/*
+ * A work-stealing deque of directories waiting to be read. The owning thread
+ * pushes and pops at the back, so it works depth-first through its own
+ * subtree, while idle threads steal from the front, taking the oldest (and
+ * likely largest) pending subtrees.
+ */
+struct deque {
+	mtx_t lock;
+	size_t head;
+	size_t count;
+	size_t size;
+	struct scan_dir **buf;
+};
+
+struct scanner {
+	struct deque *deques;
+	size_t nthreads;
+	struct scan_dir_set *seen;
+	const struct scan_tree *tree;
+
+	/* Number of file descriptors held by queued directories. */
+	atomic_size_t open_fds;
+
+	/* Number of directories either queued or being read. */
+	atomic_size_t pending;
+
+	/* Number of directories sitting in a deque. */
+	atomic_size_t queued;
+
+	/* Used to put threads to sleep while there's nothing to steal. */
+	mtx_t idle_lock;
+	cnd_t idle_cond;
+};
+
+struct worker {
+	struct scanner *scanner;
+	size_t id;
+};
+
+static bool too_deep(int depth, uint32_t max_depth)
+{
+	return depth > 0 && (uint32_t)depth > max_depth;
+}
+
+/*
+ * Read the ignore files of dir, open at fd, once its parent's have been
+ * read. Any rules read before are replaced.
+ */
+static void read_ignores(const struct scan_tree *tree, struct scan_dir *dir, int fd)
+{
+	if (dir->ignore != NULL) {
+		ignore_destroy(dir->ignore);
+		dir->ignore = NULL;
+	}
+	dir->ignore_read = true;
+	dir->in_repo = false;
+	if (!tree->options.ignore_files) {
+		return;
+	}
+
+	/* As with git, .gitignore files only count inside a repository. */
+	dir->in_repo = (dir->parent != NULL && dir->parent->in_repo)
+		|| faccessat(fd, ".git", F_OK, AT_SYMLINK_NOFOLLOW) == 0;
+	struct ignore *ignore = ignore_create(dir->path);
+	if (dir->in_repo) {
+		ignore_add_file(ignore, fd, ".gitignore");
+	}
+	ignore_add_file(ignore, fd, ".ignore");
+	if (ignore->nrules == 0) {
+		ignore_destroy(ignore);
+		ignore = NULL;
+	}
+	dir->ignore = ignore;
+}
+
+/*
+ * Make sure the ignore files of dir and everything above it have been read,
+ * for trees loaded from an index. Only safe while nothing else is scanning.
+ */
+static void read_ancestor_ignores(const struct scan_tree *tree, struct scan_dir *dir)
+{
+	if (dir == NULL || dir->ignore_read) {
+		return;
+	}
+	read_ancestor_ignores(tree, dir->parent);
+	int fd = -1;
+	if (tree->options.ignore_files) {
+		fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	if (fd == -1) {
+		dir->ignore_read = true;
+		dir->in_repo = dir->parent != NULL && dir->parent->in_repo;
+		return;
+	}
+	read_ignores(tree, dir, fd);
+	close(fd);
+}
+
+/*
+ * Check the entry called name in dir against the rules of every ignore file
+ * above it, deepest first, and then the tree's own.
+ */
+static bool is_ignored(const struct scan_tree *tree, const struct scan_dir *dir, const char *name, bool is_dir)
+{
+	for (const struct scan_dir *d = dir; d != NULL; d = d->parent) {
+		if (d->ignore == NULL) {
+			continue;
+		}
+		enum ignore_result result = ignore_match(d->ignore, dir->path, name, is_dir);
+		if (result != IGNORE_NO_MATCH) {
+			return result == IGNORE_EXCLUDE;
+		}
+	}
+	return ignore_match(tree->exclude, dir->path, name, is_dir) == IGNORE_EXCLUDE;
+}
+
+bool scan_dir_ignores(const struct scan_tree *tree, struct scan_dir *dir, const char *name, bool is_dir)
+{
+	read_ancestor_ignores(tree, dir);
+	return is_ignored(tree, dir, name, is_dir);
+}
+
+/* Whether the root at path is itself excluded. */
+static bool root_excluded(const struct scan_tree *tree, const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	if (slash == NULL) {
+		return false;
+	}
+	char parent[PATH_MAX];
+	snprintf(parent, sizeof(parent), "%.*s", (int)(slash - path), path);
+	return ignore_match(tree->exclude, parent, slash + 1, true) == IGNORE_EXCLUDE;
+}
+
+bool scan_dir_skips(const struct scan_dir *dir, const char *name)
+{
+	if (dir->skip == NULL) {
+		return false;
+	}
+	for (size_t i = 0; dir->skip[i] != NULL; i++) {
+		if (!strcmp(dir->skip[i], name)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+[[nodiscard("memory leaked")]]
+static struct scan_dir *dir_create(
+		const char *path,
+		struct scan_dir *parent,
+		int depth,
+		const char *const *skip)
+{
+	struct scan_dir *dir = xmalloc(sizeof(*dir));
+	dir->path = xstrdup(path);
+	dir->parent = parent;
+	dir->fd = -1;
+	dir->depth = depth;
+	dir->deferred = false;
+	dir->skip = skip;
+	dir->count = 0;
+	dir->size = 16;
+	dir->items = xcalloc(dir->size, sizeof(*dir->items));
+	dir->stat = (struct traverse_stat){ 0 };
+	dir->ignore = NULL;
+	dir->ignore_read = false;
+	dir->in_repo = false;
+	dir->watch = -1;
+	return dir;
+}
+
+/* Inode 0 is never a valid directory, so marks one we haven't opened. */
+static bool dir_opened(const struct scan_dir *dir)
+{
+	return dir->stat.id.ino != 0;
+}
+
+static bool same_stat(const struct traverse_stat *a, const struct traverse_stat *b)
+{
+	return a->id.dev == b->id.dev
+		&& a->id.ino == b->id.ino
+		&& a->mtime_sec == b->mtime_sec
+		&& a->mtime_nsec == b->mtime_nsec;
+}
+
+void scan_dir_destroy(struct scan_dir *dir)
+{
+	for (size_t i = 0; i < dir->count; i++) {
+		if (dir->items[i].file != NULL) {
+			free(dir->items[i].file);
+		} else {
+			scan_dir_destroy(dir->items[i].dir);
+		}
+	}
+	if (dir->fd != -1) {
+		close(dir->fd);
+	}
+	if (dir->ignore != NULL) {
+		ignore_destroy(dir->ignore);
+	}
+	free(dir->items);
+	free(dir->path);
+	free(dir);
+}
+
+static void dir_add(struct scan_dir *dir, char *file, struct scan_dir *subdir)
+{
+	if (dir->count == dir->size) {
+		dir->size *= 2;
+		dir->items = xrealloc(dir->items, dir->size * sizeof(dir->items[0]));
+	}
+	dir->items[dir->count].file = file;
+	dir->items[dir->count].dir = subdir;
+	dir->count++;
+}
+
+void scan_dir_add_file(struct scan_dir *dir, const char *name)
+{
+	dir_add(dir, xstrdup(name), NULL);
+}
+
+static void dir_set_init(struct scan_dir_set *set)
+{
+	mtx_init(&set->lock, mtx_plain);
+	set->count = 0;
+	set->size = 1024;
+	set->buf = xcalloc(set->size, sizeof(*set->buf));
+}
+
+void scan_dir_set_destroy(struct scan_dir_set *set)
+{
+	if (set->buf != NULL) {
+		mtx_destroy(&set->lock);
+		free(set->buf);
+		set->buf = NULL;
+	}
+}
+
+static uint64_t dir_set_hash(struct traverse_id id)
+{
+	return ((uint64_t)id.ino ^ ((uint64_t)id.dev << 32)) * 0x9e3779b97f4a7c15u;
+}
+
+static size_t dir_set_slot(const struct traverse_id *buf, size_t size, struct traverse_id id)
+{
+	size_t i = dir_set_hash(id) & (size - 1);
+	while (buf[i].ino != 0 && (buf[i].ino != id.ino || buf[i].dev != id.dev)) {
+		i = (i + 1) & (size - 1);
+	}
+	return i;
+}
+
+/*
+ * Add a directory to the set, returning false if it was already there.
+ * Inode 0 is never a valid directory, so marks empty slots.
+ */
+static bool dir_set_insert(struct scan_dir_set *set, struct traverse_id id)
+{
+	mtx_lock(&set->lock);
+	size_t i = dir_set_slot(set->buf, set->size, id);
+	if (set->buf[i].ino != 0) {
+		mtx_unlock(&set->lock);
+		return false;
+	}
+	set->buf[i] = id;
+	set->count++;
+	if (set->count > set->size / 2) {
+		size_t size = set->size * 2;
+		struct traverse_id *buf = xcalloc(size, sizeof(*buf));
+		for (size_t j = 0; j < set->size; j++) {
+			if (set->buf[j].ino != 0) {
+				buf[dir_set_slot(buf, size, set->buf[j])] = set->buf[j];
+			}
+		}
+		free(set->buf);
+		set->buf = buf;
+		set->size = size;
+	}
+	mtx_unlock(&set->lock);
+	return true;
+}
+
+/*
+ * Remove a directory from the set, if it's there. Later entries that probed
+ * past its slot are shifted back, so that they can still be found.
+ */
+static void dir_set_remove(struct scan_dir_set *set, struct traverse_id id)
+{
+	mtx_lock(&set->lock);
+	size_t mask = set->size - 1;
+	size_t i = dir_set_slot(set->buf, set->size, id);
+	if (set->buf[i].ino == 0) {
+		mtx_unlock(&set->lock);
+		return;
+	}
+	for (size_t j = (i + 1) & mask; set->buf[j].ino != 0; j = (j + 1) & mask) {
+		size_t home = dir_set_hash(set->buf[j]) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			set->buf[i] = set->buf[j];
+			i = j;
+		}
+	}
+	set->buf[i] = (struct traverse_id){ 0 };
+	set->count--;
+	mtx_unlock(&set->lock);
+}
+
+/*
+ * Claim the directory open at fd, returning false if it's already been
+ * claimed via another path.
+ */
+static bool claim_directory(struct scanner *scanner, struct scan_dir *dir, int fd)
+{
+	if (!traverse_stat(fd, "", &dir->stat)) {
+		return false;
+	}
+	if (!dir_set_insert(scanner->seen, dir->stat.id)) {
+		dir->stat = (struct traverse_stat){ 0 };
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Open a directory to be queued, returning false if it can't be opened or
+ * has already been seen.
+ */
+static bool open_queued_dir(struct scanner *scanner, struct scan_dir *dir, int dirfd, const char *name, bool nofollow)
+{
+	int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	if (nofollow) {
+		flags |= O_NOFOLLOW;
+	}
+	int fd = openat(dirfd, name, flags);
+	if (fd == -1) {
+		return false;
+	}
+	if (!claim_directory(scanner, dir, fd)) {
+		close(fd);
+		return false;
+	}
+	if (atomic_fetch_add(&scanner->open_fds, 1) < MAX_QUEUED_FDS) {
+		dir->fd = fd;
+	} else {
+		atomic_fetch_sub(&scanner->open_fds, 1);
+		close(fd);
+	}
+	return true;
+}
+
+static void deque_init(struct deque *d)
+{
+	mtx_init(&d->lock, mtx_plain);
+	d->head = 0;
+	d->count = 0;
+	d->size = 64;
+	d->buf = xcalloc(d->size, sizeof(*d->buf));
+}
+
+static void deque_destroy(struct deque *d)
+{
+	mtx_destroy(&d->lock);
+	free(d->buf);
+}
+
+static void deque_push(struct deque *d, struct scan_dir *dir)
+{
+	mtx_lock(&d->lock);
+	if (d->head + d->count == d->size) {
+		if (d->head >= d->size / 2) {
+			/* Plenty of space has been stolen from the front. */
+			memmove(d->buf, &d->buf[d->head], d->count * sizeof(d->buf[0]));
+			d->head = 0;
+		} else {
+			d->size *= 2;
+			d->buf = xrealloc(d->buf, d->size * sizeof(d->buf[0]));
+		}
+	}
+	d->buf[d->head + d->count] = dir;
+	d->count++;
+	mtx_unlock(&d->lock);
+}
+
+static struct scan_dir *deque_pop(struct deque *d)
+{
+	struct scan_dir *dir = NULL;
+	mtx_lock(&d->lock);
+	if (d->count > 0) {
+		d->count--;
+		dir = d->buf[d->head + d->count];
+		if (d->count == 0) {
+			d->head = 0;
+		}
+	}
+	mtx_unlock(&d->lock);
+	return dir;
+}
+
+static struct scan_dir *deque_steal(struct deque *d)
+{
+	struct scan_dir *dir = NULL;
+	mtx_lock(&d->lock);
+	if (d->count > 0) {
+		dir = d->buf[d->head];
+		d->head++;
+		d->count--;
+		if (d->count == 0) {
+			d->head = 0;
+		}
+	}
+	mtx_unlock(&d->lock);
+	return dir;
+}
+
+static void scanner_wake(struct scanner *scanner, bool all)
+{
+	mtx_lock(&scanner->idle_lock);
+	if (all) {
+		cnd_broadcast(&scanner->idle_cond);
+	} else {
+		cnd_signal(&scanner->idle_cond);
+	}
+	mtx_unlock(&scanner->idle_lock);
+}
+
+static void scanner_push(struct scanner *scanner, size_t id, struct scan_dir *dir)
+{
+	atomic_fetch_add(&scanner->pending, 1);
+	atomic_fetch_add(&scanner->queued, 1);
+	deque_push(&scanner->deques[id], dir);
+	scanner_wake(scanner, false);
+}
+
+static struct scan_dir *scanner_take(struct scanner *scanner, size_t id)
+{
+	struct scan_dir *dir = deque_pop(&scanner->deques[id]);
+	for (size_t i = 1; dir == NULL && i < scanner->nthreads; i++) {
+		dir = deque_steal(&scanner->deques[(id + i) % scanner->nthreads]);
+	}
+	if (dir != NULL) {
+		atomic_fetch_sub(&scanner->queued, 1);
+	}
+	return dir;
+}
+
+static void read_directory(struct scanner *scanner, size_t id, struct scan_dir *dir)
+{
+	struct traverse_dir d;
+	if (dir->fd != -1) {
+		traverse_open_fd(&d, dir->fd);
+		dir->fd = -1;
+		atomic_fetch_sub(&scanner->open_fds, 1);
+	} else if (!traverse_open(&d, AT_FDCWD, dir->path, false)) {
+		return;
+	}
+	/* Our parent has always been read by now. */
+	read_ignores(scanner->tree, dir, d.fd);
+
+	const struct traverse_entry *entry;
+	while ((entry = traverse_next(&d)) != NULL) {
+		if (scan_dir_skips(dir, entry->d_name)) {
+			continue;
+		}
+
+		enum traverse_kind kind = traverse_kind(&d, entry);
+		if (kind == TRAVERSE_OTHER) {
+			continue;
+		}
+
+		if (kind == TRAVERSE_FILE) {
+			if (!is_ignored(scanner->tree, dir, entry->d_name, false)) {
+				scan_dir_add_file(dir, entry->d_name);
+			}
+			continue;
+		}
+
+		int depth = dir->depth + 1;
+		if (too_deep(depth, scanner->tree->options.max_depth)
+				|| is_ignored(scanner->tree, dir, entry->d_name, true)) {
+			continue;
+		}
+		char full_path[PATH_MAX];
+		snprintf(full_path, sizeof(full_path), "%s/%s", dir->path, entry->d_name);
+
+		struct scan_dir *subdir = dir_create(full_path, dir, depth, NULL);
+		if (kind == TRAVERSE_LINK_DIR) {
+			subdir->deferred = true;
+			dir_add(dir, NULL, subdir);
+			continue;
+		}
+
+		if (!open_queued_dir(scanner, subdir, d.fd, entry->d_name, true)) {
+			scan_dir_destroy(subdir);
+			continue;
+		}
+		dir_add(dir, NULL, subdir);
+		scanner_push(scanner, id, subdir);
+	}
+
+	traverse_close(&d);
+}
+
+static int scan_worker(void *arg)
+{
+	struct worker *worker = arg;
+	struct scanner *scanner = worker->scanner;
+
+	while (true) {
+		struct scan_dir *dir = scanner_take(scanner, worker->id);
+		if (dir != NULL) {
+			read_directory(scanner, worker->id, dir);
+			if (atomic_fetch_sub(&scanner->pending, 1) == 1) {
+				/* That was the last directory, so we're done. */
+				scanner_wake(scanner, true);
+			}
+			continue;
+		}
+
+		/*
+		 * There's nothing to steal right now, so wait for something
+		 * to be queued, or for the last directory to be finished.
+		 */
+		mtx_lock(&scanner->idle_lock);
+		while (atomic_load(&scanner->queued) == 0
+				&& atomic_load(&scanner->pending) > 0) {
+			cnd_wait(&scanner->idle_cond, &scanner->idle_lock);
+		}
+		bool done = atomic_load(&scanner->pending) == 0;
+		mtx_unlock(&scanner->idle_lock);
+		if (done) {
+			return 0;
+		}
+	}
+}
+
+static void write_dir(const struct scan_dir *dir, uint32_t parent, struct file_index_builder *output)
+{
+	struct file_index_dir record = {
+		.dev = dir->stat.id.dev,
+		.ino = dir->stat.id.ino,
+		.mtime_sec = dir->stat.mtime_sec,
+		.mtime_nsec = dir->stat.mtime_nsec,
+		.parent = parent,
+		.depth = dir->depth
+	};
+	uint32_t index = file_index_builder_add_dir(output, dir->path, &record);
+	for (size_t i = 0; i < dir->count; i++) {
+		if (dir->items[i].file != NULL) {
+			file_index_builder_add_file(output, dir->path, dir->items[i].file);
+		}
+	}
+	for (size_t i = 0; i < dir->count; i++) {
+		if (dir->items[i].dir != NULL) {
+			write_dir(dir->items[i].dir, index, output);
+		}
+	}
+}
+
+/*
+ * Resolve any symlinked directories found by the last round of scanning, in
+ * the order they'll be written out, and queue those we haven't already seen.
+ * Returns the number of directories queued.
+ */
+static size_t queue_deferred(struct scanner *scanner, struct scan_dir *dir, size_t *next)
+{
+	size_t nqueued = 0;
+	for (size_t i = 0; i < dir->count; i++) {
+		struct scan_dir *subdir = dir->items[i].dir;
+		if (subdir == NULL) {
+			continue;
+		}
+		if (!subdir->deferred) {
+			nqueued += queue_deferred(scanner, subdir, next);
+			continue;
+		}
+		subdir->deferred = false;
+		if (open_queued_dir(scanner, subdir, AT_FDCWD, subdir->path, false)) {
+			scanner_push(scanner, *next, subdir);
+			*next = (*next + 1) % scanner->nthreads;
+			nqueued++;
+		} else {
+			scan_dir_destroy(subdir);
+			dir->count--;
+			memmove(&dir->items[i], &dir->items[i + 1], (dir->count - i) * sizeof(dir->items[0]));
+			i--;
+		}
+	}
+	return nqueued;
+}
+
+/* Read everything that's been queued, returning once all threads are idle. */
+static void scanner_run(struct scanner *scanner)
+{
+	struct worker *workers = xcalloc(scanner->nthreads, sizeof(*workers));
+	thrd_t *threads = xcalloc(scanner->nthreads, sizeof(*threads));
+	size_t nstarted = 1;
+	for (size_t i = 0; i < scanner->nthreads; i++) {
+		workers[i].scanner = scanner;
+		workers[i].id = i;
+	}
+	for (size_t i = 1; i < scanner->nthreads; i++) {
+		if (thrd_create(&threads[i], scan_worker, &workers[i]) != thrd_success) {
+			/*
+			 * Not a problem, as work is stolen from any deque,
+			 * we'll just be a little slower.
+			 */
+			log_error("Failed to start scanning thread.\n");
+			break;
+		}
+		nstarted++;
+	}
+
+	/* This thread does its share of the work too. */
+	scan_worker(&workers[0]);
+	for (size_t i = 1; i < nstarted; i++) {
+		thrd_join(threads[i], NULL);
+	}
+
+	free(threads);
+	free(workers);
+}
+
+static size_t get_thread_count(void)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1) {
+		return 1;
+	}
+	if (ncpu > MAX_THREADS) {
+		return MAX_THREADS;
+	}
+	return ncpu;
+}
+
+/*
+ * Read each of dirs, which are part of tree, and everything below them, with
+ * nthreads threads (including this one), skipping any directories already in
+ * seen. Any of dirs that can't be opened are left empty. Returns the number
+ * that could be.
+ */
+static size_t scan(
+		const struct scan_tree *tree,
+		struct scan_dir **dirs,
+		size_t ndirs,
+		struct scan_dir_set *seen,
+		size_t nthreads)
+{
+	struct scanner scanner = {
+		.nthreads = nthreads,
+		.seen = seen,
+		.tree = tree
+	};
+	atomic_init(&scanner.pending, 0);
+	atomic_init(&scanner.queued, 0);
+	atomic_init(&scanner.open_fds, 0);
+	mtx_init(&scanner.idle_lock, mtx_plain);
+	cnd_init(&scanner.idle_cond);
+	scanner.deques = xcalloc(scanner.nthreads, sizeof(*scanner.deques));
+	for (size_t i = 0; i < scanner.nthreads; i++) {
+		deque_init(&scanner.deques[i]);
+	}
+
+	/* Deal the roots out between the threads to get things started. */
+	size_t nopened = 0;
+	for (size_t i = 0; i < ndirs; i++) {
+		if (dirs[i] == NULL) {
+			continue;
+		}
+		if (open_queued_dir(&scanner, dirs[i], AT_FDCWD, dirs[i]->path, false)) {
+			scanner_push(&scanner, i % scanner.nthreads, dirs[i]);
+			nopened++;
+		}
+	}
+
+	log_debug("Scanning with %zu threads.\n", scanner.nthreads);
+	size_t nqueued;
+	do {
+		scanner_run(&scanner);
+		nqueued = 0;
+		size_t next = 0;
+		for (size_t i = 0; i < ndirs; i++) {
+			if (dirs[i] != NULL) {
+				nqueued += queue_deferred(&scanner, dirs[i], &next);
+			}
+		}
+	} while (nqueued > 0);
+
+	for (size_t i = 0; i < scanner.nthreads; i++) {
+		deque_destroy(&scanner.deques[i]);
+	}
+	free(scanner.deques);
+	cnd_destroy(&scanner.idle_cond);
+	mtx_destroy(&scanner.idle_lock);
+	return nopened;
+}
+
+/* Drop the roots that couldn't be opened. */
+static void drop_missing_roots(struct scan_tree *tree)
+{
+	for (size_t i = 0; i < tree->count; i++) {
+		if (tree->roots[i] != NULL && !dir_opened(tree->roots[i])) {
+			scan_dir_destroy(tree->roots[i]);
+			tree->roots[i] = NULL;
+		}
+	}
+}
+
+/* Set up an empty tree, compiling its exclude rules. */
+static void tree_init(struct scan_tree *tree, size_t nroots, struct scan_options options)
+{
+	*tree = (struct scan_tree){
+		.count = nroots,
+		.roots = xcalloc(nroots, sizeof(*tree->roots)),
+		.options = options,
+		.exclude = ignore_create("")
+	};
+	for (size_t i = 0; default_excludes[i] != NULL; i++) {
+		ignore_add_rule(tree->exclude, default_excludes[i]);
+	}
+	if (options.exclude != NULL) {
+		tree->options.exclude = xstrdup(options.exclude);
+		ignore_add_list(tree->exclude, options.exclude);
+	}
+}
+
+/* Create the directory for a root, or return NULL if it's excluded. */
+static struct scan_dir *root_create(const struct scan_tree *tree, const struct scan_root *root)
+{
+	if (root->top_level) {
+		return dir_create(root->path, NULL, -1, root->skip);
+	} else if (!root_excluded(tree, root->path)) {
+		return dir_create(root->path, NULL, 0, root->skip);
+	}
+	return NULL;
+}
+
+struct scan_tree scan_tree_create(
+		const struct scan_root *roots,
+		size_t nroots,
+		struct scan_options options,
+		scan_progress_fn *progress,
+		void *data)
+{
+	struct scan_tree tree;
+	tree_init(&tree, nroots, options);
+	for (size_t i = 0; i < nroots; i++) {
+		tree.roots[i] = root_create(&tree, &roots[i]);
+	}
+	struct scan_dir_set seen;
+	dir_set_init(&seen);
+	if (progress == NULL) {
+		scan(&tree, tree.roots, tree.count, &seen, get_thread_count());
+	} else {
+		/* Each root is still read in parallel. */
+		for (size_t i = 0; i < tree.count; i++) {
+			if (tree.roots[i] != NULL && scan(&tree, &tree.roots[i], 1, &seen, get_thread_count()) == 0) {
+				scan_dir_destroy(tree.roots[i]);
+				tree.roots[i] = NULL;
+			}
+			progress(&tree, i + 1, data);
+		}
+	}
+	scan_dir_set_destroy(&seen);
+	drop_missing_roots(&tree);
+	return tree;
+}
+
+void scan_tree_destroy(struct scan_tree *tree)
+{
+	for (size_t i = 0; i < tree->count; i++) {
+		if (tree->roots[i] != NULL) {
+			scan_dir_destroy(tree->roots[i]);
+		}
+	}
+	free(tree->roots);
+	tree->roots = NULL;
+	tree->count = 0;
+	free(tree->options.exclude);
+	tree->options.exclude = NULL;
+	if (tree->exclude != NULL) {
+		ignore_destroy(tree->exclude);
+		tree->exclude = NULL;
+	}
+}
+
+size_t scan_tree_write(const struct scan_tree *tree, struct file_index_builder *output)
+{
+	uint32_t max_files = tree->options.max_files;
+	size_t start = output->count;
+	size_t visible = SIZE_MAX;
+	for (size_t i = 0; i < tree->count; i++) {
+		const struct scan_dir *dir = tree->roots[i];
+		if (dir == NULL) {
+			continue;
+		}
+		size_t count = output->count - start;
+		if (max_files != SCAN_UNLIMITED
+				&& dir->depth < 0
+				&& visible == SIZE_MAX
+				&& count >= TOP_LEVEL_THRESHOLD(max_files)) {
+			visible = count;
+		}
+		write_dir(dir, FILE_INDEX_NO_PARENT, output);
+	}
+	size_t count = output->count - start;
+	if (visible > count) {
+		visible = count;
+	}
+	if (visible > max_files) {
+		visible = max_files;
+	}
+	file_index_builder_set_visible(output, visible);
+	file_index_builder_set_options(
+			output,
+			tree->options.max_depth,
+			max_files,
+			tree->options.exclude,
+			tree->options.ignore_files ? FILE_INDEX_IGNORE_FILES : 0);
+	return visible;
+}
+
+bool scan_options_match(const struct file_index *index, struct scan_options options)
+{
+	const char *exclude = file_index_exclude(index);
+	if (exclude == NULL) {
+		exclude = "";
+	}
+	uint32_t flags = options.ignore_files ? FILE_INDEX_IGNORE_FILES : 0;
+	return index->header->max_depth == options.max_depth
+		&& index->header->max_files == options.max_files
+		&& index->header->flags == flags
+		&& strcmp(exclude, options.exclude == NULL ? "" : options.exclude) == 0;
+}
+
+bool scan_tree_from_index(
+		struct scan_tree *tree,
+		const struct file_index *index,
+		const struct scan_root *roots,
+		size_t nroots,
+		struct scan_options options)
+{
+	if (!scan_options_match(index, options)) {
+		return false;
+	}
+	tree_init(tree, nroots, options);
+
+	size_t ndirs = index->header->dir_count;
+	struct scan_dir **dirs = xcalloc(ndirs, sizeof(*dirs));
+	size_t root = 0;
+	for (size_t i = 0; i < ndirs; i++) {
+		const struct file_index_dir *record = &index->dirs[i];
+		const char *path = &index->strings[record->path];
+		struct scan_dir *dir;
+		if (record->parent == FILE_INDEX_NO_PARENT) {
+			while (root < nroots && strcmp(roots[root].path, path) != 0) {
+				root++;
+			}
+			if (root == nroots || (record->depth < 0) != roots[root].top_level) {
+				free(dirs);
+				scan_tree_destroy(tree);
+				return false;
+			}
+			dir = dir_create(path, NULL, record->depth, roots[root].skip);
+			tree->roots[root] = dir;
+			root++;
+		} else {
+			dir = dir_create(path, dirs[record->parent], record->depth, NULL);
+			dir_add(dirs[record->parent], NULL, dir);
+		}
+		dir->stat = (struct traverse_stat){
+			.id = { .dev = record->dev, .ino = record->ino },
+			.mtime_sec = record->mtime_sec,
+			.mtime_nsec = record->mtime_nsec
+		};
+		for (size_t j = 0; j < record->file_count; j++) {
+			size_t n = record->first_file + j;
+			size_t name_len = file_index_name_len(index, n);
+			char *name = xmalloc(name_len + 1);
+			memcpy(name, file_index_string(index, n), name_len);
+			name[name_len] = '\0';
+			dir_add(dir, name, NULL);
+		}
+		dirs[i] = dir;
+	}
+	free(dirs);
+
+	/*
+	 * Roots that couldn't be read last time are left unopened, so that
+	 * they're picked up if they've since appeared.
+	 */
+	for (size_t i = 0; i < nroots; i++) {
+		if (tree->roots[i] == NULL) {
+			tree->roots[i] = root_create(tree, &roots[i]);
+		}
+	}
+	return true;
+}
+
+struct dir_vec {
+	size_t count;
+	size_t size;
+	struct scan_dir **buf;
+};
+
+static void dir_vec_add(struct dir_vec *vec, struct scan_dir *dir)
+{
+	if (vec->count == vec->size) {
+		vec->size = vec->size ? vec->size * 2 : 16;
+		vec->buf = xrealloc(vec->buf, vec->size * sizeof(vec->buf[0]));
+	}
+	vec->buf[vec->count++] = dir;
+}
+
+static const char *dir_name(const struct scan_dir *dir)
+{
+	const char *slash = strrchr(dir->path, '/');
+	return slash == NULL ? dir->path : slash + 1;
+}
+
+static int cmpdirp(const void *a, const void *b)
+{
+	const struct scan_dir *dir1 = *(struct scan_dir **)a;
+	const struct scan_dir *dir2 = *(struct scan_dir **)b;
+	return strcmp(dir_name(dir1), dir_name(dir2));
+}
+
+static int cmpnamep(const void *key, const void *b)
+{
+	const struct scan_dir *dir = *(struct scan_dir **)b;
+	return strcmp(key, dir_name(dir));
+}
+
+static void refresh_dir(const struct scan_tree *tree, struct scan_dir *dir, struct dir_vec *added, size_t *nreread);
+
+/*
+ * Read a directory that's changed, reusing any subdirectories that are
+ * still there, and adding any new ones to added to be scanned.
+ */
+static void reread_dir(
+		const struct scan_tree *tree,
+		struct scan_dir *dir,
+		const struct traverse_stat *stat,
+		struct dir_vec *added,
+		size_t *nreread)
+{
+	size_t nold = 0;
+	struct scan_dir **old = xcalloc(dir->count + 1, sizeof(*old));
+	for (size_t i = 0; i < dir->count; i++) {
+		if (dir->items[i].file != NULL) {
+			free(dir->items[i].file);
+		} else {
+			old[nold++] = dir->items[i].dir;
+		}
+	}
+	dir->count = 0;
+	qsort(old, nold, sizeof(*old), cmpdirp);
+	bool *reused = xcalloc(nold + 1, sizeof(*reused));
+
+	struct traverse_dir *d = xmalloc(sizeof(*d));
+	if (traverse_open(d, AT_FDCWD, dir->path, false)) {
+		dir->stat = *stat;
+		(*nreread)++;
+		read_ancestor_ignores(tree, dir->parent);
+		read_ignores(tree, dir, d->fd);
+		const struct traverse_entry *entry;
+		while ((entry = traverse_next(d)) != NULL) {
+			if (scan_dir_skips(dir, entry->d_name)) {
+				continue;
+			}
+			enum traverse_kind kind = traverse_kind(d, entry);
+			if (kind == TRAVERSE_OTHER) {
+				continue;
+			}
+			if (kind == TRAVERSE_FILE) {
+				if (!is_ignored(tree, dir, entry->d_name, false)) {
+					scan_dir_add_file(dir, entry->d_name);
+				}
+				continue;
+			}
+
+			int depth = dir->depth + 1;
+			if (too_deep(depth, tree->options.max_depth)
+					|| is_ignored(tree, dir, entry->d_name, true)) {
+				continue;
+			}
+			struct scan_dir **match = bsearch(entry->d_name, old, nold, sizeof(*old), cmpnamep);
+			if (match != NULL && !reused[match - old]) {
+				reused[match - old] = true;
+				dir_add(dir, NULL, *match);
+				continue;
+			}
+			char full_path[PATH_MAX];
+			snprintf(full_path, sizeof(full_path), "%s/%s", dir->path, entry->d_name);
+			struct scan_dir *subdir = dir_create(full_path, dir, depth, NULL);
+			dir_add(dir, NULL, subdir);
+			dir_vec_add(added, subdir);
+		}
+		traverse_close(d);
+	} else {
+		dir->stat = (struct traverse_stat){ 0 };
+	}
+	free(d);
+
+	for (size_t i = 0; i < nold; i++) {
+		if (reused[i]) {
+			refresh_dir(tree, old[i], added, nreread);
+		} else {
+			scan_dir_destroy(old[i]);
+		}
+	}
+	free(reused);
+	free(old);
+}
+
+static void refresh_dir(const struct scan_tree *tree, struct scan_dir *dir, struct dir_vec *added, size_t *nreread)
+{
+	struct traverse_stat stat;
+	if (!traverse_stat(AT_FDCWD, dir->path, &stat)) {
+		stat = (struct traverse_stat){ 0 };
+	}
+	if (!same_stat(&stat, &dir->stat)) {
+		reread_dir(tree, dir, &stat, added, nreread);
+		return;
+	}
+	for (size_t i = 0; i < dir->count; i++) {
+		if (dir->items[i].dir != NULL) {
+			refresh_dir(tree, dir->items[i].dir, added, nreread);
+		}
+	}
+}
+
+static void add_seen(struct scan_dir_set *seen, const struct scan_dir *dir)
+{
+	if (dir_opened(dir)) {
+		dir_set_insert(seen, dir->stat.id);
+	}
+	for (size_t i = 0; i < dir->count; i++) {
+		if (dir->items[i].dir != NULL) {
+			add_seen(seen, dir->items[i].dir);
+		}
+	}
+}
+
+void scan_dir_set_from_tree(struct scan_dir_set *set, const struct scan_tree *tree)
+{
+	dir_set_init(set);
+	for (size_t i = 0; i < tree->count; i++) {
+		if (tree->roots[i] != NULL) {
+			add_seen(set, tree->roots[i]);
+		}
+	}
+}
+
+void scan_dir_set_remove(struct scan_dir_set *set, const struct scan_dir *dir)
+{
+	if (dir_opened(dir)) {
+		dir_set_remove(set, dir->stat.id);
+	}
+	for (size_t i = 0; i < dir->count; i++) {
+		if (dir->items[i].dir != NULL) {
+			scan_dir_set_remove(set, dir->items[i].dir);
+		}
+	}
+}
+
+/* Remove any subdirectories that couldn't be opened. */
+static void prune(struct scan_dir *dir)
+{
+	for (size_t i = 0; i < dir->count; i++) {
+		struct scan_dir *subdir = dir->items[i].dir;
+		if (subdir == NULL) {
+			continue;
+		}
+		if (dir_opened(subdir)) {
+			prune(subdir);
+			continue;
+		}
+		scan_dir_destroy(subdir);
+		dir->count--;
+		memmove(&dir->items[i], &dir->items[i + 1], (dir->count - i) * sizeof(dir->items[0]));
+		i--;
+	}
+}
+
+void scan_tree_refresh(struct scan_tree *tree)
+{
+	struct dir_vec added = { 0 };
+	size_t nreread = 0;
+	for (size_t i = 0; i < tree->count; i++) {
+		if (tree->roots[i] != NULL) {
+			refresh_dir(tree, tree->roots[i], &added, &nreread);
+		}
+	}
+	log_debug("Reread %zu changed directories, found %zu new.\n", nreread, added.count);
+
+	if (added.count > 0) {
+		struct scan_dir_set seen;
+		scan_dir_set_from_tree(&seen, tree);
+		scan(tree, added.buf, added.count, &seen, get_thread_count());
+		scan_dir_set_destroy(&seen);
+		for (size_t i = 0; i < tree->count; i++) {
+			if (tree->roots[i] != NULL) {
+				prune(tree->roots[i]);
+			}
+		}
+	}
+	drop_missing_roots(tree);
+	free(added.buf);
+}
+
+struct scan_dir *scan_dir_add_subdir(
+		const struct scan_tree *tree,
+		struct scan_dir_set *seen,
+		struct scan_dir *dir,
+		const char *name)
+{
+	int depth = dir->depth + 1;
+	if (too_deep(depth, tree->options.max_depth)
+			|| scan_dir_skips(dir, name)
+			|| scan_dir_ignores(tree, dir, name, true)) {
+		return NULL;
+	}
+	char full_path[PATH_MAX];
+	snprintf(full_path, sizeof(full_path), "%s/%s", dir->path, name);
+
+	/*
+	 * name may be a symlink to somewhere that's already in seen, which a
+	 * full scan would only have listed once. New directories usually
+	 * arrive one at a time, and nearly empty, so just read them here
+	 * rather than starting up a pool of threads for each.
+	 */
+	struct scan_dir *subdir = dir_create(full_path, dir, depth, NULL);
+	if (scan(tree, &subdir, 1, seen, 1) == 0) {
+		scan_dir_destroy(subdir);
+		return NULL;
+	}
+	dir_add(dir, NULL, subdir);
+	return subdir;
+}
+
+bool scan_dir_remove(struct scan_dir *dir, const char *name, struct scan_dir **subdir)
+{
+	for (size_t i = 0; i < dir->count; i++) {
+		struct scan_item *item = &dir->items[i];
+		const char *item_name = item->file;
+		if (item_name == NULL) {
+			item_name = dir_name(item->dir);
+		}
+		if (strcmp(item_name, name) != 0) {
+			continue;
+		}
+
+		*subdir = item->dir;
+		free(item->file);
+		dir->count--;
+		memmove(item, item + 1, (dir->count - i) * sizeof(*item));
+		return true;
+	}
+	return false;
+}
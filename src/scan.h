@@ -0,0 +1,200 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <threads.h>
+#include "file_index.h"
+#include "ignore.h"
+#include "traverse.h"
+
+/* Value for either scan limit meaning there's no limit. */
+#define SCAN_UNLIMITED UINT32_MAX
+
+/*
+ * Limits on how deep to descend (roots are at depth 0) and on the number of
+ * files to list, a comma-separated list of extra rules for what to leave out
+ * (or NULL), and whether to honour .gitignore and .ignore files.
+ */
+struct scan_options {
+	uint32_t max_depth;
+	uint32_t max_files;
+	char *exclude;
+	bool ignore_files;
+};
+
+/*
+ * A directory to scan for sofi-files.
+ *
+ * Normal roots are scanned recursively starting at depth 0. A top-level root
+ * (i.e. $HOME) is listed one level higher, so its subdirectories start at
+ * depth 0, and any names in skip (a NULL-terminated list) are ignored as they
+ * will already have been scanned as roots of their own.
+ */
+struct scan_root {
+	const char *path;
+	bool top_level;
+	const char *const *skip;
+};
+
+/*
+ * The result of a scan is kept as a tree, so that it can be updated in place
+ * as files come and go. Each directory lists its entries in the order they
+ * were read. Files only store their name, as their full path is built as
+ * they're written out.
+ */
+struct scan_item {
+	char *file;
+	struct scan_dir *dir;
+};
+
+struct scan_dir {
+	char *path;
+	struct scan_dir *parent;
+	int fd;
+	int depth;
+	bool deferred;
+	const char *const *skip;
+
+	/* Recorded when the directory is opened, and zero until then. */
+	struct traverse_stat stat;
+
+	/*
+	 * Rules from the directory's own ignore files, if it has any, and
+	 * whether it's inside a git repository, so that .gitignore files
+	 * apply. Only valid once ignore_read is set.
+	 */
+	struct ignore *ignore;
+	bool ignore_read;
+	bool in_repo;
+
+	size_t count;
+	size_t size;
+	struct scan_item *items;
+
+	/* inotify watch descriptor, for sofi-files-watch. */
+	int watch;
+};
+
+struct scan_tree {
+	size_t count;
+
+	/* One per root, NULL for any that couldn't be read. */
+	struct scan_dir **roots;
+
+	/* The exclude string is the tree's own copy. */
+	struct scan_options options;
+
+	/* The built-in exclude rules, followed by those in options. */
+	struct ignore *exclude;
+};
+
+/*
+ * Set of directories (by device and inode) that are already in a tree, so
+ * that each is only listed once, however many ways there are to reach it.
+ */
+struct scan_dir_set {
+	mtx_t lock;
+	size_t count;
+	size_t size;
+	struct traverse_id *buf;
+};
+
+/*
+ * Called as each root is finished with, so that results can be shown before
+ * the whole scan is done. The first nscanned roots of tree are complete,
+ * and the rest are yet to be read.
+ */
+typedef void scan_progress_fn(const struct scan_tree *tree, size_t nscanned, void *data);
+
+/*
+ * Recursively scan the given roots in parallel.
+ *
+ * The result is identical to a sequential depth-first scan of each root in
+ * turn, regardless of the number of threads used. If progress isn't NULL,
+ * the roots are scanned one after another instead of all at once (so a
+ * directory reachable from several roots is always listed under the first),
+ * and progress is called after each one.
+ */
+[[nodiscard("memory leaked")]]
+struct scan_tree scan_tree_create(
+		const struct scan_root *roots,
+		size_t nroots,
+		struct scan_options options,
+		scan_progress_fn *progress,
+		void *data);
+
+void scan_tree_destroy(struct scan_tree *tree);
+
+/* Whether the tree written to an index was scanned with options. */
+bool scan_options_match(const struct file_index *index, struct scan_options options);
+
+/*
+ * Rebuild the tree that was written to an index, for the same roots and
+ * options. Returns false if the index doesn't match the roots, or was
+ * scanned with different options.
+ */
+bool scan_tree_from_index(
+		struct scan_tree *tree,
+		const struct file_index *index,
+		const struct scan_root *roots,
+		size_t nroots,
+		struct scan_options options);
+
+/*
+ * Bring a tree up to date. Only directories whose modification time (or
+ * identity) has changed are reread, along with any new subdirectories.
+ */
+void scan_tree_refresh(struct scan_tree *tree);
+
+/*
+ * Add the files and directories in a tree to output, in depth-first order,
+ * with each directory's files before its subdirectories. Files beyond the
+ * limit on the number listed are added to the manifest but not listed.
+ * Returns the number of files listed.
+ */
+size_t scan_tree_write(const struct scan_tree *tree, struct file_index_builder *output);
+
+/* Whether a directory deliberately ignores the entry called name. */
+bool scan_dir_skips(const struct scan_dir *dir, const char *name);
+
+/*
+ * Whether the entry called name in dir, which is part of tree, is excluded,
+ * either by the tree's rules or by an ignore file.
+ */
+bool scan_dir_ignores(const struct scan_tree *tree, struct scan_dir *dir, const char *name, bool is_dir);
+
+/* Add a file called name to the end of dir. */
+void scan_dir_add_file(struct scan_dir *dir, const char *name);
+
+/*
+ * Scan the subdirectory called name and add it to the end of dir, which is
+ * part of tree, adding the directories read to seen. Returns the new
+ * subdirectory, or NULL if it's excluded, can't be read, or is already in
+ * seen (via a symlink).
+ */
+struct scan_dir *scan_dir_add_subdir(
+		const struct scan_tree *tree,
+		struct scan_dir_set *seen,
+		struct scan_dir *dir,
+		const char *name);
+
+/*
+ * Remove the entry called name from dir, returning false if there wasn't one.
+ * If it was a subdirectory, it's detached and returned in subdir for the
+ * caller to destroy, otherwise subdir is set to NULL.
+ */
+bool scan_dir_remove(struct scan_dir *dir, const char *name, struct scan_dir **subdir);
+
+void scan_dir_destroy(struct scan_dir *dir);
+
+/* Start a set off with every directory in tree. */
+void scan_dir_set_from_tree(struct scan_dir_set *set, const struct scan_tree *tree);
+
+/* Remove dir and everything below it from a set. */
+void scan_dir_set_remove(struct scan_dir_set *set, const struct scan_dir *dir);
+
+void scan_dir_set_destroy(struct scan_dir_set *set);
+
+#endif /* SCAN_H */
@@ -8,7 +8,10 @@
 #include "clipboard.h"
 #include "color.h"
 #include "entry.h"
+#include "filter_thread.h"
 #include "matching.h"
+#include "refresh.h"
+#include "scan.h"
 #include "surface.h"
 #include "wlr-layer-shell-unstable-v1.h"
 #include "fractional-scale-v1.h"
@@ -16,6 +19,7 @@
 #define MAX_OUTPUT_NAME_LEN 256
 #define MAX_TERMINAL_NAME_LEN 256
 #define MAX_HISTORY_FILE_NAME_LEN 256
+#define MAX_FILES_EXCLUDE_LEN 4096
 
 struct output_list_element {
 	struct wl_list link;
@@ -58,6 +62,8 @@ struct sofi {
 	int32_t output_width;
 	int32_t output_height;
 	struct clipboard clipboard;
+	struct refresh refresh;
+	struct filter_thread filter;
 	struct {
 		struct surface surface;
 		struct wp_viewport *wp_viewport;
@@ -104,9 +110,13 @@ struct sofi {
 	bool print_index;
 	bool multiple_instance;
 	bool physical_keybindings;
+	struct scan_options files_options;
 	char target_output_name[MAX_OUTPUT_NAME_LEN];
 	char default_terminal[MAX_TERMINAL_NAME_LEN];
 	char history_file[MAX_HISTORY_FILE_NAME_LEN];
+
+	/* Pointed to by files_options.exclude, if it's been set. */
+	char files_exclude[MAX_FILES_EXCLUDE_LEN];
 };
 
 #endif /* TOFI_H */
@@ -5,12 +5,42 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <threads.h>
 #include "history.h"
 #include "matching.h"
+#include "pool.h"
+#include "radix_sort.h"
 #include "string_vec.h"
 #include "unicode.h"
 #include "xmalloc.h"
 
+/*
+ * Most candidates don't contain every character of the query, so they're
+ * checked against its signature a block at a time, in a loop simple enough
+ * for the compiler to vectorise, before the rest are scored, the short ones
+ * in batches.
+ */
+#define FILTER_BLOCK 1024
+
+/*
+ * Filtered results are only put in order as they're needed, at least this
+ * many at a time, as each round means a pass over all of them.
+ */
+#define RANK_BATCH 64
+
+/*
+ * Once at least this fraction of what's still unranked is wanted, it's
+ * quicker to radix sort the lot than to pick out the best with a heap.
+ */
+#define RANK_ALL_FRACTION 8
+
+/*
+ * Fuzzy filtering only works out the exact scores of the results that might
+ * be among this many of the best, which covers the first round of ranking.
+ * The rest just get an upper bound, until ranking gets to them.
+ */
+#define EXACT_SCORES RANK_BATCH
+
 static int cmpstringp(const void *restrict a, const void *restrict b)
 {
 	struct scored_string *restrict str1 = (struct scored_string *)a;
@@ -28,22 +58,19 @@ static int cmpstringp(const void *restrict a, const void *restrict b)
 	return strcmp(str1->string, str2->string);
 }
 
-static int cmpscorep(const void *restrict a, const void *restrict b)
+/*
+ * Put the n entries of buf in the order of their keys, which have each
+ * entry's index in their bottom 32 bits. keys must have room for 2 * n.
+ */
+static void sort_by_keys(struct scored_string_ref *restrict buf, uint64_t *restrict keys, size_t n)
 {
-	struct scored_string *restrict str1 = (struct scored_string *)a;
-	struct scored_string *restrict str2 = (struct scored_string *)b;
-
-	int hist_diff = str2->history_score - str1->history_score;
-	int search_diff = str2->search_score - str1->search_score;
-	return hist_diff + search_diff;
-}
-
-static int cmphistoryp(const void *restrict a, const void *restrict b)
-{
-	struct scored_string *restrict str1 = (struct scored_string *)a;
-	struct scored_string *restrict str2 = (struct scored_string *)b;
-
-	return str2->history_score - str1->history_score;
+	radix_sort(keys, &keys[n], n);
+	struct scored_string_ref *sorted = xmalloc(n * sizeof(*sorted));
+	for (size_t i = 0; i < n; i++) {
+		sorted[i] = buf[keys[i] & UINT32_MAX];
+	}
+	memcpy(buf, sorted, n * sizeof(*sorted));
+	free(sorted);
 }
 
 struct string_vec string_vec_create(void)
@@ -77,23 +104,7 @@ void string_vec_destroy(struct string_vec *restrict vec)
 void string_ref_vec_destroy(struct string_ref_vec *restrict vec)
 {
 	free(vec->buf);
-}
-
-struct string_ref_vec string_ref_vec_copy(const struct string_ref_vec *restrict vec)
-{
-	struct string_ref_vec copy = {
-		.count = vec->count,
-		.size = vec->size,
-		.buf = xcalloc(vec->size, sizeof(*copy.buf)),
-	};
-
-	for (size_t i = 0; i < vec->count; i++) {
-		copy.buf[i].string = vec->buf[i].string;
-		copy.buf[i].search_score = vec->buf[i].search_score;
-		copy.buf[i].history_score = vec->buf[i].history_score;
-	}
-
-	return copy;
+	free(vec->folded);
 }
 
 void string_vec_add(struct string_vec *restrict vec, const char *restrict str)
@@ -123,9 +134,45 @@ void string_ref_vec_add(struct string_ref_vec *restrict vec, char *restrict str)
 	vec->buf[vec->count].string = str;
 	vec->buf[vec->count].search_score = 0;
 	vec->buf[vec->count].history_score = 0;
+	vec->buf[vec->count].key = (struct match_key){ 0 };
 	vec->count++;
 }
 
+void string_ref_vec_prepare(struct string_ref_vec *restrict vec)
+{
+	/*
+	 * Fold each string separately first, then gather them all into one
+	 * block, so there's just the one thing to free.
+	 */
+	size_t folded_len = 0;
+	for (size_t i = 0; i < vec->count; i++) {
+		const char *str = vec->buf[i].string;
+		const char *separator = strstr(str, "|||");
+		size_t len = separator ? (size_t)(separator - str) : strlen(str);
+		match_key_init(&vec->buf[i].key, str, len);
+		if (vec->buf[i].key.folded != NULL) {
+			folded_len += strlen(vec->buf[i].key.folded) + 1;
+		}
+	}
+	free(vec->folded);
+	vec->folded = NULL;
+	if (folded_len == 0) {
+		return;
+	}
+	vec->folded = xmalloc(folded_len);
+	char *dest = vec->folded;
+	for (size_t i = 0; i < vec->count; i++) {
+		char *folded = vec->buf[i].key.folded;
+		if (folded != NULL) {
+			size_t len = strlen(folded) + 1;
+			memcpy(dest, folded, len);
+			free(folded);
+			vec->buf[i].key.folded = dest;
+			dest += len;
+		}
+	}
+}
+
 void string_vec_sort(struct string_vec *restrict vec)
 {
 	qsort(vec->buf, vec->count, sizeof(vec->buf[0]), cmpstringp);
@@ -151,7 +198,13 @@ void string_ref_vec_history_sort(struct string_ref_vec *restrict vec, struct his
 	}
 	g_hash_table_unref(hash);
 
-	qsort(vec->buf, vec->count, sizeof(vec->buf[0]), cmphistoryp);
+	/* Most used first, with ties kept in their original order. */
+	uint64_t *keys = xmalloc(2 * vec->count * sizeof(*keys));
+	for (size_t i = 0; i < vec->count; i++) {
+		keys[i] = (uint64_t)(INT32_MAX - (int64_t)vec->buf[i].history_score) << 32 | i;
+	}
+	sort_by_keys(vec->buf, keys, vec->count);
+	free(keys);
 }
 
 void string_vec_uniq(struct string_vec *restrict vec)
@@ -178,42 +231,606 @@ struct scored_string_ref *string_ref_vec_find_sorted(struct string_ref_vec *rest
 	return bsearch(&str, vec->buf, vec->count, sizeof(vec->buf[0]), cmpstringp);
 }
 
-struct string_ref_vec string_ref_vec_filter(
+struct result_vec result_vec_create(void)
+{
+	return (struct result_vec){ 0 };
+}
+
+void result_vec_destroy(struct result_vec *restrict vec)
+{
+	free(vec->index);
+	free(vec->score);
+	free(vec->bounded);
+	free(vec->ranked);
+}
+
+size_t result_vec_bytes(const struct result_vec *restrict vec)
+{
+	return vec->size * (sizeof(*vec->index) + sizeof(*vec->score) + sizeof(*vec->bounded))
+		+ vec->ranked_size * sizeof(*vec->ranked);
+}
+
+void result_vec_reserve(struct result_vec *restrict vec, size_t count)
+{
+	vec->count = 0;
+	vec->nranked = 0;
+	if (count <= vec->size && vec->index != NULL) {
+		return;
+	}
+	/* There's nothing to keep, so there's no point in xrealloc(). */
+	free(vec->index);
+	free(vec->score);
+	free(vec->bounded);
+	vec->size = count > 0 ? count : 1;
+	vec->index = xmalloc(vec->size * sizeof(*vec->index));
+	vec->score = xmalloc(vec->size * sizeof(*vec->score));
+	vec->bounded = xmalloc(vec->size * sizeof(*vec->bounded));
+}
+
+void result_vec_gather(struct result_vec *restrict vec, const size_t *counts, size_t nchunks, size_t chunk_size)
+{
+	size_t total = 0;
+	for (size_t i = 0; i < nchunks; i++) {
+		size_t start = i * chunk_size;
+		/* Each chunk's results can only move down, never overlapping a later one. */
+		memmove(&vec->index[total], &vec->index[start], counts[i] * sizeof(*vec->index));
+		memmove(&vec->score[total], &vec->score[start], counts[i] * sizeof(*vec->score));
+		memmove(&vec->bounded[total], &vec->bounded[start], counts[i] * sizeof(*vec->bounded));
+		total += counts[i];
+	}
+	vec->count = total;
+	vec->nranked = 0;
+}
+
+int32_t result_score(int64_t search_score, int64_t history_score)
+{
+	int64_t score = search_score + history_score;
+	if (score > INT32_MAX) {
+		return INT32_MAX;
+	} else if (score < INT32_MIN) {
+		return INT32_MIN;
+	}
+	return score;
+}
+
+/*
+ * Score the strings in batch, putting each in scores and bounded at the
+ * position in lanes, and empty it.
+ */
+static void score_batch(
+		const struct match_query *restrict query,
+		struct fuzzy_batch *restrict batch,
+		const size_t *restrict lanes,
+		int32_t *restrict scores,
+		bool *restrict bounded)
+{
+	int32_t batch_scores[FUZZY_BATCH_SIZE];
+	match_query_score_batch(query, batch, batch_scores);
+	for (size_t lane = 0; lane < batch->count; lane++) {
+		scores[lanes[lane]] = batch_scores[lane];
+		bounded[lanes[lane]] = false;
+	}
+	batch->count = 0;
+	batch->max_len = 0;
+}
+
+/*
+ * Score a block of n entries of vec, whose indices are in candidates, against
+ * query, and put the ones that match in results, starting at pos, returning
+ * how many there were. Where match_query_batchable() says so, entries are
+ * fuzzy matched in batches, which gives their exact scores. If bound is set, the rest only
+ * have their scores bounded, for settle_scores() to work out if need be.
+ */
+static size_t filter_block(
+		struct result_vec *restrict results,
+		size_t pos,
+		const struct string_ref_vec *restrict vec,
+		const uint32_t *restrict candidates,
+		size_t n,
+		const struct match_query *restrict query,
+		bool bound)
+{
+	int32_t scores[FILTER_BLOCK];
+	bool bounded[FILTER_BLOCK];
+
+	struct fuzzy_batch batch;
+	batch.count = 0;
+	batch.max_len = 0;
+	/* Which of the candidates is in each lane of the batch. */
+	size_t lanes[FUZZY_BATCH_SIZE];
+
+	for (size_t i = 0; i < n; i++) {
+		const struct scored_string_ref *entry = &vec->buf[candidates[i]];
+		if (match_query_batchable(query, &entry->key)) {
+			lanes[batch.count] = i;
+			match_batch_add(&batch, entry->string, &entry->key);
+			if (batch.count == FUZZY_BATCH_SIZE) {
+				score_batch(query, &batch, lanes, scores, bounded);
+			}
+		} else if (bound) {
+			scores[i] = match_query_bound(query, entry->string, &entry->key);
+			bounded[i] = true;
+		} else {
+			scores[i] = match_query_score(query, entry->string, &entry->key);
+			bounded[i] = false;
+		}
+	}
+	if (batch.count > 0) {
+		score_batch(query, &batch, lanes, scores, bounded);
+	}
+
+	size_t count = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (scores[i] == INT32_MIN) {
+			continue;
+		}
+		results->index[pos + count] = candidates[i];
+		results->score[pos + count] = result_score(scores[i], vec->buf[candidates[i]].history_score);
+		results->bounded[pos + count] = bounded[i];
+		count++;
+	}
+	return count;
+}
+
+/*
+ * Put the entries of vec that match query in results, starting at start, and
+ * return how many there were. The entries are those from start to end, or if
+ * indices isn't NULL, those at indices from start to end.
+ */
+static size_t filter_range(
+		struct result_vec *restrict results,
+		const struct string_ref_vec *restrict vec,
+		const uint32_t *restrict indices,
+		size_t start,
+		size_t end,
+		const struct match_query *restrict query,
+		bool bound)
+{
+	const uint64_t sig = query->sig;
+	size_t count = 0;
+	uint32_t candidates[FILTER_BLOCK];
+	for (size_t base = start; base < end; base += FILTER_BLOCK) {
+		size_t n = end - base;
+		if (n > FILTER_BLOCK) {
+			n = FILTER_BLOCK;
+		}
+		size_t ncandidates = 0;
+		if (indices == NULL) {
+			const struct scored_string_ref *block = &vec->buf[base];
+			for (size_t i = 0; i < n; i++) {
+				candidates[ncandidates] = base + i;
+				ncandidates += (block[i].key.sig & sig) == sig;
+			}
+		} else {
+			for (size_t i = 0; i < n; i++) {
+				uint32_t index = indices[base + i];
+				candidates[ncandidates] = index;
+				ncandidates += (vec->buf[index].key.sig & sig) == sig;
+			}
+		}
+		count += filter_block(
+				results,
+				start + count,
+				vec,
+				candidates,
+				ncandidates,
+				query,
+				bound);
+	}
+	return count;
+}
+
+struct filter_job {
+	const struct string_ref_vec *vec;
+
+	/* The entries to check, or NULL for all of them. */
+	const uint32_t *indices;
+	size_t count;
+
+	const struct match_query *query;
+
+	/* Whether to just bound scores, for settle_scores() to work out. */
+	bool bound;
+
+	size_t chunk_size;
+	struct result_vec *results;
+
+	/* How many results each chunk found. */
+	size_t *counts;
+
+	const atomic_bool *cancel;
+};
+
+static void filter_chunk(void *data, size_t i)
+{
+	struct filter_job *job = data;
+	size_t start = i * job->chunk_size;
+	size_t end = start + job->chunk_size;
+	if (end > job->count) {
+		end = job->count;
+	}
+	job->counts[i] = 0;
+	if (job->cancel != NULL && atomic_load(job->cancel)) {
+		return;
+	}
+	job->counts[i] = filter_range(
+			job->results,
+			job->vec,
+			job->indices,
+			start,
+			end,
+			job->query,
+			job->bound);
+}
+
+/*
+ * The best scores settle_scores() has worked out so far, in a min-heap, so
+ * that the worst of them is on top. Once it's full, that's the score to beat,
+ * which is kept in threshold too, so that it can be checked without taking
+ * the lock.
+ */
+struct top_scores {
+	mtx_t lock;
+	size_t count;
+	int32_t heap[EXACT_SCORES];
+	atomic_int_least32_t threshold;
+};
+
+static void top_scores_add(struct top_scores *top, int32_t score)
+{
+	int32_t *heap = top->heap;
+	if (top->count < EXACT_SCORES) {
+		size_t i = top->count++;
+		while (i > 0 && heap[(i - 1) / 2] > score) {
+			heap[i] = heap[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		heap[i] = score;
+	} else if (score > heap[0]) {
+		size_t i = 0;
+		while (true) {
+			size_t child = 2 * i + 1;
+			if (child >= EXACT_SCORES) {
+				break;
+			}
+			if (child + 1 < EXACT_SCORES && heap[child + 1] < heap[child]) {
+				child++;
+			}
+			if (heap[child] >= score) {
+				break;
+			}
+			heap[i] = heap[child];
+			i = child;
+		}
+		heap[i] = score;
+	}
+	if (top->count == EXACT_SCORES) {
+		atomic_store_explicit(&top->threshold, heap[0], memory_order_relaxed);
+	}
+}
+
+struct settle_job {
+	const struct string_ref_vec *vec;
+	const struct match_query *query;
+	size_t chunk_size;
+	struct result_vec *results;
+	struct top_scores top;
+	const atomic_bool *cancel;
+};
+
+static void settle_chunk(void *data, size_t i)
+{
+	struct settle_job *job = data;
+	struct result_vec *results = job->results;
+	size_t start = i * job->chunk_size;
+	size_t end = start + job->chunk_size;
+	if (end > results->count) {
+		end = results->count;
+	}
+	if (job->cancel != NULL && atomic_load(job->cancel)) {
+		return;
+	}
+	atomic_int_least32_t *threshold = &job->top.threshold;
+	for (size_t pos = start; pos < end; pos++) {
+		if (!results->bounded[pos]
+				|| results->score[pos] < atomic_load_explicit(threshold, memory_order_relaxed)) {
+			continue;
+		}
+		const struct scored_string_ref *entry = &job->vec->buf[results->index[pos]];
+		int32_t search_score = match_query_score(job->query, entry->string, &entry->key);
+		int32_t score = result_score(search_score, entry->history_score);
+		results->score[pos] = score;
+		results->bounded[pos] = false;
+		if (score > atomic_load_explicit(threshold, memory_order_relaxed)) {
+			mtx_lock(&job->top.lock);
+			top_scores_add(&job->top, score);
+			mtx_unlock(&job->top.lock);
+		}
+	}
+}
+
+/*
+ * Work out the exact scores of the results that might be among the best
+ * EXACT_SCORES, leaving the rest bounded, so that they never need ranking
+ * again. Results are skipped once there are that many better ones, and the
+ * results with the best bounds are a good guess at which those are, so
+ * they're worked out first, which gives everything else a score to beat from
+ * the start.
+ */
+static void settle_scores(
+		const struct string_ref_vec *restrict vec,
+		const struct match_query *restrict query,
+		const atomic_bool *cancel,
+		struct result_vec *restrict results)
+{
+	struct settle_job job = {
+		.vec = vec,
+		.query = query,
+		.chunk_size = results->count,
+		.results = results,
+		.top = { .threshold = INT32_MIN },
+		.cancel = cancel
+	};
+
+	result_vec_rank(results, EXACT_SCORES);
+	size_t nbest = results->nranked;
+	if (nbest > EXACT_SCORES) {
+		nbest = EXACT_SCORES;
+	}
+	for (size_t i = 0; i < nbest; i++) {
+		uint32_t pos = results->ranked[i];
+		if (results->bounded[pos]) {
+			const struct scored_string_ref *entry = &vec->buf[results->index[pos]];
+			int32_t search_score = match_query_score(query, entry->string, &entry->key);
+			results->score[pos] = result_score(search_score, entry->history_score);
+			results->bounded[pos] = false;
+		}
+		top_scores_add(&job.top, results->score[pos]);
+	}
+	results->nranked = 0;
+	if (nbest < EXACT_SCORES) {
+		/* That was all of them. */
+		return;
+	}
+
+	mtx_init(&job.top.lock, mtx_plain);
+	if (results->count >= FILTER_PARALLEL_THRESHOLD) {
+		job.chunk_size = FILTER_CHUNK_SIZE;
+		size_t nchunks = (results->count + job.chunk_size - 1) / job.chunk_size;
+		pool_run(nchunks, settle_chunk, &job);
+	} else {
+		settle_chunk(&job, 0);
+	}
+	mtx_destroy(&job.top.lock);
+}
+
+static void filter(
 		const struct string_ref_vec *restrict vec,
+		const uint32_t *restrict indices,
+		size_t count,
 		const char *restrict substr,
-		enum matching_algorithm algorithm)
+		enum matching_algorithm algorithm,
+		const atomic_bool *cancel,
+		struct result_vec *restrict results)
 {
+	result_vec_reserve(results, count);
+
+	/* Everything matches nothing, so there's nothing to check. */
 	if (substr[0] == '\0') {
-		return string_ref_vec_copy(vec);
+		for (size_t i = 0; i < count; i++) {
+			uint32_t index = indices == NULL ? i : indices[i];
+			results->index[i] = index;
+			results->score[i] = result_score(0, vec->buf[index].history_score);
+			results->bounded[i] = false;
+		}
+		results->count = count;
+		return;
+	}
+
+	struct match_query query = match_query_create(algorithm, substr);
+	size_t single_count;
+	struct filter_job job = {
+		.vec = vec,
+		.indices = indices,
+		.count = count,
+		.query = &query,
+		.bound = algorithm == MATCHING_ALGORITHM_FUZZY,
+		.chunk_size = count,
+		.results = results,
+		.counts = &single_count,
+		.cancel = cancel
+	};
+	size_t nchunks = 1;
+	/*
+	 * Even with just the one thread, chunking means there's a chance to
+	 * notice being cancelled.
+	 */
+	if (count >= FILTER_PARALLEL_THRESHOLD) {
+		job.chunk_size = FILTER_CHUNK_SIZE;
+		nchunks = (count + job.chunk_size - 1) / job.chunk_size;
+		job.counts = xcalloc(nchunks, sizeof(*job.counts));
+		pool_run(nchunks, filter_chunk, &job);
+	} else {
+		filter_chunk(&job, 0);
+	}
+	result_vec_gather(results, job.counts, nchunks, job.chunk_size);
+	if (job.counts != &single_count) {
+		free(job.counts);
+	}
+	if (job.bound) {
+		settle_scores(vec, &query, cancel, results);
+	}
+	match_query_destroy(&query);
+}
+
+void string_ref_vec_filter(
+		const struct string_ref_vec *restrict vec,
+		const char *restrict substr,
+		enum matching_algorithm algorithm,
+		const atomic_bool *cancel,
+		struct result_vec *restrict results)
+{
+	filter(vec, NULL, vec->count, substr, algorithm, cancel, results);
+}
+
+void string_ref_vec_filter_subset(
+		const struct string_ref_vec *restrict vec,
+		const uint32_t *restrict indices,
+		size_t count,
+		const char *restrict substr,
+		enum matching_algorithm algorithm,
+		const atomic_bool *cancel,
+		struct result_vec *restrict results)
+{
+	filter(vec, indices, count, substr, algorithm, cancel, results);
+}
+
+/*
+ * Results are ranked by their score, highest first, and then by their
+ * position, which packs into a single key with the lowest first.
+ */
+static uint64_t rank_key(const struct result_vec *vec, size_t pos)
+{
+	return (uint64_t)(INT32_MAX - (int64_t)vec->score[pos]) << 32 | pos;
+}
+
+/* Restore the max-heap property of heap below i. */
+static void sift_down(uint64_t *heap, size_t n, size_t i)
+{
+	while (true) {
+		size_t child = 2 * i + 1;
+		if (child >= n) {
+			return;
+		}
+		if (child + 1 < n && heap[child + 1] > heap[child]) {
+			child++;
+		}
+		if (heap[i] >= heap[child]) {
+			return;
+		}
+		uint64_t tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+/* Add the positions in the bottom half of the k keys to the ranked list. */
+static void add_ranked(struct result_vec *restrict vec, const uint64_t *keys, size_t k)
+{
+	if (vec->nranked + k > vec->ranked_size) {
+		vec->ranked_size = vec->nranked + k;
+		if (vec->ranked_size < 2 * vec->nranked) {
+			vec->ranked_size = 2 * vec->nranked;
+		}
+		vec->ranked = xrealloc(vec->ranked, vec->ranked_size * sizeof(*vec->ranked));
+	}
+	for (size_t i = 0; i < k; i++) {
+		vec->ranked[vec->nranked++] = keys[i] & UINT32_MAX;
+	}
+}
+
+void result_vec_rank(struct result_vec *restrict vec, size_t count)
+{
+	if (count <= vec->nranked || vec->nranked == vec->count) {
+		return;
+	}
+	size_t n = vec->count - vec->nranked;
+	size_t k = count - vec->nranked;
+	if (k < RANK_BATCH) {
+		k = RANK_BATCH;
+	}
+
+	/*
+	 * Everything ranked so far has a lower key than anything that hasn't
+	 * been, so the rest are those with keys above the last one ranked.
+	 */
+	uint64_t floor = 0;
+	if (vec->nranked > 0) {
+		floor = rank_key(vec, vec->ranked[vec->nranked - 1]) + 1;
+	}
+
+	if (k >= n / RANK_ALL_FRACTION) {
+		uint64_t *keys = xmalloc(2 * n * sizeof(*keys));
+		size_t nkeys = 0;
+		for (size_t i = 0; i < vec->count; i++) {
+			uint64_t key = rank_key(vec, i);
+			if (key >= floor) {
+				keys[nkeys++] = key;
+			}
+		}
+		radix_sort(keys, &keys[n], n);
+		add_ranked(vec, keys, n);
+		free(keys);
+		return;
+	}
+
+	/*
+	 * Keep a max-heap of the k best keys seen so far, so that each result
+	 * only has to beat the worst of them to get in. It starts out full of
+	 * keys that anything beats, and as there are more than k results left,
+	 * they're all replaced.
+	 */
+	uint64_t *heap = xmalloc(k * sizeof(*heap));
+	for (size_t i = 0; i < k; i++) {
+		heap[i] = UINT64_MAX;
 	}
-	struct string_ref_vec filt = string_ref_vec_create();
 	for (size_t i = 0; i < vec->count; i++) {
-		int32_t search_score;
-		
-		/* Check if this is a file entry with our special format */
-		const char *separator = strstr(vec->buf[i].string, "|||");
-		if (separator) {
-			/* Match only on the basename part (before |||) */
-			size_t basename_len = separator - vec->buf[i].string;
-			char *basename = xmalloc(basename_len + 1);
-			strncpy(basename, vec->buf[i].string, basename_len);
-			basename[basename_len] = '\0';
-			search_score = match_words(algorithm, substr, basename);
-			free(basename);
-		} else {
-			/* Normal matching for apps and regular entries */
-			search_score = match_words(algorithm, substr, vec->buf[i].string);
+		uint64_t key = rank_key(vec, i);
+		if (key >= floor && key < heap[0]) {
+			heap[0] = key;
+			sift_down(heap, k, 0);
+		}
+	}
+
+	/* Heapsort them, so that the keys end up in order. */
+	for (size_t i = k; i-- > 1; ) {
+		uint64_t tmp = heap[0];
+		heap[0] = heap[i];
+		heap[i] = tmp;
+		sift_down(heap, i, 0);
+	}
+	add_ranked(vec, heap, k);
+	free(heap);
+}
+
+void string_ref_vec_rank(
+		const struct string_ref_vec *restrict vec,
+		const struct match_query *restrict query,
+		struct result_vec *restrict results,
+		size_t count)
+{
+	/*
+	 * Rank by what's known, and if any of the newly ranked results only
+	 * had a bound on their score, work out the real thing and try again.
+	 * Real scores are never higher, so those results can only drop back
+	 * among the ones still unranked.
+	 */
+	while (true) {
+		size_t start = results->nranked;
+		result_vec_rank(results, count);
+		bool settled = true;
+		for (size_t i = start; i < results->nranked; i++) {
+			uint32_t pos = results->ranked[i];
+			if (!results->bounded[pos]) {
+				continue;
+			}
+			const struct scored_string_ref *entry = &vec->buf[results->index[pos]];
+			int32_t search_score = match_query_score(query, entry->string, &entry->key);
+			results->score[pos] = result_score(search_score, entry->history_score);
+			results->bounded[pos] = false;
+			settled = false;
 		}
-		
-		if (search_score != INT32_MIN) {
-			string_ref_vec_add(&filt, vec->buf[i].string);
-			filt.buf[filt.count - 1].search_score = search_score;
-			filt.buf[filt.count - 1].history_score = vec->buf[i].history_score;
+		if (settled) {
+			return;
 		}
+		results->nranked = start;
 	}
-	/* Sort the results by their search score. */
-	qsort(filt.buf, filt.count, sizeof(filt.buf[0]), cmpscorep);
-	return filt;
+}
+
+uint32_t result_vec_nth(const struct result_vec *restrict vec, size_t n)
+{
+	return vec->index[vec->ranked[n]];
 }
 
 struct string_ref_vec string_ref_vec_from_buffer(char *buffer)
@@ -226,5 +843,6 @@ struct string_ref_vec string_ref_vec_from_buffer(char *buffer)
 		string_ref_vec_add(&vec, line);
 		line = strtok_r(NULL, "\n", &saveptr);
 	}
+	string_ref_vec_prepare(&vec);
 	return vec;
 }
@@ -1,6 +1,7 @@
 #ifndef STRING_VEC_H
 #define STRING_VEC_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -8,6 +9,19 @@
 #include "history.h"
 #include "matching.h"
 
+/*
+ * Filtering at least this many candidates is split into chunks of
+ * FILTER_CHUNK_SIZE, which are spread across the thread pool. Each chunk is
+ * filtered into its own stretch of the results, which are packed back
+ * together in order afterwards, so the results are exactly the same either
+ * way.
+ *
+ * The filter functions also take a cancel flag, which may be NULL. Once it's
+ * set, any chunks not yet started are skipped, and the results are garbage.
+ */
+#define FILTER_PARALLEL_THRESHOLD 32768
+#define FILTER_CHUNK_SIZE 8192
+
 struct scored_string {
 	char *string;
 	int32_t search_score;
@@ -34,19 +48,28 @@ struct scored_string *string_vec_find_sorted(struct string_vec *restrict vec, co
 
 /*
  * Like a string_vec, but only store a reference to the corresponding string
- * rather than copying it. Although compatible with the string_vec struct, we
- * create a new struct to make the compiler complain if we mix them up.
+ * rather than copying it, along with its key for matching. Although it starts
+ * the same as the string_vec struct, we create a new struct to make the
+ * compiler complain if we mix them up.
  */
 struct scored_string_ref {
 	char *string;
 	int32_t search_score;
 	int32_t history_score;
+	struct match_key key;
 };
 
 struct string_ref_vec {
 	size_t count;
 	size_t size;
 	struct scored_string_ref *buf;
+
+	/*
+	 * Casefolded copies of any strings that aren't plain ASCII, which
+	 * the keys point into. Only the vector that worked them out owns
+	 * them, not copies or filtered results.
+	 */
+	char *folded;
 };
 
 /*
@@ -59,22 +82,120 @@ struct string_ref_vec string_ref_vec_create(void);
 
 void string_ref_vec_destroy(struct string_ref_vec *restrict vec);
 
-[[nodiscard("memory leaked")]]
-struct string_ref_vec string_ref_vec_copy(const struct string_ref_vec *restrict vec);
-
 void string_ref_vec_add(struct string_ref_vec *restrict vec, char *restrict str);
 
+/*
+ * Work out each string's match key, which is needed before the vector can be
+ * filtered. Strings in our special file format ("basename|||path") are only
+ * matched on the basename.
+ */
+void string_ref_vec_prepare(struct string_ref_vec *restrict vec);
+
 void string_ref_vec_history_sort(struct string_ref_vec *restrict vec, struct history *history);
 
 void string_vec_uniq(struct string_vec *restrict vec);
 
 struct scored_string_ref *string_ref_vec_find_sorted(struct string_ref_vec *restrict vec, const char *str);
 
+/*
+ * Filtered results, which just refer to the matching entries by their index
+ * in the vector that was filtered, in ascending order. Ranking only needs
+ * each result's score, so the scores are kept in an array of their own,
+ * rather than alongside everything else about the entry.
+ *
+ * Results are only put in order as they're needed, so rather than moving
+ * them around, their positions are listed in ranked, best first. Ties are
+ * broken by index, so the order is the same however the results were found.
+ *
+ * Working out fuzzy scores is slow, so where filtering can tell that a result
+ * won't be among the first to be ranked, its score is just an upper bound,
+ * and bounded is set, until string_ref_vec_rank() gets to it. Which results
+ * those are depends on how the filtering was split up between threads, but
+ * the order they end up in doesn't.
+ */
+struct result_vec {
+	size_t count;
+	size_t size;
+	uint32_t *index;
+	int32_t *score;
+	bool *bounded;
+
+	size_t nranked;
+	size_t ranked_size;
+	uint32_t *ranked;
+};
+
 [[nodiscard("memory leaked")]]
-struct string_ref_vec string_ref_vec_filter(
+struct result_vec result_vec_create(void);
+
+void result_vec_destroy(struct result_vec *restrict vec);
+
+/* Memory used by the results, for keeping track of how much is kept around. */
+size_t result_vec_bytes(const struct result_vec *restrict vec);
+
+/*
+ * Make room for count results, throwing away any there already are, for
+ * filtering into.
+ */
+void result_vec_reserve(struct result_vec *restrict vec, size_t count);
+
+/*
+ * Pack together results that were filtered in nchunks chunks, each of which
+ * put its counts[i] results at i * chunk_size.
+ */
+void result_vec_gather(struct result_vec *restrict vec, const size_t *counts, size_t nchunks, size_t chunk_size);
+
+/* Work out the score a result is ranked by, highest first. */
+int32_t result_score(int64_t search_score, int64_t history_score);
+
+/*
+ * Put at least the first count results in order, best first, which must all
+ * have exact scores.
+ */
+void result_vec_rank(struct result_vec *restrict vec, size_t count);
+
+/* Return the index of the nth best result, which must have been ranked. */
+uint32_t result_vec_nth(const struct result_vec *restrict vec, size_t n);
+
+/*
+ * Put the entries of vec that match substr in results, overwriting whatever
+ * was there, but reusing its memory if there's enough. Only the order of the
+ * results that have been ranked with string_ref_vec_rank() is settled, as
+ * there's rarely any need to sort every last match, and sorting a huge list
+ * on every keypress is slow. For the same reason, fuzzy scores are only worked
+ * out in full for results that might be among the first to be ranked.
+ */
+void string_ref_vec_filter(
+		const struct string_ref_vec *restrict vec,
+		const char *restrict substr,
+		enum matching_algorithm algorithm,
+		const atomic_bool *cancel,
+		struct result_vec *restrict results);
+
+/*
+ * As string_ref_vec_filter(), but only check the count entries of vec at the
+ * given indices, which must be in ascending order.
+ */
+void string_ref_vec_filter_subset(
 		const struct string_ref_vec *restrict vec,
+		const uint32_t *restrict indices,
+		size_t count,
 		const char *restrict substr,
-		enum matching_algorithm algorithm);
+		enum matching_algorithm algorithm,
+		const atomic_bool *cancel,
+		struct result_vec *restrict results);
+
+/*
+ * As result_vec_rank(), for results filtered from vec with query, working out
+ * the exact score of any that were only bounded once they might be among the
+ * first count. Results from anywhere else never are, so vec and query aren't
+ * used for them.
+ */
+void string_ref_vec_rank(
+		const struct string_ref_vec *restrict vec,
+		const struct match_query *restrict query,
+		struct result_vec *restrict results,
+		size_t count);
 
 [[nodiscard("memory leaked")]]
 struct string_ref_vec string_ref_vec_from_buffer(char *buffer);
@@ -0,0 +1,147 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include "traverse.h"
+
+bool traverse_open(struct traverse_dir *dir, int dirfd, const char *name, bool nofollow)
+{
+	int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+	if (nofollow) {
+		flags |= O_NOFOLLOW;
+	}
+	int fd = openat(dirfd, name, flags);
+	if (fd == -1) {
+		return false;
+	}
+	traverse_open_fd(dir, fd);
+	return true;
+}
+
+void traverse_open_fd(struct traverse_dir *dir, int fd)
+{
+	dir->fd = fd;
+	dir->pos = 0;
+	dir->len = 0;
+}
+
+void traverse_close(struct traverse_dir *dir)
+{
+	if (dir->fd != -1) {
+		close(dir->fd);
+		dir->fd = -1;
+	}
+}
+
+const struct traverse_entry *traverse_next(struct traverse_dir *dir)
+{
+	while (true) {
+		if (dir->pos >= dir->len) {
+			/*
+			 * We call getdents64 directly, as not all libcs
+			 * provide a wrapper.
+			 */
+			long res = syscall(SYS_getdents64, dir->fd, dir->buf, sizeof(dir->buf));
+			if (res <= 0) {
+				return NULL;
+			}
+			dir->len = res;
+			dir->pos = 0;
+		}
+		const struct traverse_entry *entry =
+			(const struct traverse_entry *)&dir->buf[dir->pos];
+		dir->pos += entry->d_reclen;
+
+		const char *name = entry->d_name;
+		if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+			continue;
+		}
+		return entry;
+	}
+}
+
+enum traverse_kind traverse_kind(const struct traverse_dir *dir, const struct traverse_entry *entry)
+{
+	switch (entry->d_type) {
+		case DT_REG:
+			return TRAVERSE_FILE;
+		case DT_DIR:
+			return TRAVERSE_DIR;
+		case DT_LNK:
+		case DT_UNKNOWN:
+			break;
+		default:
+			return TRAVERSE_OTHER;
+	}
+
+	/*
+	 * Some filesystems don't fill in d_type, and symlinks need following,
+	 * so we have to ask. Only the file type is needed, which lets
+	 * network and FUSE filesystems skip fetching everything else.
+	 */
+	struct statx stx;
+	bool link = entry->d_type == DT_LNK;
+	if (!link) {
+		if (statx(dir->fd, entry->d_name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx) == -1) {
+			return TRAVERSE_OTHER;
+		}
+		link = S_ISLNK(stx.stx_mode);
+	}
+	if (link && statx(dir->fd, entry->d_name, 0, STATX_TYPE, &stx) == -1) {
+		return TRAVERSE_OTHER;
+	}
+
+	if (S_ISREG(stx.stx_mode)) {
+		return TRAVERSE_FILE;
+	} else if (S_ISDIR(stx.stx_mode)) {
+		return link ? TRAVERSE_LINK_DIR : TRAVERSE_DIR;
+	}
+	return TRAVERSE_OTHER;
+}
+
+bool traverse_is_executable(const struct traverse_dir *dir, const struct traverse_entry *entry)
+{
+	switch (entry->d_type) {
+		case DT_REG:
+		case DT_LNK:
+		case DT_UNKNOWN:
+			break;
+		default:
+			return false;
+	}
+
+	struct statx stx;
+	if (statx(dir->fd, entry->d_name, 0, STATX_TYPE | STATX_MODE, &stx) == -1) {
+		return false;
+	}
+	if (!S_ISREG(stx.stx_mode)) {
+		return false;
+	}
+
+	/*
+	 * Without any execute bits there's no need to ask, but even with all
+	 * of them set, the kernel has the final say, as the file may be on a
+	 * noexec mount or denied by an ACL.
+	 */
+	if ((stx.stx_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) == 0) {
+		return false;
+	}
+	return faccessat(dir->fd, entry->d_name, X_OK, 0) == 0;
+}
+
+bool traverse_stat(int dirfd, const char *name, struct traverse_stat *st)
+{
+	struct statx stx;
+	int flags = name[0] == '\0' ? AT_EMPTY_PATH : 0;
+	if (statx(dirfd, name, flags, STATX_INO | STATX_MTIME, &stx) == -1) {
+		return false;
+	}
+	st->id.dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	st->id.ino = stx.stx_ino;
+	st->mtime_sec = stx.stx_mtime.tv_sec;
+	st->mtime_nsec = stx.stx_mtime.tv_nsec;
+	return true;
+}
@@ -0,0 +1,84 @@
+#ifndef TRAVERSE_H
+#define TRAVERSE_H
+
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Thin layer over getdents64(), for reading large numbers of directories
+ * with as few system calls as possible. Everything works relative to open
+ * directory file descriptors, and the type of each entry is taken from
+ * d_type whenever the filesystem provides it, so most entries cost no system
+ * calls at all.
+ */
+
+/* Big enough for a few hundred entries per getdents64() call. */
+#define TRAVERSE_BUFFER_SIZE 16384
+
+/* Matches the kernel's struct linux_dirent64. */
+struct traverse_entry {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct traverse_dir {
+	int fd;
+	size_t pos;
+	size_t len;
+	alignas(8) char buf[TRAVERSE_BUFFER_SIZE];
+};
+
+enum traverse_kind {
+	TRAVERSE_OTHER,
+	TRAVERSE_FILE,
+	TRAVERSE_DIR,
+	TRAVERSE_LINK_DIR
+};
+
+/* Identifies a directory, regardless of the path used to reach it. */
+struct traverse_id {
+	dev_t dev;
+	ino_t ino;
+};
+
+struct traverse_stat {
+	struct traverse_id id;
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+};
+
+/*
+ * Open name (relative to dirfd, or absolute) for reading. If nofollow is
+ * true, fail if name is a symlink.
+ */
+bool traverse_open(struct traverse_dir *dir, int dirfd, const char *name, bool nofollow);
+
+/* Start reading from an already open directory, taking ownership of fd. */
+void traverse_open_fd(struct traverse_dir *dir, int fd);
+
+void traverse_close(struct traverse_dir *dir);
+
+/* Return the next entry, skipping "." and "..", or NULL when done. */
+const struct traverse_entry *traverse_next(struct traverse_dir *dir);
+
+/*
+ * Determine what an entry is, following symlinks. Only performs a stat if
+ * d_type is DT_LNK or DT_UNKNOWN.
+ */
+enum traverse_kind traverse_kind(const struct traverse_dir *dir, const struct traverse_entry *entry);
+
+/* Whether an entry is a regular file we're allowed to execute. */
+bool traverse_is_executable(const struct traverse_dir *dir, const struct traverse_entry *entry);
+
+/*
+ * Get the identity and modification time of name, relative to dirfd and
+ * following symlinks. If name is "", fd itself is used.
+ */
+bool traverse_stat(int dirfd, const char *name, struct traverse_stat *st);
+
+#endif /* TRAVERSE_H */
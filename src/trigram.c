@@ -0,0 +1,353 @@
+#include <stdlib.h>
+#include <string.h>
+#include "trigram.h"
+#include "xmalloc.h"
+
+/*
+ * Decoding an ID is far cheaper than matching a name, but once there are only
+ * a few candidates left, it's quicker to just check them than to work through
+ * a much longer list to rule a few more out.
+ */
+#define MAX_DECODE_RATIO 64
+
+static uint32_t lower(unsigned char c)
+{
+	if (c >= 'A' && c <= 'Z') {
+		return c + ('a' - 'A');
+	}
+	return c;
+}
+
+static uint32_t make_trigram(const char *s)
+{
+	return lower(s[0]) << 16 | lower(s[1]) << 8 | lower(s[2]);
+}
+
+static bool is_ascii(const char *s, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		if ((unsigned char)s[i] >= 0x80) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static size_t hash(uint32_t trigram, size_t size)
+{
+	uint32_t h = trigram;
+	h ^= h >> 16;
+	h *= 0x7feb352d;
+	h ^= h >> 15;
+	h *= 0x846ca68b;
+	h ^= h >> 16;
+	return h & (size - 1);
+}
+
+void trigram_builder_init(struct trigram_builder *builder)
+{
+	builder->count = 0;
+	builder->size = 4096;
+	builder->lists = xcalloc(builder->size, sizeof(*builder->lists));
+	builder->postings_size = 0;
+}
+
+void trigram_builder_destroy(struct trigram_builder *builder)
+{
+	for (size_t i = 0; i < builder->size; i++) {
+		free(builder->lists[i].buf);
+	}
+	free(builder->lists);
+	builder->lists = NULL;
+	builder->count = 0;
+	builder->size = 0;
+	builder->postings_size = 0;
+}
+
+/* Empty slots are those with no IDs. */
+static struct trigram_list *find_list(struct trigram_builder *builder, uint32_t trigram)
+{
+	size_t i = hash(trigram, builder->size);
+	while (builder->lists[i].count > 0 && builder->lists[i].trigram != trigram) {
+		i = (i + 1) & (builder->size - 1);
+	}
+	return &builder->lists[i];
+}
+
+static void grow(struct trigram_builder *builder)
+{
+	struct trigram_list *old = builder->lists;
+	size_t old_size = builder->size;
+	builder->size *= 2;
+	builder->lists = xcalloc(builder->size, sizeof(*builder->lists));
+	for (size_t i = 0; i < old_size; i++) {
+		if (old[i].count > 0) {
+			*find_list(builder, old[i].trigram) = old[i];
+		}
+	}
+	free(old);
+}
+
+static void add_id(struct trigram_builder *builder, uint32_t trigram, uint32_t id)
+{
+	struct trigram_list *list = find_list(builder, trigram);
+	if (list->count == 0) {
+		if (2 * (builder->count + 1) > builder->size) {
+			grow(builder);
+			list = find_list(builder, trigram);
+		}
+		list->trigram = trigram;
+		builder->count++;
+	} else if (list->last == id) {
+		/* The same trigram turning up twice in a name. */
+		return;
+	}
+
+	if (list->len + 5 > list->size) {
+		list->size = list->size ? 2 * list->size : 8;
+		list->buf = xrealloc(list->buf, list->size);
+	}
+	uint32_t gap = list->count == 0 ? id : id - list->last;
+	size_t start = list->len;
+	while (gap >= 0x80) {
+		list->buf[list->len++] = (gap & 0x7f) | 0x80;
+		gap >>= 7;
+	}
+	list->buf[list->len++] = gap;
+	builder->postings_size += list->len - start;
+	list->count++;
+	list->last = id;
+}
+
+void trigram_builder_add(struct trigram_builder *builder, uint32_t id, const char *name, size_t len)
+{
+	if (!is_ascii(name, len)) {
+		add_id(builder, TRIGRAM_OTHER, id);
+		return;
+	}
+	for (size_t i = 0; i + 3 <= len; i++) {
+		add_id(builder, make_trigram(&name[i]), id);
+	}
+}
+
+static int cmp_trigram(const void *restrict a, const void *restrict b)
+{
+	uint32_t ta = ((const struct trigram_list *)a)->trigram;
+	uint32_t tb = ((const struct trigram_list *)b)->trigram;
+	return (ta > tb) - (ta < tb);
+}
+
+void trigram_builder_write(
+		struct trigram_builder *builder,
+		struct trigram_entry *table,
+		uint8_t *postings)
+{
+	/* Pack the lists to the front of the hash table and sort them. */
+	size_t count = 0;
+	for (size_t i = 0; i < builder->size; i++) {
+		if (builder->lists[i].count > 0) {
+			builder->lists[count++] = builder->lists[i];
+		}
+	}
+	memset(&builder->lists[count], 0, (builder->size - count) * sizeof(*builder->lists));
+	qsort(builder->lists, count, sizeof(*builder->lists), cmp_trigram);
+
+	size_t offset = 0;
+	for (size_t i = 0; i < count; i++) {
+		const struct trigram_list *list = &builder->lists[i];
+		table[i] = (struct trigram_entry){
+			.trigram = list->trigram,
+			.count = list->count,
+			.offset = offset
+		};
+		memcpy(&postings[offset], list->buf, list->len);
+		offset += list->len;
+	}
+	trigram_builder_destroy(builder);
+}
+
+struct cursor {
+	const uint8_t *p;
+	const uint8_t *end;
+	uint32_t left;
+	uint32_t id;
+	bool first;
+};
+
+static struct cursor cursor_create(const struct trigram_index *index, const struct trigram_entry *entry)
+{
+	return (struct cursor){
+		.p = &index->postings[entry->offset],
+		.end = &index->postings[index->postings_size],
+		.left = entry->count,
+		.first = true
+	};
+}
+
+/*
+ * Decode the next ID of a list, returning false at the end, or if anything
+ * about it is off.
+ */
+static bool cursor_next(const struct trigram_index *index, struct cursor *cursor, uint32_t *id)
+{
+	if (cursor->left == 0) {
+		return false;
+	}
+	uint64_t gap = 0;
+	for (unsigned int shift = 0; ; shift += 7) {
+		if (cursor->p == cursor->end || shift > 28) {
+			cursor->left = 0;
+			return false;
+		}
+		uint8_t byte = *cursor->p++;
+		gap |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			break;
+		}
+	}
+	uint64_t next = cursor->first ? gap : cursor->id + gap;
+	if ((!cursor->first && gap == 0) || next >= index->limit) {
+		cursor->left = 0;
+		return false;
+	}
+	cursor->id = next;
+	cursor->first = false;
+	cursor->left--;
+	*id = next;
+	return true;
+}
+
+static int cmp_entry(const void *restrict key, const void *restrict entry)
+{
+	uint32_t a = *(const uint32_t *)key;
+	uint32_t b = ((const struct trigram_entry *)entry)->trigram;
+	return (a > b) - (a < b);
+}
+
+static const struct trigram_entry *lookup(const struct trigram_index *index, uint32_t trigram)
+{
+	return bsearch(&trigram, index->table, index->count, sizeof(*index->table), cmp_entry);
+}
+
+static int cmp_count(const void *restrict a, const void *restrict b)
+{
+	uint32_t ca = (*(const struct trigram_entry *const *)a)->count;
+	uint32_t cb = (*(const struct trigram_entry *const *)b)->count;
+	return (ca > cb) - (ca < cb);
+}
+
+/* Keep only the IDs that are also in entry's list. */
+static size_t intersect(
+		const struct trigram_index *index,
+		uint32_t *ids,
+		size_t count,
+		const struct trigram_entry *entry)
+{
+	struct cursor cursor = cursor_create(index, entry);
+	size_t n = 0;
+	uint32_t id;
+	bool more = cursor_next(index, &cursor, &id);
+	for (size_t i = 0; i < count && more; i++) {
+		while (more && id < ids[i]) {
+			more = cursor_next(index, &cursor, &id);
+		}
+		if (more && id == ids[i]) {
+			ids[n++] = ids[i];
+		}
+	}
+	return n;
+}
+
+/* Merge in the IDs from entry's list, returning the new array. */
+static uint32_t *merge(
+		const struct trigram_index *index,
+		uint32_t *ids,
+		size_t *count,
+		const struct trigram_entry *entry)
+{
+	uint32_t *merged = xmalloc((*count + entry->count) * sizeof(*merged));
+	struct cursor cursor = cursor_create(index, entry);
+	size_t n = 0;
+	size_t i = 0;
+	uint32_t id;
+	bool more = cursor_next(index, &cursor, &id);
+	while (i < *count || more) {
+		if (!more || (i < *count && ids[i] < id)) {
+			merged[n++] = ids[i++];
+		} else {
+			if (i < *count && ids[i] == id) {
+				i++;
+			}
+			merged[n++] = id;
+			more = cursor_next(index, &cursor, &id);
+		}
+	}
+	free(ids);
+	*count = n;
+	return merged;
+}
+
+bool trigram_search(
+		const struct trigram_index *index,
+		const char *query,
+		uint32_t **ids,
+		size_t *count)
+{
+	/* Look up the list for each distinct trigram in each word. */
+	size_t len = strlen(query);
+	const struct trigram_entry **lists = xmalloc((len + 1) * sizeof(*lists));
+	size_t nlists = 0;
+	bool found = false;
+	bool missing = false;
+	for (size_t i = 0; i + 3 <= len; i++) {
+		if (!is_ascii(&query[i], 3) || memchr(&query[i], ' ', 3) != NULL) {
+			continue;
+		}
+		found = true;
+		const struct trigram_entry *entry = lookup(index, make_trigram(&query[i]));
+		if (entry == NULL) {
+			missing = true;
+			break;
+		}
+		bool dup = false;
+		for (size_t j = 0; j < nlists; j++) {
+			dup = dup || lists[j] == entry;
+		}
+		if (!dup) {
+			lists[nlists++] = entry;
+		}
+	}
+	if (!found) {
+		free(lists);
+		return false;
+	}
+
+	/* Intersect the lists, shortest first. */
+	uint32_t *res = NULL;
+	size_t n = 0;
+	if (!missing) {
+		qsort(lists, nlists, sizeof(*lists), cmp_count);
+		res = xmalloc(lists[0]->count * sizeof(*res));
+		struct cursor cursor = cursor_create(index, lists[0]);
+		while (cursor_next(index, &cursor, &res[n])) {
+			n++;
+		}
+		for (size_t i = 1; i < nlists && n > 0; i++) {
+			if (lists[i]->count / MAX_DECODE_RATIO > n) {
+				break;
+			}
+			n = intersect(index, res, n, lists[i]);
+		}
+	}
+	free(lists);
+
+	/* Anything that couldn't be indexed could still match. */
+	const struct trigram_entry *other = lookup(index, TRIGRAM_OTHER);
+	if (other != NULL) {
+		res = merge(index, res, &n, other);
+	}
+
+	*ids = res;
+	*count = n;
+	return true;
+}
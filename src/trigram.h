@@ -0,0 +1,95 @@
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Trigram posting lists, used to find the few names that could possibly
+ * contain a search term without looking at every one of them.
+ *
+ * Each three byte sequence found in a name (lowercased) maps to the sorted
+ * list of IDs of the names containing it, stored as varint-encoded gaps
+ * between successive IDs. A term of three or more bytes can then only be in
+ * the names that appear in the lists of all of its trigrams.
+ *
+ * Unicode case folding and normalisation can make a name match a term that
+ * shares none of its bytes, so names containing anything other than ASCII
+ * aren't split into trigrams, but are listed under TRIGRAM_OTHER, and always
+ * have to be checked.
+ */
+
+/* Key of the list of names that couldn't be indexed. */
+#define TRIGRAM_OTHER 0
+
+/* An entry in the on-disk table of lists, which is sorted by trigram. */
+struct trigram_entry {
+	uint32_t trigram;
+
+	/* Number of IDs in the list. */
+	uint32_t count;
+
+	/* Offset of the list from the start of the postings. */
+	uint64_t offset;
+};
+
+struct trigram_list {
+	uint32_t trigram;
+	uint32_t count;
+	uint32_t last;
+	size_t len;
+	size_t size;
+	uint8_t *buf;
+};
+
+/* Hash table of the lists being built, keyed by trigram. */
+struct trigram_builder {
+	size_t count;
+	size_t size;
+	struct trigram_list *lists;
+	size_t postings_size;
+};
+
+/* A table and postings laid out by trigram_builder_write(). */
+struct trigram_index {
+	size_t count;
+	const struct trigram_entry *table;
+	size_t postings_size;
+	const uint8_t *postings;
+
+	/* IDs at or above this are ignored, in case the index is corrupt. */
+	uint32_t limit;
+};
+
+void trigram_builder_init(struct trigram_builder *builder);
+void trigram_builder_destroy(struct trigram_builder *builder);
+
+/*
+ * Add the first len bytes of name under id, which must be larger than that of
+ * any name added before.
+ */
+void trigram_builder_add(struct trigram_builder *builder, uint32_t id, const char *name, size_t len);
+
+/*
+ * Write builder->count table entries to table and builder->postings_size
+ * bytes of lists to postings. The builder is left empty.
+ */
+void trigram_builder_write(
+		struct trigram_builder *builder,
+		struct trigram_entry *table,
+		uint8_t *postings);
+
+/*
+ * Find the names that could contain every space-separated word of query,
+ * ignoring case. Returns false if query doesn't have any trigrams to look
+ * up, in which case every name needs checking. Otherwise, *ids is set to an
+ * allocated, sorted array of the *count candidates' IDs.
+ */
+bool trigram_search(
+		const struct trigram_index *index,
+		const char *query,
+		uint32_t **ids,
+		size_t *count);
+
+#endif /* TRIGRAM_H */
@@ -101,6 +101,11 @@ size_t utf8_strlen(const char *s)
 	return g_utf8_strlen(s, -1);
 }
 
+size_t utf8_strnlen(const char *s, size_t len)
+{
+	return g_utf8_strlen(s, len);
+}
+
 char *utf8_strcasestr(const char * restrict haystack, const char * restrict needle)
 {
 	char *h = g_utf8_casefold(haystack, -1);
@@ -121,6 +126,11 @@ char *utf8_strcasestr(const char * restrict haystack, const char * restrict need
 	return ret;
 }
 
+char *utf8_casefold(const char *s, ssize_t len)
+{
+	return g_utf8_casefold(s, len);
+}
+
 char *utf8_normalize(const char *s)
 {
 	return g_utf8_normalize(s, -1, G_NORMALIZE_DEFAULT);
@@ -4,6 +4,7 @@
 #include <glib.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 uint8_t utf32_to_utf8(uint32_t c, char *buf);
 uint32_t utf8_to_utf32(const char *s);
@@ -24,7 +25,9 @@ char *utf8_prev_char(const char *s);
 char *utf8_strchr(const char *s, uint32_t c);
 char *utf8_strcasechr(const char *s, uint32_t c);
 size_t utf8_strlen(const char *s);
+size_t utf8_strnlen(const char *s, size_t len);
 char *utf8_strcasestr(const char * restrict haystack, const char * restrict needle);
+char *utf8_casefold(const char *s, ssize_t len);
 char *utf8_normalize(const char *s);
 char *utf8_compose(const char *s);
 bool utf8_validate(const char *s);
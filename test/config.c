@@ -49,6 +49,7 @@ int main(int argc, char *argv[])
 	is_valid("matching-algorithm", "normal", "Normal matching");
 	is_valid("matching-algorithm", "fuzzy", "Fuzzy matching");
 	is_valid("matching-algorithm", "prefix", "Prefix matching");
+	is_valid("matching-algorithm", "approx", "Approximate matching");
 	isnt_valid("matching-algorithm", "regex", "Regex matching");
 
 	/* Bools */
@@ -0,0 +1,383 @@
+#include <locale.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "file_index.h"
+#include "string_vec.h"
+#include "tap.h"
+#include "xmalloc.h"
+
+static const char *const names[] = {
+	"readme.md",
+	"README",
+	"read",
+	"Makefile",
+	"makefile.am",
+	"main.c",
+	"main.h",
+	"domain.c",
+	"abc",
+	"xabcx",
+	"file 1.txt",
+	"file 2.txt",
+	"profile",
+	"Ärger.txt",
+	"ärgerlich",
+	"straße.pdf",
+	"STRASSE.pdf",
+	"naïve.md",
+	"Café menu.txt",
+	"résumé final.doc",
+	"東京.jpg",
+	"über.txt",
+	"uber.txt"
+};
+
+static const char *const queries[] = {
+	"read",
+	"READ",
+	"rea",
+	"me",
+	"main.c",
+	"ain",
+	"abc",
+	"file",
+	"file 1",
+	"1 file",
+	"txt file",
+	"ile fi",
+	"ärg",
+	"ÄRGER",
+	"arg",
+	"strasse",
+	"straße",
+	"café",
+	"cafe",
+	"menu café",
+	"résumé final",
+	"final res",
+	"東京",
+	"über",
+	"ber",
+	"xyz",
+	"",
+	"a"
+};
+
+/*
+ * Build an index of the names above, followed by count generated ones, so
+ * that some of the trigram lists are long.
+ */
+void build(struct file_index *index, size_t count, bool trigrams)
+{
+	struct file_index_builder builder;
+	file_index_builder_init(&builder);
+	file_index_builder_set_trigrams(&builder, trigrams);
+	file_index_builder_end_apps(&builder);
+	struct file_index_dir dir = { .parent = FILE_INDEX_NO_PARENT };
+	file_index_builder_add_dir(&builder, "/base", &dir);
+	file_index_builder_set_options(&builder, UINT32_MAX, UINT32_MAX, NULL, 0);
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		file_index_builder_add_file(&builder, "/base", names[i]);
+	}
+	const char *parts[] = { "read", "me", "file", "main", "abc", "ain", "txt", ".c", "é", "x" };
+	const size_t nparts = sizeof(parts) / sizeof(parts[0]);
+	uint32_t seed = 1;
+	for (size_t i = 0; i < count; i++) {
+		char name[64] = "";
+		for (size_t j = 0; j < 3; j++) {
+			seed = seed * 1103515245 + 12345;
+			strcat(name, parts[(seed >> 16) % nparts]);
+		}
+		file_index_builder_add_file(&builder, "/base", name);
+	}
+	if (!file_index_build(index, &builder)) {
+		tap_not_ok("Index of %zu extra names built", count);
+	}
+}
+
+/* Copy the first character of str, which may be more than one byte. */
+void first_char(const char *str, char buf[5])
+{
+	size_t len = 1;
+	unsigned char c = str[0];
+	if (c >= 0xf0) {
+		len = 4;
+	} else if (c >= 0xe0) {
+		len = 3;
+	} else if (c >= 0xc0) {
+		len = 2;
+	} else if (c == '\0') {
+		len = 0;
+	}
+	memcpy(buf, str, len);
+	buf[len] = '\0';
+}
+
+bool same_results(const struct result_vec *a, const struct result_vec *b)
+{
+	if (a->count != b->count) {
+		return false;
+	}
+	for (size_t i = 0; i < a->count; i++) {
+		if (a->index[i] != b->index[i] || a->score[i] != b->score[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Check that narrowing the search down with the trigram index finds the same
+ * results as checking every name, for each query and algorithm, both from
+ * scratch and starting from the results for the query's first character.
+ */
+void is_same_as_unindexed(const struct file_index *index, const char *message)
+{
+	struct string_ref_vec commands = file_index_commands(index);
+	const enum matching_algorithm algorithms[] = {
+		MATCHING_ALGORITHM_NORMAL,
+		MATCHING_ALGORITHM_PREFIX,
+		MATCHING_ALGORITHM_FUZZY,
+		MATCHING_ALGORITHM_APPROX
+	};
+	bool same = true;
+	for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); i++) {
+		for (size_t j = 0; j < sizeof(algorithms) / sizeof(algorithms[0]); j++) {
+			const char *query = queries[i];
+			enum matching_algorithm algorithm = algorithms[j];
+			struct result_vec indexed = result_vec_create();
+			struct result_vec unindexed = result_vec_create();
+			file_index_filter(index, &commands, NULL, 0, query, algorithm, NULL, &indexed);
+			string_ref_vec_filter(&commands, query, algorithm, NULL, &unindexed);
+			if (!same_results(&indexed, &unindexed)) {
+				tap_not_ok("%s, \"%s\", algorithm %d", message, query, algorithm);
+				same = false;
+			}
+
+			char first[5];
+			first_char(query, first);
+			struct result_vec base = result_vec_create();
+			string_ref_vec_filter(&commands, first, algorithm, NULL, &base);
+			file_index_filter(index, &commands, base.index, base.count, query, algorithm, NULL, &indexed);
+			string_ref_vec_filter_subset(&commands, base.index, base.count, query, algorithm, NULL, &unindexed);
+			if (!same_results(&indexed, &unindexed)) {
+				tap_not_ok("%s, \"%s\" from \"%s\", algorithm %d", message, query, first, algorithm);
+				same = false;
+			}
+
+			result_vec_destroy(&base);
+			result_vec_destroy(&indexed);
+			result_vec_destroy(&unindexed);
+		}
+	}
+	if (same) {
+		tap_ok("%s", message);
+	}
+	string_ref_vec_destroy(&commands);
+}
+
+/* Write size bytes of data to path, and check whether it maps. */
+void is_mapped(const char *path, const char *data, size_t size, bool expected, const char *message)
+{
+	FILE *fp = fopen(path, "wb");
+	fwrite(data, 1, size, fp);
+	fclose(fp);
+	struct file_index index = { 0 };
+	bool res = file_index_map(&index, path);
+	file_index_destroy(&index);
+	tap_is(res, expected, message);
+}
+
+/* Copy an index's data, for corrupting. */
+char *copy(const struct file_index *index)
+{
+	char *data = xmalloc(index->size);
+	memcpy(data, index->data, index->size);
+	return data;
+}
+
+void isnt_mapped(const char *path, char *data, size_t size, const char *message)
+{
+	is_mapped(path, data, size, false, message);
+	free(data);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "");
+
+	tap_version(14);
+
+	struct file_index index;
+
+	/* Searching with and without the trigram index. */
+	build(&index, 0, true);
+	tap_isnt(index.trigrams.count, 0, "Trigram index built");
+	is_same_as_unindexed(&index, "Same results with a small trigram index");
+	file_index_destroy(&index);
+
+	build(&index, 5000, true);
+	is_same_as_unindexed(&index, "Same results with long trigram lists");
+	file_index_destroy(&index);
+
+	build(&index, 100, false);
+	tap_is(index.trigrams.count, 0, "No trigram index built");
+	is_same_as_unindexed(&index, "Same results without a trigram index");
+	file_index_destroy(&index);
+
+	/* Checks on the header and each section when mapping an index. */
+	char path[] = "/tmp/sofi-test-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1) {
+		tap_not_ok("Couldn't create a temporary file");
+		tap_plan();
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	build(&index, 0, true);
+	const size_t size = index.size;
+	const struct file_index_header *h = index.header;
+	tap_is(file_index_write(&index, path), true, "Index written");
+	struct file_index mapped = { 0 };
+	tap_is(file_index_map(&mapped, path), true, "Index mapped");
+	tap_is(mapped.header->count, index.header->count, "Mapped index has every record");
+	file_index_destroy(&mapped);
+
+	char *data;
+	struct file_index_header *header;
+	struct file_index_record *records;
+	struct file_index_dir *dirs;
+	struct trigram_entry *trigrams;
+
+	is_mapped(path, index.data, 0, false, "Empty file");
+	is_mapped(path, index.data, sizeof(*h) - 1, false, "Truncated header");
+	is_mapped(path, index.data, size - 1, false, "Truncated postings");
+	is_mapped(path, index.data, h->postings_offset, false, "Postings missing");
+	is_mapped(path, index.data, h->records_offset + 8, false, "Records missing");
+
+	data = copy(&index);
+	header = (struct file_index_header *)data;
+	header->magic[0] = 'X';
+	isnt_mapped(path, data, size, "Wrong magic");
+
+	data = copy(&index);
+	header = (struct file_index_header *)data;
+	header->version++;
+	isnt_mapped(path, data, size, "Wrong version");
+
+	data = copy(&index);
+	header = (struct file_index_header *)data;
+	header->records_offset++;
+	isnt_mapped(path, data, size, "Misaligned records");
+
+	data = copy(&index);
+	header = (struct file_index_header *)data;
+	header->total = UINT32_MAX;
+	isnt_mapped(path, data, size, "Too many records");
+
+	data = copy(&index);
+	header = (struct file_index_header *)data;
+	header->count = header->total + 1;
+	isnt_mapped(path, data, size, "More records listed than there are");
+
+	data = copy(&index);
+	header = (struct file_index_header *)data;
+	header->app_count = header->count + 1;
+	isnt_mapped(path, data, size, "More apps than records");
+
+	data = copy(&index);
+	header = (struct file_index_header *)data;
+	header->dirs_offset = size + 8;
+	isnt_mapped(path, data, size, "Directories past the end");
+
+	data = copy(&index);
+	header = (struct file_index_header *)data;
+	header->dir_count = UINT32_MAX;
+	isnt_mapped(path, data, size, "Too many directories");
+
+	data = copy(&index);
+	header = (struct file_index_header *)data;
+	header->strings_size = size;
+	isnt_mapped(path, data, size, "Strings past the end");
+
+	data = copy(&index);
+	header = (struct file_index_header *)data;
+	header->exclude = header->strings_size;
+	isnt_mapped(path, data, size, "Exclude rules past the strings");
+
+	data = copy(&index);
+	data[h->strings_offset + h->strings_size - 1] = 'x';
+	isnt_mapped(path, data, size, "Strings not terminated");
+
+	data = copy(&index);
+	records = (struct file_index_record *)&data[h->records_offset];
+	records[0].offset = h->strings_size;
+	isnt_mapped(path, data, size, "Record past the strings");
+
+	data = copy(&index);
+	records = (struct file_index_record *)&data[h->records_offset];
+	records[0].name_len = h->strings_size;
+	isnt_mapped(path, data, size, "Name past the strings");
+
+	data = copy(&index);
+	records = (struct file_index_record *)&data[h->records_offset];
+	records[h->total - 1].name_len |= FILE_INDEX_FOLDED;
+	isnt_mapped(path, data, size, "Folded name past the strings");
+
+	data = copy(&index);
+	dirs = (struct file_index_dir *)&data[h->dirs_offset];
+	dirs[0].path = h->strings_size;
+	isnt_mapped(path, data, size, "Directory path past the strings");
+
+	data = copy(&index);
+	dirs = (struct file_index_dir *)&data[h->dirs_offset];
+	dirs[0].parent = 0;
+	isnt_mapped(path, data, size, "Directory is its own parent");
+
+	data = copy(&index);
+	dirs = (struct file_index_dir *)&data[h->dirs_offset];
+	dirs[0].file_count = h->total + 1;
+	isnt_mapped(path, data, size, "Directory has too many files");
+
+	data = copy(&index);
+	header = (struct file_index_header *)data;
+	header->trigrams_offset++;
+	isnt_mapped(path, data, size, "Misaligned trigram table");
+
+	data = copy(&index);
+	header = (struct file_index_header *)data;
+	header->trigram_count = UINT32_MAX;
+	isnt_mapped(path, data, size, "Too many trigram lists");
+
+	data = copy(&index);
+	header = (struct file_index_header *)data;
+	header->postings_size = size;
+	isnt_mapped(path, data, size, "Postings past the end");
+
+	data = copy(&index);
+	trigrams = (struct trigram_entry *)&data[h->trigrams_offset];
+	trigrams[0].count = 0;
+	isnt_mapped(path, data, size, "Empty trigram list");
+
+	data = copy(&index);
+	trigrams = (struct trigram_entry *)&data[h->trigrams_offset];
+	trigrams[0].offset = h->postings_size;
+	isnt_mapped(path, data, size, "Trigram list past the postings");
+
+	data = copy(&index);
+	trigrams = (struct trigram_entry *)&data[h->trigrams_offset];
+	trigrams[h->trigram_count - 1].count = h->postings_size;
+	isnt_mapped(path, data, size, "Trigram list too long for the postings");
+
+	file_index_destroy(&index);
+	unlink(path);
+
+	tap_plan();
+
+	return EXIT_SUCCESS;
+}
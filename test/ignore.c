@@ -0,0 +1,101 @@
+#include <locale.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "ignore.h"
+#include "tap.h"
+
+#define BASE "/base"
+
+void is_result(
+		const char *rules,
+		const char *dir,
+		const char *name,
+		bool is_dir,
+		enum ignore_result expected,
+		const char *message)
+{
+	struct ignore *ignore = ignore_create(BASE);
+	ignore_add_list(ignore, rules);
+	enum ignore_result res = ignore_match(ignore, dir, name, is_dir);
+	ignore_destroy(ignore);
+	tap_is(res, expected, message);
+}
+
+void is_excluded(const char *rules, const char *dir, const char *name, const char *message)
+{
+	is_result(rules, dir, name, false, IGNORE_EXCLUDE, message);
+}
+
+void isnt_excluded(const char *rules, const char *dir, const char *name, const char *message)
+{
+	is_result(rules, dir, name, false, IGNORE_NO_MATCH, message);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "");
+
+	tap_version(14);
+
+	/* Plain names. */
+	is_excluded("build", BASE, "build", "Name in the base directory");
+	is_excluded("build", BASE "/a/b", "build", "Name in a subdirectory");
+	isnt_excluded("build", BASE, "rebuild", "Name is matched whole");
+	is_excluded("with\\ space\\ ", BASE, "with space ", "Escaped trailing space");
+	isnt_excluded("# build", BASE, "# build", "Comment");
+
+	/* Anchoring. */
+	is_excluded("/build", BASE, "build", "Leading slash, in the base directory");
+	isnt_excluded("/build", BASE "/a", "build", "Leading slash, in a subdirectory");
+	is_excluded("a/build", BASE "/a", "build", "Inner slash, right directory");
+	isnt_excluded("a/build", BASE "/b/a", "build", "Inner slash, nested too deep");
+	is_excluded("a/*.o", BASE "/a", "x.o", "Anchored wildcard");
+	isnt_excluded("a/*.o", BASE "/b/a", "x.o", "Anchored wildcard, nested too deep");
+	isnt_excluded("a/*.o", BASE "/a/b", "x.o", "Star doesn't match a slash");
+
+	/* Wildcards. */
+	is_excluded("*.o", BASE "/a", "main.o", "Star");
+	isnt_excluded("*.o", BASE, "main.c", "Star, wrong suffix");
+	is_excluded("?.o", BASE, "a.o", "Question mark");
+	isnt_excluded("?.o", BASE, "ab.o", "Question mark matches one character");
+
+	/* Double stars. */
+	is_excluded("**/foo", BASE, "foo", "Leading double star, no directories");
+	is_excluded("**/foo", BASE "/a/b", "foo", "Leading double star, nested");
+	isnt_excluded("**/foo", BASE, "xfoo", "Leading double star, partial name");
+	isnt_excluded("**/foo", BASE "/a", "xfoo", "Leading double star, partial name, nested");
+	is_excluded("a/**/b", BASE "/a", "b", "Inner double star, no directories");
+	is_excluded("a/**/b", BASE "/a/x/y", "b", "Inner double star, nested");
+	isnt_excluded("a/**/b", BASE "/a", "xb", "Inner double star, partial name");
+	isnt_excluded("a/**/b", BASE "/a/x", "xb", "Inner double star, partial name, nested");
+	isnt_excluded("a/**/b", BASE "/c/a", "b", "Inner double star is anchored");
+	is_excluded("a/**", BASE "/a/x", "y", "Trailing double star");
+	isnt_excluded("a/**", BASE, "a", "Trailing double star needs something inside");
+
+	/* Character classes. */
+	is_excluded("*.[oa]", BASE, "lib.a", "Class");
+	isnt_excluded("*.[oa]", BASE, "lib.so", "Class, no match");
+	is_excluded("file[0-9]", BASE, "file7", "Class range");
+	isnt_excluded("file[0-9]", BASE, "filex", "Class range, no match");
+	is_excluded("[!a]bc", BASE, "xbc", "Negated class");
+	isnt_excluded("[!a]bc", BASE, "abc", "Negated class, no match");
+	is_excluded("[]]x", BASE, "]x", "Class starting with a bracket");
+	is_excluded("[ab", BASE, "[ab", "Unterminated class is literal");
+
+	/* Directories only. */
+	is_result("cache/", BASE, "cache", true, IGNORE_EXCLUDE, "Directory rule, directory");
+	is_result("cache/", BASE, "cache", false, IGNORE_NO_MATCH, "Directory rule, file");
+	is_result("*.d/", BASE, "conf.d", true, IGNORE_EXCLUDE, "Directory wildcard, directory");
+	is_result("*.d/", BASE, "conf.d", false, IGNORE_NO_MATCH, "Directory wildcard, file");
+
+	/* Negation. */
+	is_result("*.log, !keep.log", BASE, "keep.log", false, IGNORE_INCLUDE, "Negation");
+	is_excluded("*.log, !keep.log", BASE, "other.log", "Negation of something else");
+	is_excluded("!keep.log, *.log", BASE, "keep.log", "Later rules win");
+	is_result("build, !b*", BASE, "build", false, IGNORE_INCLUDE, "Negated wildcard beats a name");
+	is_result("/a/**, !/a/**/keep", BASE "/a/x", "keep", false, IGNORE_INCLUDE, "Negated double star");
+
+	tap_plan();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+#include <locale.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "radix_sort.h"
+#include "tap.h"
+#include "xmalloc.h"
+
+static uint32_t seed = 1;
+
+/* A xorshift generator, so that every bit is random, and every run the same. */
+uint32_t next_random(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+int cmp_key(const void *a, const void *b)
+{
+	uint64_t ka = *(const uint64_t *)a;
+	uint64_t kb = *(const uint64_t *)b;
+	return (ka > kb) - (ka < kb);
+}
+
+/*
+ * Sort count keys, with the given values in their top half and their position
+ * in the bottom half, and check the result against qsort(). As the positions
+ * are unique, sorting whole keys gives the order with ties left as they were.
+ */
+void is_sorted(const uint32_t *values, size_t count, const char *message)
+{
+	uint64_t *keys = xcalloc(count + 1, sizeof(*keys));
+	uint64_t *tmp = xcalloc(count + 1, sizeof(*tmp));
+	uint64_t *expected = xcalloc(count + 1, sizeof(*expected));
+	for (size_t i = 0; i < count; i++) {
+		keys[i] = (uint64_t)values[i] << 32 | i;
+		expected[i] = keys[i];
+	}
+	qsort(expected, count, sizeof(*expected), cmp_key);
+	radix_sort(keys, tmp, count);
+	bool same = true;
+	for (size_t i = 0; same && i < count; i++) {
+		same = keys[i] == expected[i];
+	}
+	free(keys);
+	free(tmp);
+	free(expected);
+	tap_is(same, true, message);
+}
+
+/* Sort count random values, with only the bytes in mask set. */
+void is_sorted_random(size_t count, uint32_t mask, const char *message)
+{
+	uint32_t *values = xcalloc(count + 1, sizeof(*values));
+	for (size_t i = 0; i < count; i++) {
+		values[i] = next_random() & mask;
+	}
+	is_sorted(values, count, message);
+	free(values);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "");
+
+	tap_version(14);
+
+	is_sorted(NULL, 0, "No keys");
+	is_sorted((uint32_t[]){ 7 }, 1, "One key");
+	is_sorted((uint32_t[]){ 1, 2, 3, 4, 5 }, 5, "Already sorted");
+	is_sorted((uint32_t[]){ 5, 4, 3, 2, 1 }, 5, "Reversed");
+	is_sorted((uint32_t[]){ 3, 3, 3, 3 }, 4, "All equal, left in order");
+	is_sorted((uint32_t[]){ 2, 1, 2, 1, 2, 1 }, 6, "Ties left in order");
+	is_sorted((uint32_t[]){ UINT32_MAX, 0, UINT32_MAX - 1, 1 }, 4, "Extreme values");
+	is_sorted((uint32_t[]){ 0x100, 0x1, 0x10000, 0x1000000, 0 }, 5, "One bit in each byte");
+
+	/*
+	 * Passes are skipped where every key has the same byte, so try each
+	 * number of passes, which leaves the keys in either array.
+	 */
+	is_sorted_random(1000, 0x000000FF, "One pass");
+	is_sorted_random(1000, 0x0000FFFF, "Two passes");
+	is_sorted_random(1000, 0x00FF00FF, "Two passes, one skipped between");
+	is_sorted_random(1000, 0x00FFFFFF, "Three passes");
+	is_sorted_random(1000, 0xFF000000, "Only the last pass");
+	is_sorted_random(1000, 0x0000000F, "Many ties");
+	is_sorted_random(100000, 0xFFFFFFFF, "Many keys");
+
+	tap_plan();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,215 @@
+#include <locale.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tap.h"
+#include "trigram.h"
+#include "xmalloc.h"
+
+#define ABC ('a' << 16 | 'b' << 8 | 'c')
+
+/* An index laid out in memory, as it would be in the files cache. */
+struct test_index {
+	struct trigram_entry *table;
+	uint8_t *postings;
+	struct trigram_index index;
+};
+
+/* Lay out what's in builder, ignoring IDs from limit up. */
+void lay_out(struct test_index *test, struct trigram_builder *builder, uint32_t limit)
+{
+	test->index = (struct trigram_index){
+		.count = builder->count,
+		.postings_size = builder->postings_size,
+		.limit = limit
+	};
+	test->table = xcalloc(builder->count + 1, sizeof(*test->table));
+	test->postings = xcalloc(builder->postings_size + 1, 1);
+	trigram_builder_write(builder, test->table, test->postings);
+	test->index.table = test->table;
+	test->index.postings = test->postings;
+}
+
+/* Index count names, with IDs 0 to count - 1. */
+void build(struct test_index *test, const char *const *names, size_t count)
+{
+	struct trigram_builder builder;
+	trigram_builder_init(&builder);
+	for (size_t i = 0; i < count; i++) {
+		trigram_builder_add(&builder, i, names[i], strlen(names[i]));
+	}
+	lay_out(test, &builder, count);
+}
+
+/* Index a single list for "abc", with IDs that needn't start from 0. */
+void build_list(struct test_index *test, const uint32_t *ids, size_t count)
+{
+	struct trigram_builder builder;
+	trigram_builder_init(&builder);
+	for (size_t i = 0; i < count; i++) {
+		trigram_builder_add(&builder, ids[i], "abc", 3);
+	}
+	lay_out(test, &builder, UINT32_MAX);
+}
+
+/* Use a hand-written list of count IDs for "abc", which may be corrupt. */
+void build_raw(struct test_index *test, uint32_t count, const uint8_t *postings, size_t size)
+{
+	test->table = xcalloc(1, sizeof(*test->table));
+	test->table[0] = (struct trigram_entry){ .trigram = ABC, .count = count };
+	test->postings = xmalloc(size);
+	memcpy(test->postings, postings, size);
+	test->index = (struct trigram_index){
+		.count = 1,
+		.table = test->table,
+		.postings_size = size,
+		.postings = test->postings,
+		.limit = 1000
+	};
+}
+
+void destroy(struct test_index *test)
+{
+	free(test->table);
+	free(test->postings);
+}
+
+/*
+ * Check that searching for query finds exactly the count IDs in expected, in
+ * order.
+ */
+void is_found(const struct test_index *test, const char *query, const uint32_t *expected, size_t count, const char *message)
+{
+	uint32_t *ids = NULL;
+	size_t nids = 0;
+	bool same = trigram_search(&test->index, query, &ids, &nids) && nids == count;
+	for (size_t i = 0; same && i < count; i++) {
+		same = ids[i] == expected[i];
+	}
+	free(ids);
+	tap_is(same, true, message);
+}
+
+/* Check that query has no trigrams to look up. */
+void isnt_searchable(const struct test_index *test, const char *query, const char *message)
+{
+	uint32_t *ids = NULL;
+	size_t nids = 0;
+	bool res = trigram_search(&test->index, query, &ids, &nids);
+	tap_is(res, false, message);
+}
+
+int main(int argc, char *argv[])
+{
+	setlocale(LC_ALL, "");
+
+	tap_version(14);
+
+	struct test_index test;
+
+	/* Building and searching. */
+	const char *names[] = {
+		"abcd",
+		"abc",
+		"bcd",
+		"xABCDx",
+		"readme.md",
+		"read",
+		"me",
+		"abcabcabc"
+	};
+	build(&test, names, sizeof(names) / sizeof(names[0]));
+	is_found(&test, "abc", (uint32_t[]){ 0, 1, 3, 7 }, 4, "Single trigram");
+	is_found(&test, "abcd", (uint32_t[]){ 0, 3 }, 2, "Intersection of two trigrams");
+	is_found(&test, "ABCD", (uint32_t[]){ 0, 3 }, 2, "Query is lowercased");
+	is_found(&test, "cabca", (uint32_t[]){ 7 }, 1, "Repeated trigrams in a name");
+	is_found(&test, "read .md", (uint32_t[]){ 4 }, 1, "Every word must be found");
+	is_found(&test, ".md read", (uint32_t[]){ 4 }, 1, "Words in any order");
+	is_found(&test, "xyz", NULL, 0, "Missing trigram");
+	is_found(&test, "abc xyz", NULL, 0, "Missing trigram in one word");
+	isnt_searchable(&test, "ab", "Query too short");
+	isnt_searchable(&test, "ab cd", "Words too short");
+	isnt_searchable(&test, "äöü", "Non-ASCII query");
+	destroy(&test);
+
+	/* Varints. */
+	const uint32_t gaps[] = {
+		0,
+		127,
+		128,
+		16383,
+		16384,
+		2097152,
+		268435456,
+		4000000000,
+		UINT32_MAX - 1
+	};
+	size_t ngaps = sizeof(gaps) / sizeof(gaps[0]);
+	build_list(&test, gaps, ngaps);
+	is_found(&test, "abc", gaps, ngaps, "IDs of every varint length");
+	test.index.limit = 4000000000;
+	is_found(&test, "abc", gaps, ngaps - 2, "IDs past the limit are dropped");
+	destroy(&test);
+
+	build_raw(&test, 3, (uint8_t[]){ 5, 0x81, 0x01, 3 }, 4);
+	is_found(&test, "abc", (uint32_t[]){ 5, 134, 137 }, 3, "Hand-written list");
+	destroy(&test);
+
+	build_raw(&test, 3, (uint8_t[]){ 5, 0x81 }, 2);
+	is_found(&test, "abc", (uint32_t[]){ 5 }, 1, "Truncated varint");
+	destroy(&test);
+
+	build_raw(&test, 3, (uint8_t[]){ 5, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01 }, 7);
+	is_found(&test, "abc", (uint32_t[]){ 5 }, 1, "Overlong varint");
+	destroy(&test);
+
+	build_raw(&test, 3, (uint8_t[]){ 5, 0, 1 }, 3);
+	is_found(&test, "abc", (uint32_t[]){ 5 }, 1, "Repeated ID");
+	destroy(&test);
+
+	build_raw(&test, 5, (uint8_t[]){ 5, 1 }, 2);
+	is_found(&test, "abc", (uint32_t[]){ 5, 6 }, 2, "List shorter than its count");
+	destroy(&test);
+
+	build_raw(&test, 3, (uint8_t[]){ 5, 0xe7, 0x07, 1 }, 4);
+	is_found(&test, "abc", (uint32_t[]){ 5 }, 1, "ID past the number of names");
+	destroy(&test);
+
+	/*
+	 * Once a few candidates are left, much longer lists aren't decoded,
+	 * leaving some that can't match for the matcher to rule out.
+	 */
+	const char **many = xcalloc(200, sizeof(*many));
+	many[0] = "abc";
+	for (size_t i = 1; i < 200; i++) {
+		many[i] = "bcd";
+	}
+	build(&test, many, 65);
+	is_found(&test, "abcd", NULL, 0, "List up to 64 times longer is intersected");
+	destroy(&test);
+	build(&test, many, 200);
+	is_found(&test, "abcd", (uint32_t[]){ 0 }, 1, "List over 64 times longer is skipped");
+	destroy(&test);
+	free(many);
+
+	/* Names that aren't ASCII are always candidates. */
+	const char *mixed[] = {
+		"über",
+		"abc",
+		"Ärger",
+		"abcd",
+		"straße"
+	};
+	build(&test, mixed, sizeof(mixed) / sizeof(mixed[0]));
+	is_found(&test, "abc", (uint32_t[]){ 0, 1, 2, 3, 4 }, 5, "Unindexed names merged in order");
+	is_found(&test, "abcd", (uint32_t[]){ 0, 2, 3, 4 }, 4, "Unindexed names merged after intersection");
+	is_found(&test, "xyz", (uint32_t[]){ 0, 2, 4 }, 3, "Unindexed names with a missing trigram");
+	is_found(&test, "ärger", (uint32_t[]){ 0, 2, 4 }, 3, "Non-ASCII query with an ASCII trigram");
+	is_found(&test, "strasse", (uint32_t[]){ 0, 2, 4 }, 3, "Query only matching when casefolded");
+	destroy(&test);
+
+	tap_plan();
+
+	return EXIT_SUCCESS;
+}
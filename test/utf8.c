@@ -23,6 +23,7 @@ void is_match(const char *pattern, const char *str, const char *message)
 	is_single_match(MATCHING_ALGORITHM_NORMAL, pattern, str, message);
 	is_single_match(MATCHING_ALGORITHM_PREFIX, pattern, str, message);
 	is_single_match(MATCHING_ALGORITHM_FUZZY, pattern, str, message);
+	is_single_match(MATCHING_ALGORITHM_APPROX, pattern, str, message);
 }
 
 void isnt_match(const char *pattern, const char *str, const char *message)
@@ -30,6 +31,7 @@ void isnt_match(const char *pattern, const char *str, const char *message)
 	isnt_single_match(MATCHING_ALGORITHM_NORMAL, pattern, str, message);
 	isnt_single_match(MATCHING_ALGORITHM_PREFIX, pattern, str, message);
 	isnt_single_match(MATCHING_ALGORITHM_FUZZY, pattern, str, message);
+	isnt_single_match(MATCHING_ALGORITHM_APPROX, pattern, str, message);
 }
 
 int main(int argc, char *argv[])
@@ -50,6 +52,26 @@ int main(int argc, char *argv[])
 	tap_todo("Needs composed character comparison");
 	isnt_single_match(MATCHING_ALGORITHM_FUZZY, "ạ", "aọ", "Decomposed diacritics, character mismatch");
 
+	/* Long strings. */
+	char str[155];
+	str[0] = 'a';
+	memset(&str[1], 'x', 150);
+	strcpy(&str[151], "-ab");
+	tap_is(match_words(MATCHING_ALGORITHM_FUZZY, "ab", str), -122, "Best fuzzy match in a long string");
+	char repeats[1001];
+	memset(repeats, 'a', 1000);
+	repeats[1000] = '\0';
+	is_single_match(MATCHING_ALGORITHM_FUZZY, "aaaaaaaaaaaaaaaaaaaaaaaaa", repeats, "Fuzzy match with many possible alignments");
+
+	/* Typos. */
+	is_single_match(MATCHING_ALGORITHM_APPROX, "firfox", "Firefox", "Approximate match with a missing letter");
+	is_single_match(MATCHING_ALGORITHM_APPROX, "thunderbrid", "Thunderbird", "Approximate match with swapped letters");
+	is_single_match(MATCHING_ALGORITHM_APPROX, "ιβλος", "Βίβλος", "Approximate match with a non-ASCII typo");
+	isnt_single_match(MATCHING_ALGORITHM_APPROX, "fox", "fix", "Short words must match exactly");
+	isnt_single_match(MATCHING_ALGORITHM_APPROX, "fxrfx", "Firefox", "Approximate match with too many typos");
+	tap_is(match_words(MATCHING_ALGORITHM_APPROX, "firefox", "Firefix"), -100, "Approximate match score");
+	tap_is(match_words(MATCHING_ALGORITHM_APPROX, "firefox", "Firefox"), 0, "Exact match beats approximate match");
+
 	tap_plan();
 
 	return EXIT_SUCCESS;